@@ -0,0 +1,77 @@
+#ifndef BEARWASM_ARENA_H
+#define BEARWASM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <bearwasm/host.hpp>
+
+namespace bearwasm {
+
+static constexpr size_t ARENA_BLOCK_SIZE = 0x10000;
+
+/*
+ * Bump allocator handing out memory from a list of large blocks taken
+ * from frg_allocator. Single allocations are never freed, everything
+ * goes away at once when the arena is destroyed. Not thread safe.
+ */
+class Arena {
+public:
+	Arena(size_t block_size = ARENA_BLOCK_SIZE);
+	~Arena();
+
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	void *allocate(size_t size);
+
+	/* bytes held in blocks, used or not */
+	size_t get_reserved() const {
+		return reserved;
+	}
+private:
+	struct BlockHeader {
+		BlockHeader *next;
+		size_t size;
+	};
+
+	void *new_block(size_t size);
+
+	BlockHeader *blocks;
+	char *ptr;
+	char *end;
+	size_t block_size;
+	size_t reserved;
+};
+
+/*
+ * frg_allocator compatible allocator for containers that should live in
+ * an Arena. A default constructed ArenaAllocator has no arena and falls
+ * back to frg_allocator, so the same container types can be used
+ * outside of a Module.
+ */
+struct ArenaAllocator {
+	ArenaAllocator(Arena *arena = nullptr) : arena(arena) {
+	}
+
+	void *allocate(size_t size) {
+		if (!arena)
+			return frg_allocator{}.allocate(size);
+		return arena->allocate(size);
+	}
+
+	void free(void *p) {
+		if (!arena)
+			frg_allocator{}.free(p);
+	}
+
+	void deallocate(void *p, size_t n) {
+		if (!arena)
+			frg_allocator{}.deallocate(p, n);
+	}
+
+	Arena *arena;
+};
+
+} /* namespace bearwasm */
+
+#endif
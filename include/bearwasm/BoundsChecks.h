@@ -0,0 +1,35 @@
+#ifndef BEARWASM_BOUNDSCHECKS_H
+#define BEARWASM_BOUNDSCHECKS_H
+
+#include <stddef.h>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Module.h>
+
+namespace bearwasm {
+
+/* loops with more instructions than this are not copied for a guard */
+static constexpr size_t BOUNDS_MAX_LOOP_SIZE = 512;
+/* walks over a loop before the locals it writes are given up on */
+static constexpr int BOUNDS_MAX_ITERATIONS = 8;
+/* instructions the analysis of one function may visit */
+static constexpr size_t BOUNDS_MAX_STEPS = 1 << 20;
+
+/*
+ * Removes bounds checks from memory accesses once all code of a module
+ * was decoded, after inlining. A range analysis tracks every i32 as a
+ * range, or a local plus a range, through the code of a function.
+ * Addresses that are always below the initial size of memory need no
+ * check at all. For those relative to a local that a loop does not
+ * write, the loop is copied: the first copy runs without checks if one
+ * test per local before the loop passes, the second one is the
+ * original and runs otherwise. Only runs for modules decoded with
+ * TRANSLATE_BOUNDS_CHECKS, it has not shown a measurable win so far.
+ */
+class BoundsChecks {
+public:
+	static void run(Module &module);
+};
+
+} /* namespace bearwasm */
+
+#endif
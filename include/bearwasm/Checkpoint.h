@@ -0,0 +1,46 @@
+#ifndef BEARWASM_CHECKPOINT_H
+#define BEARWASM_CHECKPOINT_H
+
+#include <stdint.h>
+#include <bearwasm/host.hpp>
+#include <bearwasm/VirtualMachine.h>
+
+namespace bearwasm {
+
+static constexpr uint32_t CHECKPOINT_VERSION = 6;
+
+struct CheckpointHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t module_hash;
+	int32_t current_function;
+	int32_t pc;
+	uint32_t locals;
+	uint32_t num_functions, num_globals, num_memories;
+	uint32_t stack_size, callstack_size, labelstack_size;
+	uint64_t fuel;
+};
+
+/*
+ * Execution state of a VirtualMachine that is neither running nor
+ * blocked in a native call: pc, stacks, which hold the locals, globals
+ * and the memory pages written since init(). Restoring it into another
+ * instance of the same module, initialized the same way, continues
+ * where the saved one left off.
+ */
+class Checkpoint {
+public:
+	static bool save(VirtualMachine &vm, uint64_t module_hash,
+			DataSink *sink);
+
+	/*
+	 * Resets vm and applies the checkpoint. Returns false if it is
+	 * malformed or belongs to another module, vm is reset then.
+	 */
+	static bool restore(VirtualMachine &vm, uint64_t module_hash,
+			DataStream *stream);
+};
+
+} /* namespace bearwasm */
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef BEARWASM_EPOCH_H
+#define BEARWASM_EPOCH_H
+
+#include <stdint.h>
+#include <bearwasm/host.hpp>
+
+namespace bearwasm {
+
+/* deadline of an instance that may run forever */
+static constexpr uint64_t EPOCH_NEVER = UINT64_MAX;
+
+/*
+ * Coarse global clock for deadlines. Nothing but an EpochTimer or the
+ * embedder advances it, running instances only compare against it at
+ * loop back-edges and calls.
+ */
+extern uint64_t global_epoch;
+
+inline uint64_t current_epoch() {
+	return __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+}
+
+inline void increment_epoch() {
+	__atomic_add_fetch(&global_epoch, 1, __ATOMIC_RELAXED);
+}
+
+/* advances the epoch every interval microseconds on its own thread */
+class EpochTimer {
+public:
+	EpochTimer(uint64_t interval);
+	~EpochTimer();
+
+	EpochTimer(const EpochTimer &) = delete;
+	EpochTimer &operator=(const EpochTimer &) = delete;
+private:
+	static void timer_main(void *arg);
+
+	uint64_t interval;
+	void *thread;
+	bool stopping;
+};
+
+} /* namespace bearwasm */
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef BEARWASM_EXECUTOR_H
+#define BEARWASM_EXECUTOR_H
+
+#include <stdint.h>
+#include <frg/vector.hpp>
+#include <bearwasm/host.hpp>
+#include <bearwasm/VirtualMachine.h>
+
+namespace bearwasm {
+
+static constexpr size_t WORK_DEQUE_SIZE = 1024;
+
+/* unit of work, embedded at the start of whatever is to be run */
+struct Task {
+	void (*run)(Task *task);
+};
+
+/*
+ * Runs main of an initialized instance without a budget, done is called
+ * afterwards. A trap, the epoch deadline, running out of fuel or a
+ * blocking native end it early, vm is left as resume() returned then.
+ */
+struct Invocation : Task {
+	VirtualMachine *vm;
+	int argc;
+	char **argv;
+	ExecutionStatus status;
+	/* only valid if status is EXECUTION_FINISHED */
+	int result;
+	void (*done)(Invocation *invocation);
+};
+
+/*
+ * Chase-Lev deque. Only the owning worker pushes and takes at the
+ * bottom, any thread may steal from the top.
+ */
+class WorkDeque {
+public:
+	WorkDeque();
+
+	/* false if the deque is full */
+	bool push(Task *task);
+	Task *take();
+	Task *steal();
+private:
+	int64_t top;
+	int64_t bottom;
+	Task *tasks[WORK_DEQUE_SIZE];
+};
+
+/*
+ * Pool of worker threads running Tasks. Submitted tasks go to a shared
+ * queue, workers move batches of it into their own deque and steal
+ * from each other once they run dry. Different instances may run in
+ * parallel, a single VirtualMachine must only be in one task at a time.
+ */
+class Executor {
+public:
+	Executor(size_t num_workers);
+	/* finishes all submitted tasks first */
+	~Executor();
+
+	Executor(const Executor &) = delete;
+	Executor &operator=(const Executor &) = delete;
+
+	void submit(Task *task);
+	void submit(Invocation *invocation);
+
+	/* blocks until every task submitted so far has finished */
+	void wait_idle();
+private:
+	struct Worker {
+		Executor *executor;
+		size_t index;
+		void *thread;
+		WorkDeque deque;
+	};
+
+	static void worker_main(void *arg);
+	Task *find_task(Worker *worker);
+	Task *grab_injected(Worker *worker);
+	void lock();
+	void unlock();
+
+	frg::vector<Worker*, frg_allocator> workers;
+	/* tasks submitted but not picked up by a worker yet */
+	frg::vector<Task*, frg_allocator> injected;
+	size_t injected_head;
+	bool locked;
+	bool stopping;
+	/* bumped whenever there is new work, workers sleep on it */
+	uint32_t work_seq;
+	/* tasks submitted but not finished */
+	uint32_t outstanding;
+};
+
+} /* namespace bearwasm */
+
+#endif
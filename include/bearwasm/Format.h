@@ -2,6 +2,7 @@
 #define BEARWASM_FORMAT_H
 
 #include <bearwasm/host.hpp>
+#include <bearwasm/Arena.h>
 #include <bearwasm/BinaryFormat.h>
 #include <bearwasm/Util.h>
 
@@ -12,7 +13,13 @@ namespace bearwasm {
 
 struct Instruction;
 
-using Expression = frg::vector<Instruction, frg_allocator>;
+/*
+ * Everything a Module decodes is allocated from its Arena. The
+ * constructors take the allocator so nested containers end up in the
+ * same arena as the ones holding them.
+ */
+using String = frg::string<ArenaAllocator>;
+using Expression = frg::vector<Instruction, ArenaAllocator>;
 using MemoryType = Limit;
 using Local = BinaryType;
 
@@ -36,21 +43,34 @@ struct Value {
 };
 
 struct FunctionType {
-	frg::vector<BinaryType, frg_allocator> results, parameters;
+	FunctionType(ArenaAllocator allocator = {}) :
+		results(allocator), parameters(allocator) {
+	}
+
+	frg::vector<BinaryType, ArenaAllocator> results, parameters;
 };
 
+static constexpr uint32_t ELEMENT_NULL = UINT32_MAX;
+
 struct Table {
+	Table(ArenaAllocator allocator = {}) : data(allocator) {
+	}
+
 	TableType type;
 	Limit limit;
-	/* for now just contains a vector of
-	 * function types but that may change later */
-	frg::vector<uint32_t, frg_allocator> data;
+	/* function indices the active element segments put into the
+	 * table, ELEMENT_NULL for the rest of its initial size */
+	frg::vector<uint32_t, ArenaAllocator> data;
 };
 
 struct Code {
+	Code(ArenaAllocator allocator = {}) :
+		expression(allocator), locals(allocator) {
+	}
+
 	uint32_t size;
 	Expression expression;
-	frg::vector<Local, frg_allocator> locals;
+	frg::vector<Local, ArenaAllocator> locals;
 };
 
 struct GlobalValue {
@@ -59,24 +79,44 @@ struct GlobalValue {
 	bool mut;
 };
 
+using Globals = frg::vector<GlobalValue, ArenaAllocator>;
+
 struct Export {
-	frg::string<frg_allocator> name;
+	Export(ArenaAllocator allocator = {}) : name(allocator) {
+	}
+
+	String name;
 	int index;
 };
 
 struct Import {
-	frg::string<frg_allocator> module, name;
+	Import(ArenaAllocator allocator = {}) :
+		module(allocator), name(allocator) {
+	}
+
+	String module, name;
+	/* idx is the type of a function and the value type of a global,
+	 * tables and memories have a limit instead */
 	int description, idx;
+	Limit limit;
 };
 
 struct Exports {
-	frg::vector<Export, frg_allocator> func, table, mem, global;
+	Exports(ArenaAllocator allocator = {}) :
+		func(allocator), table(allocator), mem(allocator),
+		global(allocator) {
+	}
+
+	frg::vector<Export, ArenaAllocator> func, table, mem, global;
 };
 
 struct DataEntry {
+	DataEntry(ArenaAllocator allocator = {}) : bytes(allocator) {
+	}
+
 	int memidx;
 	int offset;
-	frg::vector<uint8_t, frg_allocator> bytes;
+	frg::vector<uint8_t, ArenaAllocator> bytes;
 };
 
 }/* namespace bearwasm */
@@ -0,0 +1,115 @@
+#ifndef BEARWASM_GUARDEDSTACK_H
+#define BEARWASM_GUARDEDSTACK_H
+
+#include <stddef.h>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+/* one host page, larger than anything pushed */
+static constexpr size_t STACK_GUARD_SIZE = 0x1000;
+
+/*
+ * Fixed size stack with an inaccessible page on either side. push()
+ * and pop() do no checks, running over either end faults in a guard
+ * page and handle_fault() turns that into TRAP_STACK_OVERFLOW.
+ */
+template<typename T>
+class GuardedStack {
+	static_assert(sizeof(T) <= STACK_GUARD_SIZE,
+			"elements have to land in the guard page");
+public:
+	/* size in bytes */
+	GuardedStack(size_t size) {
+		size = (size + STACK_GUARD_SIZE - 1) & ~(STACK_GUARD_SIZE - 1);
+		mapping_size = size + 2 * STACK_GUARD_SIZE;
+		mapping = static_cast<char*>(bearwasm_map_memory(mapping_size));
+		if (!mapping
+				|| !bearwasm_protect_memory(mapping, STACK_GUARD_SIZE)
+				|| !bearwasm_protect_memory(mapping + STACK_GUARD_SIZE
+					+ size, STACK_GUARD_SIZE))
+			panic("Unable to map %d byte stack\n",
+					static_cast<int>(mapping_size));
+		base = reinterpret_cast<T*>(mapping + STACK_GUARD_SIZE);
+		ptr = base;
+		limit = size / sizeof(T);
+	}
+
+	~GuardedStack() {
+		bearwasm_unmap_memory(mapping, mapping_size);
+	}
+
+	GuardedStack(const GuardedStack &) = delete;
+	GuardedStack &operator=(const GuardedStack &) = delete;
+
+	void push(const T &value) {
+		*ptr++ = value;
+	}
+
+	template<typename... Args>
+	void emplace(Args &&...args) {
+		*ptr++ = T(std::forward<Args>(args)...);
+	}
+
+	void pop() {
+		ptr--;
+	}
+
+	T &top() {
+		return ptr[-1];
+	}
+
+	/* from the bottom */
+	T &operator[](size_t i) {
+		return base[i];
+	}
+
+	size_t size() const {
+		return ptr - base;
+	}
+
+	bool empty() const {
+		return ptr == base;
+	}
+
+	/* elements that fit before the guard page */
+	size_t capacity() const {
+		return limit;
+	}
+
+	T *begin() {
+		return base;
+	}
+
+	T *end() {
+		return ptr;
+	}
+
+	void clear() {
+		ptr = base;
+	}
+
+	/* drops or adds elements at the top, added ones are not set */
+	void resize(size_t size) {
+		ptr = base + size;
+	}
+
+	bool is_guard(const void *address) const {
+		auto p = static_cast<const char*>(address);
+		auto first = mapping + STACK_GUARD_SIZE;
+		auto last = mapping + mapping_size - STACK_GUARD_SIZE;
+		return (p >= mapping && p < first)
+			|| (p >= last && p < mapping + mapping_size);
+	}
+private:
+	char *mapping;
+	size_t mapping_size;
+	T *base;
+	T *ptr;
+	size_t limit;
+};
+
+} /* namespace bearwasm */
+
+#endif
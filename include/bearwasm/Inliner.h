@@ -0,0 +1,29 @@
+#ifndef BEARWASM_INLINER_H
+#define BEARWASM_INLINER_H
+
+#include <stddef.h>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Module.h>
+
+namespace bearwasm {
+
+/* callees with at most this many instructions, not counting the end */
+static constexpr size_t INLINE_MAX_SIZE = 16;
+/* inlined code has its own calls inlined up to this many levels */
+static constexpr int INLINE_MAX_DEPTH = 2;
+
+/*
+ * Replaces calls to small functions by their bodies, once all code of
+ * a module was decoded. The parameters and locals of an inlined callee
+ * become locals of the caller, shared by all calls inlined at the same
+ * depth. Callees that branch to their outermost label or return are
+ * left alone, as are recursive calls.
+ */
+class Inliner {
+public:
+	static void run(Module &module);
+};
+
+} /* namespace bearwasm */
+
+#endif
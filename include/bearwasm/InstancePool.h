@@ -0,0 +1,51 @@
+#ifndef BEARWASM_INSTANCEPOOL_H
+#define BEARWASM_INSTANCEPOOL_H
+
+#include <frg/vector.hpp>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Module.h>
+#include <bearwasm/VirtualMachine.h>
+
+namespace bearwasm {
+
+/*
+ * Keeps initialized VirtualMachines of one module around so a request
+ * can start on a ready instance. Released instances are reset instead
+ * of being torn down. acquire() and release() may be called from any
+ * thread. Instances whose start function does not finish are thrown
+ * away.
+ */
+class InstancePool {
+public:
+	/* called on every new instance before init(), e.g. to
+	 * register native functions */
+	using SetupFunction = void (*)(VirtualMachine *vm);
+
+	/* takes over one reference to module */
+	InstancePool(Module *module, SetupFunction setup, size_t max_idle);
+	~InstancePool();
+
+	InstancePool(const InstancePool &) = delete;
+	InstancePool &operator=(const InstancePool &) = delete;
+
+	/* creates up to count idle instances ahead of time */
+	void prefill(size_t count);
+
+	/* nullptr if the start function of a new instance did not finish */
+	VirtualMachine *acquire();
+	void release(VirtualMachine *vm);
+private:
+	VirtualMachine *create();
+	void lock();
+	void unlock();
+
+	Module *module;
+	SetupFunction setup;
+	size_t max_idle;
+	bool locked;
+	frg::vector<VirtualMachine*, frg_allocator> idle;
+};
+
+} /* namespace bearwasm */
+
+#endif
@@ -1,23 +1,43 @@
 #ifndef BEARWASM_INTERPRETER_H
 #define BEARWASM_INTERPRETER_H
 
+#include <string.h>
 #include <frg/vector.hpp>
-#include <frg/stack.hpp>
 #include <frg/optional.hpp>
 #include <frg/string.hpp>
 #include <bearwasm/host.hpp>
 #include <bearwasm/Format.h>
+#include <bearwasm/Epoch.h>
+#include <bearwasm/GuardedStack.h>
+#include <bearwasm/Trap.h>
+#include <bearwasm/NativeFunction.h>
 
 namespace bearwasm {
 
 static constexpr int PC_END = -1;
 static constexpr int STACK_SIZE = 0x400000;
+static constexpr int CALL_STACK_SIZE = 0x100000;
+static constexpr int LABEL_STACK_SIZE = 0x100000;
+/* budget for interpret() that never suspends, also the default fuel */
+static constexpr uint64_t BUDGET_UNLIMITED = UINT64_MAX;
+
+enum ExecutionStatus {
+	EXECUTION_FINISHED,
+	/* out of budget, interpret() again with the same state to resume */
+	EXECUTION_SUSPENDED,
+	/* the same, but it can only resume after more fuel was added */
+	EXECUTION_OUT_OF_FUEL,
+	/* the epoch deadline passed, resumes after it was moved */
+	EXECUTION_INTERRUPTED,
+	/* a native function waits for something, see block_call() */
+	EXECUTION_BLOCKED,
+	/* state.trap says why, the state can only be reset */
+	EXECUTION_TRAPPED,
+};
 
 struct InterpreterState;
 struct Instruction;
 
-using NativeHandler = int (*)(InterpreterState *state);
-
 struct MemArg {
 	uint32_t align, offset;
 };
@@ -27,9 +47,20 @@ struct Block {
 	BinaryType type;
 };
 
-struct LocalInstance {
-	Local type;
-	Value value;
+/* call_indirect sites a module may have, site has 24 bits */
+static constexpr uint32_t MAX_INDIRECT_CALLS = 1 << 24;
+
+/* the type is canonical, see Module::type_ids */
+struct IndirectCall {
+	uint32_t type;
+	uint32_t site : 24;
+	uint32_t table : 8;
+};
+
+/* the last table slot a call_indirect site used and what it held */
+struct IndirectCache {
+	uint32_t slot;
+	int function;
 };
 
 enum InstanceType {
@@ -39,56 +70,209 @@ enum InstanceType {
 
 struct FunctionInstance {
 	InstanceType type;
-	NativeHandler native_handler;
-	FunctionType signature;
-	Expression expression;
-	frg::vector<LocalInstance, frg_allocator> locals;
-	frg::string<frg_allocator> name;
+	NativeFunction native;
+	/* point into the Module, only signature is set for natives */
+	const FunctionType *signature;
+	/* Module::type_ids of the signature */
+	uint32_t type_id;
+	const Expression *expression;
+	const String *name;
 	int size;
 };
 
+/*
+ * What a call needs to know about its target, one per function of an
+ * instance so calls do not have to look at the FunctionInstance.
+ * expression is nullptr for natives.
+ */
+struct Callee {
+	const Expression *expression;
+	uint32_t num_params;
+	/* parameters and declared locals */
+	uint32_t frame_size;
+	uint32_t num_results;
+};
+
+/*
+ * A guest buffer resolved to host memory. Laid out like a POSIX struct
+ * iovec so arrays of them can go to readv/writev as they are.
+ */
+struct GuestBuffer {
+	void *base;
+	size_t length;
+};
+
+/* granularity of dirty tracking, matches the host page size */
+static constexpr size_t DIRTY_PAGE_SIZE = 0x1000;
+
+/* part of an image mapped over linear memory by map_range() */
+struct MappedRange {
+	uint32_t address;
+	size_t size;
+	void *image;
+	size_t offset;
+	bool writable;
+};
+
+/*
+ * Linear memory, mapped through the host. Every write through copy()
+ * and store() marks the pages it touches so reset() only has to undo
+ * what was actually written.
+ */
 class MemoryInstance {
 public:
-	MemoryInstance(int size) {
-		resize(size);
-	}
+	MemoryInstance(int size);
+	/* copy-on-write mapping of size pages of a snapshot image */
+	MemoryInstance(int size, void *image, size_t image_offset);
+	/*
+	 * size pages at base that belong to the embedder, or to another
+	 * instance that exports them. They have to stay mapped while this
+	 * exists, can not grow and reset() leaves them alone.
+	 */
+	MemoryInstance(char *base, int size);
+	MemoryInstance(MemoryInstance &&other);
+	~MemoryInstance();
+
+	MemoryInstance(const MemoryInstance &) = delete;
+	MemoryInstance &operator=(const MemoryInstance &) = delete;
 
-	void resize(int new_size) {
-		bytes.resize(new_size * PAGE_SIZE);
-		size = new_size * PAGE_SIZE;
+	void resize(int new_size);
+
+	/* whether resize() to new_size pages would succeed */
+	bool can_resize(uint32_t new_size) const {
+		auto new_bytes = static_cast<size_t>(new_size) * PAGE_SIZE;
+		if (!owned)
+			return new_bytes == static_cast<size_t>(size);
+		return new_bytes <= capacity || !ranges.size();
 	}
 
-	void copy(char *data, int num, int pos) {
-		for (int i = 0; i < num; i++)
-			bytes[pos + i] = data[i];
+	void copy(const char *data, size_t num, size_t pos) {
+		memcpy(bytes + pos, data, num);
+		mark_dirty(pos, num);
 	}
 
 	int get_size() const {
 		return size;
 	}
 
+	/* for n bytes at address + offset, computed without wrapping */
+	bool in_bounds(uint32_t address, uint32_t offset, size_t n) const {
+		return static_cast<uint64_t>(address) + offset + n
+			<= static_cast<uint64_t>(size);
+	}
+
 	template<typename T>
 	void store(T value, int pos) {
-		auto data = reinterpret_cast<char*>(&value);
-		for (size_t i = 0; i < sizeof(T); i++)
-			bytes[pos + i] = data[i];
+		memcpy(bytes + pos, &value, sizeof(T));
+		mark_dirty(pos, sizeof(T));
 	}
 
 	template<typename T>
 	T load(int pos) {
 		T ret;
-		auto data = reinterpret_cast<char*>(&ret);
-		for (size_t i = 0; i < sizeof(T); i++)
-			data[i] = bytes[pos + i];
+		memcpy(&ret, bytes + pos, sizeof(T));
 		return ret;
 	}
 
+	/* writes done through this pointer have to be reported
+	 * with mark_dirty() */
 	char *data() {
-		return bytes.data();
+		return bytes;
+	}
+
+	bool contains(const void *address) const {
+		auto p = static_cast<const char*>(address);
+		return p >= bytes && p < bytes + capacity;
 	}
+
+	/*
+	 * Places size bytes of image at offset into memory at address,
+	 * e.g. a file the embedder opened with bearwasm_open_image,
+	 * without copying it. Guest
+	 * writes trap unless it is writable, then they are copy-on-write
+	 * and reset() brings back the image contents. address and offset
+	 * have to be page aligned and the range inside of memory. Memory
+	 * with mapped ranges can only grow within its capacity and does
+	 * not shrink below them.
+	 */
+	bool map_range(uint32_t address, size_t size, void *image,
+			size_t offset, bool writable);
+
+	/*
+	 * Views for host functions, checked once when they are made and
+	 * nullptr if any part is outside of memory. They stay valid until
+	 * the memory grows or is reset.
+	 */
+	const char *view(uint32_t address, uint32_t size) const {
+		if (!in_bounds(address, 0, size))
+			return nullptr;
+		return bytes + address;
+	}
+
+	/* the range counts as written from here on */
+	char *writable_view(uint32_t address, uint32_t size) {
+		if (!in_bounds(address, 0, size) || read_only(address, size))
+			return nullptr;
+		mark_dirty(address, size);
+		return bytes + address;
+	}
+
+	/* a NUL terminated string, length does not include the NUL */
+	const char *string_view(uint32_t address, size_t &length) const;
+
+	/*
+	 * Resolves count wasm iovecs (pairs of 32 bit address and length)
+	 * at iovs into buffers. Fails if the array or any buffer is out of
+	 * bounds, writable marks all buffers as written.
+	 */
+	bool gather(uint32_t iovs, uint32_t count, GuestBuffer *buffers,
+			bool writable);
+
+	size_t num_dirty_pages() const {
+		return (size + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE;
+	}
+
+	bool is_dirty(size_t page) const {
+		return dirty[page / 64] & (static_cast<uint64_t>(1) << (page % 64));
+	}
+
+	/* the current contents become the ones reset() goes back to */
+	void clear_dirty() {
+		for (size_t i = 0; i < dirty.size(); i++)
+			dirty[i] = 0;
+	}
+
+	void mark_dirty(size_t pos, size_t num) {
+		if (!num)
+			return;
+		auto last = (pos + num - 1) / DIRTY_PAGE_SIZE;
+		for (auto page = pos / DIRTY_PAGE_SIZE; page <= last; page++)
+			dirty[page / 64] |= static_cast<uint64_t>(1) << (page % 64);
+	}
+
+	/*
+	 * Shrinks back to the initial size, or the end of the last mapped
+	 * range, zeroes every dirty page and writes the parts of segments
+	 * that fall into them again. Memory mapped from an image goes back
+	 * to the image contents instead.
+	 */
+	void reset(const frg::vector<DataEntry, ArenaAllocator> &segments,
+			int memidx);
 private:
+	void map_image();
+	void map_ranges();
+	bool read_only(uint32_t address, size_t size) const;
+
 	int size;
-	frg::vector<char, frg_allocator> bytes;
+	int initial_size;
+	size_t capacity;
+	char *bytes;
+	void *image;
+	size_t image_offset;
+	/* false for memory from the embedder */
+	bool owned;
+	frg::vector<uint64_t, frg_allocator> dirty;
+	frg::vector<MappedRange, frg_allocator> ranges;
 };
 
 struct TableInstance {
@@ -100,28 +284,88 @@ struct Frame {
 	int pc;
 	int labelstack_size;
 	int prev;
-	const Expression *prev_expr;
+	/* state.locals of prev */
+	uint32_t locals;
 };
 
 struct Label {
-	int pc_cont, pc_end;
+	int pc_cont;
+	/* branches to a loop keep its label, it continues after the loop */
+	bool loop;
 };
 
 
 struct InterpreterState {
-	InterpreterState() : pc(0) {}
+	InterpreterState() : stack(STACK_SIZE), callstack(CALL_STACK_SIZE),
+		labelstack(LABEL_STACK_SIZE), pc(0), locals(0),
+		fuel(BUDGET_UNLIMITED), epoch_deadline(EPOCH_NEVER),
+		trap(TRAP_NONE), blocked(false), has_call_result(false),
+		unblocked(nullptr),
+		unblocked_data(nullptr), host_data(nullptr) {}
 	frg::vector<FunctionInstance, frg_allocator> functions;
+	/* indexed like functions */
+	frg::vector<Callee, frg_allocator> callees;
 	frg::vector<MemoryInstance, frg_allocator> memory;
 	frg::vector<TableInstance, frg_allocator> tables;
-	frg::vector<GlobalValue, frg_allocator> globals;
-	frg::stack<Value, frg_allocator> stack;
-	frg::stack<Frame, frg_allocator> callstack;
-	frg::stack<Label, frg_allocator> labelstack;
+	/* one per call_indirect, tables do not change while running */
+	frg::vector<IndirectCache, frg_allocator> indirect_caches;
+	Globals globals;
+	GuardedStack<Value> stack;
+	GuardedStack<Frame> callstack;
+	GuardedStack<Label> labelstack;
 
 	int current_function;
 	int pc;
+	/* the locals of current_function live on the value stack from
+	 * here, the arguments of a call become its first ones */
+	uint32_t locals;
+	/* instructions left to run, across resumes */
+	uint64_t fuel;
+	/* interrupted at the next loop or call once the epoch reaches it */
+	uint64_t epoch_deadline;
+	TrapKind trap;
+	/* the last native call has not finished yet */
+	bool blocked;
+	/* from finish_call(), replaces what the native returned on resume */
+	bool has_call_result;
+	Value call_result;
+	/* called by finish_call() with unblocked_data, if set */
+	void (*unblocked)(void *data);
+	void *unblocked_data;
+	/* whatever the embedder wants its native functions to see */
+	void *host_data;
 };
 
+/*
+ * For native functions that started an operation the guest has to wait
+ * for, e.g. I/O. Once the native returned, interpret() leaves with
+ * EXECUTION_BLOCKED and keeps doing so until the embedder called
+ * finish_call(), from the same thread or after synchronizing with the
+ * one that resumes. The value the native returned is a placeholder.
+ * A native that hands the operation to another thread has to block the
+ * call before that thread can finish it.
+ */
+inline void block_call(InterpreterState *state) {
+	__atomic_store_n(&state->blocked, true, __ATOMIC_RELAXED);
+}
+
+/* finishes a blocked call of a native without results */
+inline void finish_call(InterpreterState *state) {
+	__atomic_store_n(&state->blocked, false, __ATOMIC_RELEASE);
+	if (state->unblocked)
+		state->unblocked(state->unblocked_data);
+}
+
+/*
+ * Finishes a blocked call, result replaces what the native returned.
+ * That may not be on the stack yet if another thread finishes it.
+ */
+inline void finish_call(InterpreterState *state, Value result) {
+	state->call_result = result;
+	state->has_call_result = true;
+	finish_call(state);
+}
+
 struct ASMInterpreterState {
 	char *stack;
 	uint32_t pc;
@@ -138,7 +382,10 @@ struct ASMInterpreterState {
 };
 
 struct Instruction {
-	uint64_t type;
+	uint32_t type;
+	/* instructions in the basic block this one ends, 0 if it does not
+	 * end one. Charged against fuel when the block is done. */
+	uint32_t cost;
 	union {
 		uint8_t uint8_val;
 		uint32_t uint32_val;
@@ -149,18 +396,33 @@ struct Instruction {
 		double double_val;
 		Block block;
 		MemArg memarg;
+		IndirectCall indirect;
 	} arg;
 };
 
 class Interpreter {
 public:
-	static bool interpret(InterpreterState &state);
-	static frg::optional<GlobalValue> interpret_global(
-			DataStream *stream);
-	static frg::optional<uint32_t> interpret_offset(
-			DataStream *stream);
-	static frg::vector<Instruction, frg_allocator> decode_code(DataStream
-            *stream);
+	/*
+	 * Runs until the function on the bottom frame returns, budget
+	 * instructions have executed or state.fuel ran out. Both are
+	 * charged a basic block at a time, at the branch, call or block
+	 * instruction that ends it, so a slice can overrun by the rest of
+	 * one block. Every slice runs at least one block. Loop back-edges
+	 * and calls also stop once the epoch deadline has passed.
+	 * Traps, explicit or from a fault, return EXECUTION_TRAPPED.
+	 */
+	static ExecutionStatus interpret(InterpreterState &state,
+			uint64_t budget = BUDGET_UNLIMITED);
+	static frg::optional<GlobalValue> interpret_global(DataStream *stream,
+			const Globals &globals);
+	static frg::optional<uint32_t> interpret_offset(DataStream *stream,
+			const Globals &globals);
+	static void decode_code(DataStream *stream, Expression &out);
+	/* what decode_code() does at the end, again for changed code:
+	 * the sizes of blocks and the length of each basic block on
+	 * the instruction ending it */
+	static void assign_block_sizes(Expression &out);
+	static void assign_costs(Expression &out);
 };
 
 }/* namespace bearwasm*/
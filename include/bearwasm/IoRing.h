@@ -0,0 +1,128 @@
+#ifndef BEARWASM_IORING_H
+#define BEARWASM_IORING_H
+
+#include <stdint.h>
+#include <bearwasm/VirtualMachine.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace bearwasm {
+
+static constexpr unsigned DEFAULT_RING_ENTRIES = 256;
+
+enum IoOperation {
+	IO_READ,
+	IO_WRITE,
+	/* does nothing, fd and buffers are not used */
+	IO_NOP,
+};
+
+/*
+ * A readv or writev on fd. buffers have the layout of struct iovec and
+ * stay valid, like the request itself, until done is called.
+ */
+struct IoRequest {
+	IoOperation operation;
+	int fd;
+	const GuestBuffer *buffers;
+	uint32_t count;
+	/* -1 for the current file position */
+	int64_t offset;
+	/* bytes transferred, -errno on failure */
+	void (*done)(IoRequest *request, int32_t result);
+};
+
+/*
+ * io_uring, through the raw system calls. Requests are only queued by
+ * submit(), complete() hands all of them to the kernel at once and
+ * reaps what finished, so one thread can keep many of them in flight.
+ * Any thread may submit, only one at a time may complete. While it
+ * waits in the kernel, submit() hands requests over by itself.
+ */
+class IoRing {
+public:
+	IoRing(unsigned entries = DEFAULT_RING_ENTRIES);
+	~IoRing();
+
+	IoRing(const IoRing &) = delete;
+	IoRing &operator=(const IoRing &) = delete;
+
+	/* false if the kernel has no io_uring or does not allow it */
+	bool valid() {
+		return ring_fd >= 0;
+	}
+
+	/* false if the ring is full, the caller has to do it itself */
+	bool submit(IoRequest *request);
+
+	/*
+	 * Submits what was queued, waits for at least wait_for requests
+	 * to finish and calls done for every one that did. Returns how
+	 * many that were. Requests submitted meanwhile count as well, so
+	 * it may wait for more than are in flight when it is called.
+	 */
+	unsigned complete(unsigned wait_for);
+
+	/* only exact on the thread that completes, if nobody submits */
+	unsigned in_flight() {
+		return __atomic_load_n(&pending, __ATOMIC_RELAXED)
+			+ __atomic_load_n(&submitted, __ATOMIC_RELAXED);
+	}
+private:
+	void release();
+	void lock();
+	void unlock();
+	void enter(unsigned wait_for);
+
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	io_uring_cqe *cqes;
+
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	uint32_t cq_entries;
+	/* queued by submit() and handed to the kernel but not done */
+	unsigned pending, submitted;
+	/* held while touching the submission queue and the counts */
+	bool locked;
+	/* complete() sleeps in the kernel */
+	bool waiting;
+};
+
+/*
+ * Completes the requests of a ring on a thread of its own, for green
+ * threads of a Scheduler. Natives that wait for the ring, like WASI
+ * reads and writes with WasiContext::set_ring(), block their green
+ * thread, the scheduler parks it and finish_call() from the completion
+ * puts it back into the executor's queue. Their natives must not block
+ * on anything else.
+ */
+class IoWorker {
+public:
+	IoWorker(IoRing *ring);
+	/* waits for what is in flight, submit nothing after the call */
+	~IoWorker();
+
+	IoWorker(const IoWorker &) = delete;
+	IoWorker &operator=(const IoWorker &) = delete;
+private:
+	/* wakes the thread from the kernel, it stops once this is done */
+	struct StopRequest : IoRequest {
+		bool finished;
+	};
+
+	static void worker_main(void *arg);
+	static void stop_done(IoRequest *request, int32_t result);
+
+	IoRing *ring;
+	void *thread;
+	StopRequest stop;
+};
+
+} /* namespace bearwasm */
+
+#endif
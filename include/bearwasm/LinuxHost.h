@@ -0,0 +1,21 @@
+#ifndef BEARWASM_LINUXHOST_H
+#define BEARWASM_LINUXHOST_H
+
+/*
+ * LinuxHost.cpp implements everything host.hpp asks for on Linux, for
+ * the bearwasm binary and the runtime tests alike.
+ */
+
+/* passes faults of guest code on to bearwasm::handle_fault */
+void bearwasm_install_fault_handlers();
+
+/*
+ * An image handle for MemoryInstance::map_range around a file the
+ * embedder opened, or nullptr. It keeps its own duplicate of fd and
+ * has to outlive every memory it is mapped into, since reset() maps
+ * it again. Release it with bearwasm_destroy_image. Accesses past the
+ * end of the file trap.
+ */
+void *bearwasm_open_image(int fd);
+
+#endif
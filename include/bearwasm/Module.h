@@ -12,22 +12,54 @@
 
 namespace bearwasm {
 
-using FunctionTypes = frg::vector<FunctionType, frg_allocator>;
-using Functions = frg::vector<uint32_t, frg_allocator>;
-using Tables = frg::vector<Table, frg_allocator>;
-using MemoryTypes = frg::vector<MemoryType, frg_allocator>;
-using Globals = frg::vector<GlobalValue, frg_allocator>;
-using FunctionCodes = frg::vector<Code, frg_allocator>;
-using FunctionNames = frg::hash_map<uint32_t, frg::string<frg_allocator>,
-      frg::hash<int>, frg_allocator>;
-using Data = frg::vector<DataEntry, frg_allocator>;
-using Imports = frg::vector<Import, frg_allocator>;
+using FunctionTypes = frg::vector<FunctionType, ArenaAllocator>;
+using Functions = frg::vector<uint32_t, ArenaAllocator>;
+using Tables = frg::vector<Table, ArenaAllocator>;
+using MemoryTypes = frg::vector<MemoryType, ArenaAllocator>;
+using FunctionCodes = frg::vector<Code, ArenaAllocator>;
+using FunctionNames = frg::hash_map<uint32_t, String,
+      frg::hash<int>, ArenaAllocator>;
+using Data = frg::vector<DataEntry, ArenaAllocator>;
+using Imports = frg::vector<Import, ArenaAllocator>;
+
+/* locals one function may declare, a few bytes of code entry could
+ * otherwise ask for gigabytes */
+static constexpr uint32_t MAX_LOCALS = 50000;
+
+/* passes translate_code() only runs when asked to */
+enum TranslateFlags : uint32_t {
+	/* see BoundsChecks.h */
+	TRANSLATE_BOUNDS_CHECKS = 1,
+};
 
 class Module {
+	friend class StreamingDecoder;
+	friend class ModuleCache;
+
+	/* has to come first, all the containers below allocate from it */
+	Arena arena;
+	ArenaAllocator allocator;
 public:
-	Module(DataStream *stream);
+	/* translate_flags is a combination of TranslateFlags */
+	Module(DataStream *stream, uint32_t translate_flags = 0);
+
+	/*
+	 * A decoded module never changes and is shared by every
+	 * VirtualMachine running it, possibly on different threads.
+	 * Whoever creates it holds the first reference.
+	 */
+	void retain();
+	void release();
+
+	/* bytes of decoded module data */
+	size_t get_memory_usage() const {
+		return arena.get_reserved();
+	}
 
 	FunctionTypes function_types;
+	/* for every function type the index of the first one that is
+	 * equal to it, so comparing signatures compares two integers */
+	frg::vector<uint32_t, ArenaAllocator> type_ids;
 	Functions functions;
 	Tables tables;
 	MemoryTypes memory_types;
@@ -37,19 +69,35 @@ public:
 	FunctionNames function_names;
 	Data data;
 	Imports imports;
+	/* function run by VirtualMachine::init(), -1 if there is none */
+	int32_t start_function;
+	/* call_indirect instructions, each has its own inline cache */
+	uint32_t num_indirect_calls;
 private:
+	/* empty module, filled in by StreamingDecoder or ModuleCache */
+	Module();
+	/* use release() */
+	~Module() = default;
+
 	void read_sections();
+	void parse_section(uint8_t id, uint32_t length);
 	void parse_type_section();
+	void assign_type_ids();
 	void parse_function_section();
 	void parse_table_section();
 	void parse_memory_section();
 	void parse_global_section();
 	void parse_export_section();
+	void parse_start_section();
 	void parse_code_section();
+	void parse_code_entry(Code &code);
+	void parse_element_section();
 	void parse_data_section();
 	void parse_import_section();
-	void parse_custom_section(int length);
+	void parse_custom_section(uint32_t length);
 	bool verify_signature();
+	/* the passes over all code once it is decoded */
+	void translate_code();
 	
 	void dump_function_types();
 	void dump_functions();
@@ -61,6 +109,8 @@ private:
 	void dump_imports();
 
 	DataStream *stream;
+	uint32_t translate_flags;
+	unsigned int refcount;
 };
 
 } /* namespace bearwasm */
@@ -0,0 +1,56 @@
+#ifndef BEARWASM_MODULECACHE_H
+#define BEARWASM_MODULECACHE_H
+
+#include <stdint.h>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Module.h>
+
+namespace bearwasm {
+
+static constexpr uint32_t CACHE_VERSION = 7;
+static constexpr uint64_t CACHE_HASH_SEED = 0xcbf29ce484222325;
+
+/* location of an array inside the cache image, relative to its start */
+struct CacheBlob {
+	uint32_t offset, count;
+};
+
+struct CacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t module_hash;
+	uint32_t instruction_size;
+	int32_t start_function;
+	uint32_t num_indirect_calls;
+	CacheBlob function_types, functions, tables, memory_types, globals,
+		  exports, function_code, function_names, data, imports;
+};
+
+/*
+ * Serialized form of an already decoded Module. The image contains no
+ * pointers, only offsets from its start, so it can be mmap'd and
+ * loaded without running the decoder or the passes after it again.
+ * load() copies every array out of the image into the module's arena
+ * with one memcpy each, the image may go away once it returned.
+ */
+class ModuleCache {
+public:
+	/* FNV-1a, chain calls by passing the previous result as seed */
+	static uint64_t hash(const char *data, size_t size,
+			uint64_t seed = CACHE_HASH_SEED);
+
+	static bool write(Module &module, uint64_t module_hash,
+			DataSink *sink);
+
+	/*
+	 * Returns nullptr if the image is malformed, was written by a
+	 * different version or belongs to another module. The module
+	 * does not point into data.
+	 */
+	static Module *load(const char *data, size_t size,
+			uint64_t module_hash);
+};
+
+} /* namespace bearwasm */
+
+#endif
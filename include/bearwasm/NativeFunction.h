@@ -0,0 +1,146 @@
+#ifndef BEARWASM_NATIVEFUNCTION_H
+#define BEARWASM_NATIVEFUNCTION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+#include <bearwasm/BinaryFormat.h>
+#include <bearwasm/Format.h>
+
+namespace bearwasm {
+
+struct InterpreterState;
+
+/* the C++ types host functions can take and return, and their wasm types */
+template<typename T>
+struct NativeType;
+
+template<>
+struct NativeType<void> {
+	static constexpr BinaryType type = EMPTY;
+};
+
+template<>
+struct NativeType<int32_t> {
+	static constexpr BinaryType type = I_32;
+	static int32_t from(const Value &value) { return value.int32_val; }
+};
+
+template<>
+struct NativeType<uint32_t> {
+	static constexpr BinaryType type = I_32;
+	static uint32_t from(const Value &value) { return value.uint32_val; }
+};
+
+template<>
+struct NativeType<int64_t> {
+	static constexpr BinaryType type = I_64;
+	static int64_t from(const Value &value) { return value.int64_val; }
+};
+
+template<>
+struct NativeType<uint64_t> {
+	static constexpr BinaryType type = I_64;
+	static uint64_t from(const Value &value) { return value.uint64_val; }
+};
+
+template<>
+struct NativeType<float> {
+	static constexpr BinaryType type = F_32;
+	static float from(const Value &value) { return value.float_val; }
+};
+
+template<>
+struct NativeType<double> {
+	static constexpr BinaryType type = F_64;
+	static double from(const Value &value) { return value.double_val; }
+};
+
+using GenericFunction = void (*)();
+
+/*
+ * Calls function with the arguments that start at args, the top of the
+ * value stack, and leaves the result (if any) in args[0].
+ */
+using NativeThunk = void (*)(GenericFunction function,
+		InterpreterState *state, Value *args);
+
+/* a host function and what the thunk generated for it expects */
+struct NativeFunction {
+	NativeThunk thunk;
+	GenericFunction function;
+	const BinaryType *parameters;
+	size_t num_parameters;
+	BinaryType result;
+	size_t num_results;
+};
+
+template<bool WithState, typename R, typename... Args>
+struct NativeBinding {
+	static constexpr BinaryType parameters[] = {
+		NativeType<Args>::type..., EMPTY
+	};
+
+	template<size_t... I>
+	static R call(GenericFunction function, InterpreterState *state,
+			Value *args, std::index_sequence<I...>) {
+		if constexpr (WithState) {
+			return reinterpret_cast<R (*)(InterpreterState*, Args...)>(
+					function)(state, NativeType<Args>::from(args[I])...);
+		} else {
+			(void)state;
+			return reinterpret_cast<R (*)(Args...)>(function)(
+					NativeType<Args>::from(args[I])...);
+		}
+	}
+
+	static void thunk(GenericFunction function, InterpreterState *state,
+			Value *args) {
+		if constexpr (std::is_void<R>::value)
+			call(function, state, args, std::index_sequence_for<Args...>{});
+		else
+			args[0] = Value{call(function, state, args,
+					std::index_sequence_for<Args...>{})};
+	}
+
+	static NativeFunction make(GenericFunction function) {
+		return NativeFunction{thunk, function, parameters,
+			sizeof...(Args), NativeType<R>::type,
+			std::is_void<R>::value ? 0u : 1u};
+	}
+};
+
+/* functions that want to reach memory take the state first, it is
+ * not a wasm parameter */
+template<typename Signature>
+struct NativeSignature;
+
+template<typename R, typename... Args>
+struct NativeSignature<R(Args...)> : NativeBinding<false, R, Args...> { };
+
+template<typename R, typename... Args>
+struct NativeSignature<R(InterpreterState*, Args...)>
+	: NativeBinding<true, R, Args...> { };
+
+template<typename Signature>
+NativeFunction make_native_function(Signature *function) {
+	return NativeSignature<Signature>::make(
+			reinterpret_cast<GenericFunction>(function));
+}
+
+/* whether native can be called through an import of type type */
+inline bool native_matches(const NativeFunction &native,
+		const FunctionType &type) {
+	if (type.parameters.size() != native.num_parameters
+			|| type.results.size() != native.num_results)
+		return false;
+	for (size_t i = 0; i < native.num_parameters; i++)
+		if (type.parameters[i] != native.parameters[i])
+			return false;
+	return !native.num_results || type.results[0] == native.result;
+}
+
+} /* namespace bearwasm */
+
+#endif
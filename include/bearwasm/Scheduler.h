@@ -0,0 +1,60 @@
+#ifndef BEARWASM_SCHEDULER_H
+#define BEARWASM_SCHEDULER_H
+
+#include <stdint.h>
+#include <bearwasm/Executor.h>
+
+namespace bearwasm {
+
+/* instructions an instance may run before it has to yield */
+static constexpr uint64_t DEFAULT_TIME_SLICE = 0x10000;
+
+class Scheduler;
+
+/* main of an initialized instance, run one time slice at a time */
+struct GreenThread : Task {
+	Scheduler *scheduler;
+	VirtualMachine *vm;
+	int argc;
+	char **argv;
+	/* result is only valid if it finished, not ran out of fuel */
+	ExecutionStatus status;
+	int result;
+	/* slices it took to finish */
+	uint64_t slices;
+	void (*done)(GreenThread *thread);
+	/* whether it waits for a blocked call, see Scheduler */
+	uint32_t wait_state;
+};
+
+/*
+ * Cooperative scheduler on top of an Executor. Each green thread runs
+ * for one time slice, then goes to the back of the executor's queue,
+ * so a long running instance can not starve the others and thousands
+ * of them share the executor's few workers. One that leaves a slice
+ * with EXECUTION_BLOCKED is parked until finish_call() is called for
+ * it, e.g. by an IoWorker, then it goes back into the queue.
+ */
+class Scheduler {
+public:
+	Scheduler(Executor *executor, uint64_t time_slice = DEFAULT_TIME_SLICE);
+
+	/* sets up main right away, done is called from a worker thread */
+	void spawn(GreenThread *thread);
+
+	/* blocks until every spawned thread has finished, parked or not */
+	void wait_idle();
+private:
+	static void run_slice(Task *task);
+	static void unblocked(void *data);
+	void finished(GreenThread *thread);
+
+	Executor *executor;
+	uint64_t time_slice;
+	/* spawned but not done yet */
+	uint32_t live;
+};
+
+} /* namespace bearwasm */
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef BEARWASM_SNAPSHOT_H
+#define BEARWASM_SNAPSHOT_H
+
+#include <frg/vector.hpp>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Interpreter.h>
+#include <bearwasm/Module.h>
+
+namespace bearwasm {
+
+class VirtualMachine;
+
+/*
+ * Linear memory, globals and tables of an initialized instance. The
+ * memories are written to a host memory image once, new instances map
+ * it copy-on-write through VirtualMachine::init(Snapshot*) and skip
+ * data segments and the start function.
+ */
+class Snapshot {
+	friend class VirtualMachine;
+public:
+	/* vm has to be initialized and not running */
+	Snapshot(VirtualMachine &vm);
+
+	Snapshot(const Snapshot &) = delete;
+	Snapshot &operator=(const Snapshot &) = delete;
+
+	/* shared like Module, whoever creates it holds the first
+	 * reference */
+	void retain();
+	void release();
+
+	Module *get_module() {
+		return module;
+	}
+private:
+	~Snapshot();
+
+	struct MemoryImage {
+		size_t offset;
+		int pages;
+	};
+
+	Module *module;
+	void *image;
+	frg::vector<MemoryImage, frg_allocator> memories;
+	Globals globals;
+	frg::vector<TableInstance, frg_allocator> tables;
+	unsigned int refcount;
+};
+
+} /* namespace bearwasm */
+
+#endif
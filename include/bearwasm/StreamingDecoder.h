@@ -0,0 +1,59 @@
+#ifndef BEARWASM_STREAMINGDECODER_H
+#define BEARWASM_STREAMINGDECODER_H
+
+#include <frg/vector.hpp>
+#include <frg/optional.hpp>
+#include <bearwasm/host.hpp>
+#include <bearwasm/Module.h>
+
+namespace bearwasm {
+
+/*
+ * Push-style module loader. The embedder hands over the binary in
+ * chunks as they arrive and every section is parsed as soon as all of
+ * its bytes are there. The code section is not waited for as a whole,
+ * each function body is decoded as soon as it is complete, so decoding
+ * overlaps with reading the rest of the file.
+ */
+class StreamingDecoder {
+public:
+	/* translate_flags as for Module */
+	StreamingDecoder(uint32_t translate_flags = 0);
+	~StreamingDecoder();
+
+	void feed(const char *data, size_t size);
+
+	/*
+	 * Signals the end of the binary and returns the parsed module.
+	 * The caller holds the only reference to the module.
+	 */
+	Module *finish();
+private:
+	enum DecoderState {
+		DECODE_HEADER,
+		DECODE_SECTION_HEADER,
+		DECODE_SECTION,
+		DECODE_CODE_COUNT,
+		DECODE_CODE_ENTRY,
+	};
+
+	bool step();
+	frg::optional<uint32_t> peek_varuint(size_t &length);
+
+	size_t available() const {
+		return buffer.size() - consumed;
+	}
+
+	frg::vector<char, frg_allocator> buffer;
+	size_t consumed;
+
+	Module *module;
+	DecoderState decoder_state;
+	uint8_t section_id;
+	uint32_t section_length;
+	uint32_t code_entries_left;
+};
+
+} /* namespace bearwasm */
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef BEARWASM_TRAP_H
+#define BEARWASM_TRAP_H
+
+#include <bearwasm/host.hpp>
+
+namespace bearwasm {
+
+enum TrapKind {
+	TRAP_NONE,
+	TRAP_UNREACHABLE,
+	TRAP_OUT_OF_BOUNDS,
+	TRAP_DIVIDE_BY_ZERO,
+	TRAP_INTEGER_OVERFLOW,
+	TRAP_STACK_OVERFLOW,
+	/* call_indirect past the end of the table */
+	TRAP_UNDEFINED_ELEMENT,
+	TRAP_UNINITIALIZED_ELEMENT,
+	TRAP_INDIRECT_CALL_MISMATCH,
+	/* not an error, the program asked to exit, e.g. WASI proc_exit */
+	TRAP_EXIT,
+};
+
+struct InterpreterState;
+
+/* one per running interpret(), the host keeps the innermost per thread */
+struct TrapContext {
+	void *jump_buffer[5];
+	InterpreterState *state;
+	TrapContext *prev;
+};
+
+const char *trap_name(TrapKind kind);
+
+/*
+ * For the host's memory fault handlers, with the address that was
+ * accessed. If it belongs to the instance running in interpret() on
+ * this thread it unwinds out of it and does not return, interpret()
+ * then returns EXECUTION_TRAPPED. Otherwise it returns and the host
+ * should treat the fault as a crash.
+ */
+void handle_fault(void *address);
+
+/*
+ * For host functions, e.g. when they are handed a bad guest pointer.
+ * Unwinds out of the interpret() that called them.
+ */
+[[noreturn]] void raise_trap(TrapKind kind);
+
+} /* namespace bearwasm */
+
+#endif
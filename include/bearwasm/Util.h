@@ -5,6 +5,7 @@
 #include <type_traits>
 #include <utility>
 #include <bearwasm/host.hpp>
+#include <bearwasm/Arena.h>
 #include <bearwasm/libc.h>
 #include <frg/optional.hpp>
 #include <frg/string.hpp>
@@ -57,6 +58,24 @@ static inline void log_warn(const char *msg, ...) {
 
 using Limit = frg::tuple<uint32_t, uint32_t>;
 
+/*
+ * DataStream over a buffer that is already in memory. The buffer
+ * is not copied and has to outlive the stream.
+ */
+class MemoryStream : public DataStream {
+public:
+	MemoryStream(const char *data, size_t size);
+
+	frg::optional<char> get() override;
+	bool read(char *buf, size_t size) override;
+	int seek(long pos, SeekType type) override;
+	long tell() override;
+private:
+	const char *data;
+	size_t size;
+	size_t pos;
+};
+
 template<typename T>
 frg::optional<T> stream_read(DataStream *stream) {
 	T ret;
@@ -66,6 +85,11 @@ frg::optional<T> stream_read(DataStream *stream) {
 	return ret;
 }
 
+template<typename T>
+bool stream_write(DataSink *sink, const T &value) {
+	return sink->write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
 template<typename T>
 frg::optional<T> decode_varuint(DataStream *stream) {
 	static_assert(std::is_unsigned<T>::value);
@@ -74,9 +98,9 @@ frg::optional<T> decode_varuint(DataStream *stream) {
 	int shift = 0;
 	while (true) {
 		auto c = stream->get();
-		if (!c)
+		if (!c || shift >= static_cast<int>(sizeof(T) * 8))
 			return frg::null_opt;
-		ret |= (*c & 0x7f) << shift;
+		ret |= static_cast<T>(*c & 0x7f) << shift;
 		if (!(*c & 0x80))
 			break;
 		shift += 7;
@@ -89,30 +113,31 @@ template<typename T>
 frg::optional<T> decode_varint(DataStream *stream) {
 	static_assert(std::is_signed<T>::value);
 
-	T ret = 0;
+	using U = std::make_unsigned_t<T>;
+	U ret = 0;
 	int shift = 0;
 	int size = sizeof(T) * 8;
 	frg::optional<char> c;
 
 	do {
 		c = stream->get();
-		if (!c)
+		if (!c || shift >= size)
 			return frg::null_opt;
-		ret |= (*c & 0x7f) << shift;
+		ret |= static_cast<U>(*c & 0x7f) << shift;
 		shift += 7;
-		/* TODO: check if we dont go over max amount of bits */
 	} while (*c & 0x80);
-	
+
 	if ((shift < size) && (*c & 0x40)) {
-		ret |= -(1 << shift);
+		ret |= ~static_cast<U>(0) << shift;
 	}
 
-	return ret;
+	return static_cast<T>(ret);
 }
 
 extern frg::optional<Limit> decode_limit(DataStream *stream);
 
-extern frg::optional<frg::string<frg_allocator>> read_string(DataStream *stream);
+extern frg::optional<frg::string<ArenaAllocator>> read_string(
+		DataStream *stream, ArenaAllocator allocator = {});
 
 } /* namespace bearwasm */
 
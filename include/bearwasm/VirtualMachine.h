@@ -7,33 +7,148 @@
 #include <bearwasm/host.hpp>
 #include <bearwasm/Interpreter.h>
 #include <bearwasm/Module.h>
+#include <bearwasm/Snapshot.h>
 
 extern "C" int vm_enter(void *state);
 
 namespace bearwasm {
 
 class VirtualMachine {
+	friend class Snapshot;
+	friend class Checkpoint;
 public:
 	VirtualMachine(DataStream *stream);
-	void init();
+	/* takes over one reference to a module built elsewhere, e.g.
+	 * by a StreamingDecoder. Call module->retain() first to run
+	 * several instances of the same module. */
+	VirtualMachine(Module *module);
+	~VirtualMachine();
+	/*
+	 * Instantiates the module and runs its start function. Anything
+	 * but EXECUTION_FINISHED means start did not run to its end, e.g.
+	 * get_trap() says why it trapped, and the instance is unusable.
+	 */
+	ExecutionStatus init();
+	/* instantiates from a snapshot of the same module, retains it */
+	void init(Snapshot *snapshot);
 
-	void register_handler(const frg::string<frg_allocator> &name,
-            NativeHandler handler);
+	/*
+	 * Brings an initialized instance back to the state right after
+	 * init(). Only memory pages written since the data segments were
+	 * copied in are touched, the start function runs again on them
+	 * unless the instance came from a snapshot. Returns what init()
+	 * would.
+	 */
+	ExecutionStatus reset();
+
+	Module *get_module() {
+		return module;
+	}
+
+	/*
+	 * Makes function available as import module.name, module is env
+	 * if not given. Signature is a plain function type like
+	 * int32_t(int32_t, int64_t), optionally taking an
+	 * InterpreterState* first. The types are checked against the
+	 * import in init().
+	 */
+	template<typename Signature>
+	void register_function(const char *module, const char *name,
+			Signature *function) {
+		register_native(module, name, make_native_function(function));
+	}
+	template<typename Signature>
+	void register_function(const char *name, Signature *function) {
+		register_function("env", name, function);
+	}
+	void register_native(const char *module, const char *name,
+			const NativeFunction &native);
+
+	/*
+	 * Backs the memory import module.name with pages pages at base,
+	 * see MemoryInstance(char*, int). To share memory between
+	 * instances pass what get_memory() of the exporting one returned,
+	 * its reset() does not know about writes made through the import.
+	 */
+	void register_memory(const char *module, const char *name,
+			char *base, int pages);
+	void register_memory(const char *module, const char *name,
+			MemoryInstance &memory);
+
+	/* exported memory, nullptr if there is none called name */
+	MemoryInstance *get_memory(const char *name);
+
+	/* handed to native functions as state->host_data */
+	void set_host_data(void *data);
+
+	/*
+	 * finish_call() calls handler with data, on whichever thread the
+	 * blocked call finishes. Lets a scheduler run the instance again.
+	 */
+	void set_unblocked_handler(void (*handler)(void *data), void *data);
+
+	/* start() and resume() without a budget, get_result() if finished */
+	ExecutionStatus execute(int argc, char **argv);
+
+	/*
+	 * Sets up a call to main without running any of it. resume() then
+	 * runs it in slices of at most budget instructions, get_result()
+	 * is valid once it returned EXECUTION_FINISHED.
+	 */
+	void start(int argc, char **argv);
+	/* index of an exported function, -1 if there is none */
+	int find_function(const char *name);
+	/* like start(), the parameters of the function start out as 0 */
+	void start_function(int index);
+	ExecutionStatus resume(uint64_t budget);
+	int get_result();
+
+	/*
+	 * Instructions this instance may still run, unlimited after init()
+	 * and reset(). resume() returns EXECUTION_OUT_OF_FUEL when it is
+	 * used up, it can continue once more was set.
+	 */
+	void set_fuel(uint64_t fuel);
+	uint64_t get_fuel();
+
+	/*
+	 * resume() returns EXECUTION_INTERRUPTED at the first loop or call
+	 * once the epoch advanced by ticks from now. Has to be set before
+	 * resume(), never expires after init() and reset().
+	 */
+	void set_epoch_deadline(uint64_t ticks);
+
+	/* why resume() returned EXECUTION_TRAPPED, reset() before reuse */
+	TrapKind get_trap();
 
-	int execute(int argc, char **argv);
 	int execute_asm(int argc, char **argv);
 private:
 	void build_import_instances();
 	void build_function_instances();
+	void build_table_instances();
 	void build_memory_instances();
 	void build_data_instances();
+	void reset_state();
+	void reset_stacks();
+	ExecutionStatus run_start();
+	void clear_dirty();
 
 	InterpreterState state;
 	ASMInterpreterState *asm_state;
-	Module module;
+	Module *module;
+	Snapshot *snapshot;
+	/* what reset() restores, from the module or the snapshot */
+	Globals initial_globals;
+	frg::hash_map<frg::string<frg_allocator>,
+        NativeFunction, frg::hash<frg::string<frg_allocator>>,
+        frg_allocator> natives;
+	struct BorrowedMemory {
+		char *base;
+		int pages;
+	};
 	frg::hash_map<frg::string<frg_allocator>,
-        NativeHandler, frg::hash<frg::string<frg_allocator>>,
-        frg_allocator> handlers;
+        BorrowedMemory, frg::hash<frg::string<frg_allocator>>,
+        frg_allocator> memories;
 };
 
 } /* namespace bearwasm */
@@ -0,0 +1,87 @@
+#ifndef BEARWASM_WASI_H
+#define BEARWASM_WASI_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <bearwasm/VirtualMachine.h>
+#include <bearwasm/IoRing.h>
+
+namespace bearwasm {
+
+static constexpr size_t WASI_STDOUT_BUFFER_SIZE = 0x10000;
+/* iovecs a single fd_read or fd_write may pass */
+static constexpr uint32_t WASI_MAX_IOVS = 1024;
+
+/*
+ * Host side of the wasi_snapshot_preview1 imports for one instance,
+ * on top of POSIX. Guest iovecs go to readv/writev as they are and
+ * small writes to stdout are collected until the buffer fills up, the
+ * guest reads, exits or the context is destroyed.
+ */
+class WasiContext {
+	friend struct WasiCalls;
+public:
+	WasiContext(std::vector<std::string> args,
+			std::vector<std::string> environment);
+	~WasiContext();
+
+	WasiContext(const WasiContext &) = delete;
+	WasiContext &operator=(const WasiContext &) = delete;
+
+	/*
+	 * Lets the guest open files below the host directory path, it sees
+	 * it as guest_path. Paths that are absolute or contain .. are
+	 * refused, and so are symlinks, except ones in the middle of a path
+	 * that stay below path.
+	 */
+	bool preopen(const char *path, const char *guest_path);
+
+	/* registers the imports and makes vm use this context, before init() */
+	void attach(VirtualMachine &vm);
+
+	/*
+	 * Sends fd_read and fd_write through ring instead of blocking in
+	 * them, the guest is suspended with EXECUTION_BLOCKED meanwhile.
+	 * Writes that fit the stdout buffer still go there. An IoWorker
+	 * completes them for instances run by a Scheduler.
+	 */
+	void set_ring(IoRing *ring) {
+		this->ring = ring;
+	}
+
+	void flush();
+
+	/* what the guest passed to proc_exit */
+	int get_exit_code() {
+		return exit_code;
+	}
+private:
+	struct Fd {
+		int host_fd;
+		/* guest name of a preopened directory, empty otherwise */
+		std::string preopen;
+	};
+
+	/* the one fd_read or fd_write a suspended guest waits for */
+	struct PendingIo : IoRequest {
+		InterpreterState *state;
+		uint32_t result_address;
+		GuestBuffer iovs[WASI_MAX_IOVS];
+	};
+
+	Fd *get_fd(int32_t fd);
+
+	std::vector<std::string> args;
+	std::vector<std::string> environment;
+	std::vector<Fd> fds;
+	char stdout_buffer[WASI_STDOUT_BUFFER_SIZE];
+	size_t stdout_size;
+	IoRing *ring;
+	PendingIo pending_io;
+	int exit_code;
+};
+
+} /* namespace bearwasm */
+
+#endif
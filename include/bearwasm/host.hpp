@@ -1,6 +1,7 @@
 #ifndef BEARWASM_HOST_HPP
 #define BEARWASM_HOST_HPP
 
+#include <stdint.h>
 #include <frg/optional.hpp>
 
 struct frg_allocator {
@@ -14,6 +15,63 @@ struct frg_allocator {
 extern void bearwasm_log(int level, const char *str);
 extern void bearwasm_abort();
 
+/*
+ * Page granular memory for linear memories. map returns zeroed memory
+ * or nullptr, discard gives the pages back to the host and has to make
+ * them read as they did when they were mapped: zero, or the contents
+ * of the image for bearwasm_map_image. Addresses and sizes are
+ * multiples of the host page size.
+ */
+extern void *bearwasm_map_memory(size_t size);
+extern void bearwasm_unmap_memory(void *p, size_t size);
+extern void bearwasm_discard_memory(void *p, size_t size);
+/* makes mapped pages fault on any access, for guard pages */
+extern bool bearwasm_protect_memory(void *p, size_t size);
+
+/*
+ * Memory images back snapshots, e.g. with a memfd. create returns an
+ * opaque handle to a zero filled image of size bytes or nullptr.
+ * map_image maps part of it copy-on-write, so pages stay shared until
+ * they are written. Unmap those mappings with bearwasm_unmap_memory,
+ * they may outlive the image itself.
+ */
+extern void *bearwasm_create_image(size_t size);
+extern bool bearwasm_write_image(void *image, size_t offset,
+		const void *data, size_t size);
+extern void *bearwasm_map_image(void *image, size_t offset, size_t size);
+/*
+ * Replaces the pages at address, which are part of a memory mapping,
+ * with size bytes of image at offset. Copy-on-write if writable, read
+ * only otherwise. Embedders may pass their own handles here, e.g. for
+ * a file they opened, to place it into linear memory. On Linux that
+ * is what bearwasm_open_image makes.
+ */
+extern bool bearwasm_map_image_at(void *address, void *image,
+		size_t offset, size_t size, bool writable);
+extern void bearwasm_destroy_image(void *image);
+
+/*
+ * Threads for the Executor. spawn returns an opaque handle or nullptr.
+ * wait sleeps as long as *addr == expected and may return spuriously,
+ * wake wakes up to count threads sleeping on addr.
+ */
+extern void *bearwasm_spawn_thread(void (*function)(void *arg), void *arg);
+extern void bearwasm_join_thread(void *thread);
+extern void bearwasm_wait(uint32_t *addr, uint32_t expected);
+extern void bearwasm_wake(uint32_t *addr, uint32_t count);
+
+/* for the EpochTimer, may return early */
+extern void bearwasm_sleep(uint64_t microseconds);
+
+/*
+ * A per-thread pointer for the innermost bearwasm::TrapContext. The
+ * host also has to pass SIGSEGV and SIGBUS (or what it has instead)
+ * to bearwasm::handle_fault, with signals that are not blocked while
+ * the handler runs since it may never return.
+ */
+extern void *bearwasm_get_trap_context();
+extern void bearwasm_set_trap_context(void *context);
+
 namespace bearwasm {
 
 enum log_level {
@@ -53,5 +111,15 @@ public:
     virtual long tell() = 0;
 };
 
+class DataSink {
+public:
+    /*
+     * Write size bytes from buf to the sink.
+     * Returns true upon success, false when not all
+     * bytes could be written.
+     */
+    virtual bool write(const char *buf, size_t size) = 0;
+};
+
 } /* namespace bearwasm */
 #endif
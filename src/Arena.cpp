@@ -0,0 +1,55 @@
+#include <bearwasm/Arena.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+static constexpr size_t ARENA_ALIGN = alignof(max_align_t);
+
+static size_t align_up(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+Arena::Arena(size_t block_size) :
+	blocks(nullptr), ptr(nullptr), end(nullptr), block_size(block_size),
+	reserved(0) {
+}
+
+Arena::~Arena() {
+	while (blocks) {
+		auto next = blocks->next;
+		frg_allocator{}.deallocate(blocks, blocks->size);
+		blocks = next;
+	}
+}
+
+/* allocates a block with room for size bytes and returns its start */
+void *Arena::new_block(size_t size) {
+	size += align_up(sizeof(BlockHeader));
+	auto block = static_cast<BlockHeader*>(frg_allocator{}.allocate(size));
+	if (!block)
+		panic("Out of memory allocating arena block\n");
+	block->next = blocks;
+	block->size = size;
+	blocks = block;
+	reserved += size;
+	return reinterpret_cast<char*>(block) + align_up(sizeof(BlockHeader));
+}
+
+void *Arena::allocate(size_t size) {
+	size = align_up(size ? size : 1);
+
+	/* big allocations get their own block so the tail of
+	 * the current one is not thrown away */
+	if (size > block_size / 4)
+		return new_block(size);
+
+	if (static_cast<size_t>(end - ptr) < size) {
+		ptr = static_cast<char*>(new_block(block_size));
+		end = ptr + block_size;
+	}
+	auto ret = ptr;
+	ptr += size;
+	return ret;
+}
+
+} /* namespace bearwasm */
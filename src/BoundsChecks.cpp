@@ -0,0 +1,1089 @@
+#include <bearwasm/BoundsChecks.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+static constexpr uint32_t NO_LOCAL = UINT32_MAX;
+
+/* base + k for some k in [lo, hi] that does not wrap, base is a local
+ * as it is at that point or 0 for NO_LOCAL */
+struct Range {
+	uint32_t base;
+	uint32_t lo, hi;
+};
+
+static constexpr Range RANGE_ANY = {NO_LOCAL, 0, UINT32_MAX};
+
+enum Relation : uint8_t {
+	REL_EQ,
+	REL_NE,
+	REL_LT,
+	REL_GE,
+	REL_GT,
+	REL_LE,
+};
+
+/* what is known about local when a branch on the value is taken */
+struct Condition {
+	uint32_t local;
+	Relation relation;
+	bool is_signed;
+	uint32_t constant;
+};
+
+struct AbstractValue {
+	Range range;
+	/* the local it was read from, as long as that is not written */
+	uint32_t origin;
+	/* local is NO_LOCAL if nothing is known */
+	Condition condition;
+};
+
+struct AbstractState {
+	frg::vector<Range, frg_allocator> locals;
+	frg::vector<AbstractValue, frg_allocator> stack;
+	bool reachable;
+};
+
+/* a block, loop or if the walk is in */
+struct Control {
+	bool loop;
+	size_t height;
+	uint32_t arity;
+	/* the states of all branches to it, joined */
+	AbstractState target;
+};
+
+enum AccessKind : uint8_t {
+	ACCESS_CHECKED,
+	ACCESS_STATIC,
+	ACCESS_HOISTED,
+};
+
+/* the result of the last walk over a load or store */
+struct Access {
+	AccessKind kind;
+	/* for hoisted ones, the address is below base + extent */
+	uint32_t base;
+	uint64_t extent;
+	/* and the loop that checks it */
+	size_t loop;
+};
+
+/* a test before a copied loop, one per base local */
+struct Guard {
+	size_t loop;
+	uint32_t base;
+	uint64_t extent;
+};
+
+struct Analysis {
+	Analysis(const Module &module, const Expression &code)
+		: module(module), code(code) {}
+
+	const Module &module;
+	const Expression &code;
+	/* type of every function, the imported ones first */
+	const frg::vector<uint32_t, frg_allocator> *function_types;
+	uint64_t min_bytes;
+	/* all indexed by instruction */
+	frg::vector<Access, frg_allocator> accesses;
+	frg::vector<size_t, frg_allocator> ends;
+	frg::vector<uint8_t, frg_allocator> hosts;
+	frg::vector<Guard, frg_allocator> guards;
+	frg::vector<Control*, frg_allocator> controls;
+	size_t steps;
+	bool failed;
+};
+
+struct Emission {
+	frg::vector<Instruction, frg_allocator> code;
+	/* open labels, true for the ifs around copied loops */
+	frg::vector<uint8_t, frg_allocator> wrappers;
+	/* copied loops being emitted without their checks */
+	frg::vector<size_t, frg_allocator> unchecked;
+	int removed;
+	int hoisted;
+};
+
+static AbstractValue make_value(Range range) {
+	AbstractValue value;
+	value.range = range;
+	value.origin = NO_LOCAL;
+	value.condition.local = NO_LOCAL;
+	return value;
+}
+
+static bool is_constant(Range range) {
+	return range.base == NO_LOCAL && range.lo == range.hi;
+}
+
+static bool is_any(Range range) {
+	return range.base == NO_LOCAL && !range.lo && range.hi == UINT32_MAX;
+}
+
+static Range join(Range a, Range b) {
+	if (a.base != b.base)
+		return RANGE_ANY;
+	return {a.base, a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi};
+}
+
+static bool includes(Range outer, Range inner) {
+	if (is_any(outer))
+		return true;
+	return outer.base == inner.base && outer.lo <= inner.lo
+		&& inner.hi <= outer.hi;
+}
+
+static Range make_range(uint32_t base, uint64_t lo, uint64_t hi) {
+	if (hi > UINT32_MAX)
+		return RANGE_ANY;
+	return {base, static_cast<uint32_t>(lo), static_cast<uint32_t>(hi)};
+}
+
+static void copy_state(AbstractState &to, const AbstractState &from) {
+	to.locals.resize(from.locals.size());
+	for (size_t i = 0; i < from.locals.size(); i++)
+		to.locals[i] = from.locals[i];
+	to.stack.resize(from.stack.size());
+	for (size_t i = 0; i < from.stack.size(); i++)
+		to.stack[i] = from.stack[i];
+	to.reachable = from.reachable;
+}
+
+static bool same_condition(const Condition &a, const Condition &b) {
+	if (a.local == NO_LOCAL || b.local == NO_LOCAL)
+		return a.local == b.local;
+	return a.local == b.local && a.relation == b.relation
+		&& a.is_signed == b.is_signed && a.constant == b.constant;
+}
+
+static AbstractValue join(const AbstractValue &a, const AbstractValue &b) {
+	auto value = make_value(join(a.range, b.range));
+	if (a.origin == b.origin)
+		value.origin = a.origin;
+	if (same_condition(a.condition, b.condition))
+		value.condition = a.condition;
+	return value;
+}
+
+/* both stacks have to be as high, see set_results() */
+static void join_into(AbstractState &to, const AbstractState &from) {
+	if (!from.reachable)
+		return;
+	if (!to.reachable) {
+		copy_state(to, from);
+		return;
+	}
+	for (size_t i = 0; i < to.locals.size(); i++)
+		to.locals[i] = join(to.locals[i], from.locals[i]);
+	for (size_t i = 0; i < to.stack.size(); i++)
+		to.stack[i] = i < from.stack.size()
+			? join(to.stack[i], from.stack[i])
+			: make_value(RANGE_ANY);
+}
+
+static AbstractValue pop(AbstractState &state) {
+	if (state.stack.empty())
+		return make_value(RANGE_ANY);
+	auto value = state.stack[state.stack.size() - 1];
+	state.stack.resize(state.stack.size() - 1);
+	return value;
+}
+
+static void set_height(AbstractState &state, size_t height) {
+	while (state.stack.size() > height)
+		state.stack.resize(state.stack.size() - 1);
+	while (state.stack.size() < height)
+		state.stack.push(make_value(RANGE_ANY));
+}
+
+/* moves the top arity values down to height, where a block leaves them */
+static void set_results(AbstractState &state, size_t height,
+		uint32_t arity) {
+	if (state.stack.size() < height + arity) {
+		set_height(state, height);
+		set_height(state, height + arity);
+		return;
+	}
+	auto from = state.stack.size() - arity;
+	for (uint32_t i = 0; i < arity; i++)
+		state.stack[height + i] = state.stack[from + i];
+	set_height(state, height + arity);
+}
+
+/* a local nothing is known about is at least equal to itself */
+static Range read_local(const AbstractState &state, uint32_t idx) {
+	auto range = state.locals[idx];
+	if (is_any(range))
+		return {idx, 0, 0};
+	return range;
+}
+
+/* forgets everything that depends on the old value of idx */
+static void invalidate(AbstractState &state, uint32_t idx) {
+	for (auto &local : state.locals)
+		if (local.base == idx)
+			local = RANGE_ANY;
+	for (auto &value : state.stack) {
+		if (value.range.base == idx)
+			value.range = RANGE_ANY;
+		if (value.origin == idx)
+			value.origin = NO_LOCAL;
+		if (value.condition.local == idx)
+			value.condition.local = NO_LOCAL;
+	}
+}
+
+static void write_local(AbstractState &state, uint32_t idx, Range range) {
+	invalidate(state, idx);
+	state.locals[idx] = range.base == idx ? RANGE_ANY : range;
+}
+
+static Relation negate(Relation relation) {
+	switch (relation) {
+		case REL_EQ: return REL_NE;
+		case REL_NE: return REL_EQ;
+		case REL_LT: return REL_GE;
+		case REL_GE: return REL_LT;
+		case REL_GT: return REL_LE;
+		default: return REL_GT;
+	}
+}
+
+/* for constant relation value, turned around */
+static Relation flip(Relation relation) {
+	switch (relation) {
+		case REL_LT: return REL_GT;
+		case REL_GT: return REL_LT;
+		case REL_LE: return REL_GE;
+		case REL_GE: return REL_LE;
+		default: return relation;
+	}
+}
+
+/* false if no value in range satisfies it */
+static bool refine(Range &range, Relation relation, bool is_signed,
+		uint32_t c) {
+	uint64_t lo = range.lo, hi = range.hi;
+	switch (relation) {
+		case REL_EQ:
+			lo = lo > c ? lo : c;
+			hi = hi < c ? hi : c;
+			break;
+		case REL_NE:
+			if (lo == c)
+				lo++;
+			if (hi == c)
+				hi = hi ? hi - 1 : 0;
+			if (range.lo == c && range.hi == c)
+				return false;
+			break;
+		default:
+			break;
+	}
+
+	if (relation != REL_EQ && relation != REL_NE) {
+		uint64_t min = 0, max = UINT32_MAX;
+		if (is_signed) {
+			/* only constants that split the positive half */
+			if (c > INT32_MAX)
+				return true;
+			if (relation == REL_LT || relation == REL_LE) {
+				if (hi > INT32_MAX)
+					return true;
+			} else {
+				max = INT32_MAX;
+			}
+		}
+		switch (relation) {
+			case REL_LT:
+				if (!c)
+					return false;
+				max = c - 1;
+				break;
+			case REL_LE:
+				max = c;
+				break;
+			case REL_GT:
+				min = static_cast<uint64_t>(c) + 1;
+				break;
+			default:
+				min = c;
+				break;
+		}
+		lo = lo > min ? lo : min;
+		hi = hi < max ? hi : max;
+	}
+
+	if (lo > hi)
+		return false;
+	range.lo = lo;
+	range.hi = hi;
+	return true;
+}
+
+/* whether the edge with condition can be taken at all */
+static bool apply(AbstractState &state, const Condition &condition,
+		bool taken) {
+	if (condition.local == NO_LOCAL)
+		return true;
+	auto &local = state.locals[condition.local];
+	if (local.base != NO_LOCAL)
+		return true;
+	return refine(local, taken ? condition.relation
+			: negate(condition.relation),
+			condition.is_signed, condition.constant);
+}
+
+static Condition condition_of(const AbstractValue &value) {
+	if (value.condition.local != NO_LOCAL)
+		return value.condition;
+	Condition condition;
+	condition.local = value.origin;
+	condition.relation = REL_NE;
+	condition.is_signed = false;
+	condition.constant = 0;
+	return condition;
+}
+
+/* splits state into the taken and not taken edges of value */
+static void branch_on(const AbstractValue &value, AbstractState &taken,
+		AbstractState &not_taken) {
+	auto condition = condition_of(value);
+	if (is_constant(value.range)) {
+		if (value.range.lo)
+			not_taken.reachable = false;
+		else
+			taken.reachable = false;
+	}
+	if (!apply(taken, condition, true))
+		taken.reachable = false;
+	if (!apply(not_taken, condition, false))
+		not_taken.reachable = false;
+}
+
+static Range arithmetic(uint32_t type, Range a, Range b) {
+	bool a_plain = a.base == NO_LOCAL, b_plain = b.base == NO_LOCAL;
+	switch (type) {
+		case I_32_ADD:
+			if (!a_plain && !b_plain)
+				return RANGE_ANY;
+			return make_range(a_plain ? b.base : a.base,
+					static_cast<uint64_t>(a.lo) + b.lo,
+					static_cast<uint64_t>(a.hi) + b.hi);
+		case I_32_SUB:
+			if (!is_constant(b) || a.lo < b.lo)
+				return RANGE_ANY;
+			return {a.base, a.lo - b.lo, a.hi - b.lo};
+		case I_32_MUL:
+			if (!a_plain || !b_plain)
+				return RANGE_ANY;
+			return make_range(NO_LOCAL,
+					static_cast<uint64_t>(a.lo) * b.lo,
+					static_cast<uint64_t>(a.hi) * b.hi);
+		case I_32_SHL:
+			if (!a_plain || !is_constant(b) || b.lo >= 32)
+				return RANGE_ANY;
+			return make_range(NO_LOCAL,
+					static_cast<uint64_t>(a.lo) << b.lo,
+					static_cast<uint64_t>(a.hi) << b.lo);
+		case I_32_SHR_S:
+			if (!a_plain || a.hi > INT32_MAX || !is_constant(b)
+					|| b.lo >= 32)
+				return RANGE_ANY;
+			return {NO_LOCAL, a.lo >> b.lo, a.hi >> b.lo};
+		case I_32_AND:
+			if (a_plain && b_plain)
+				return {NO_LOCAL, 0, a.hi < b.hi ? a.hi : b.hi};
+			if (a_plain || b_plain)
+				return {NO_LOCAL, 0, a_plain ? a.hi : b.hi};
+			return RANGE_ANY;
+		case I_32_OR:
+			if (!a_plain || !b_plain)
+				return RANGE_ANY;
+			return make_range(NO_LOCAL, a.lo > b.lo ? a.lo : b.lo,
+					static_cast<uint64_t>(a.hi) + b.hi);
+		case I_32_DIV_S:
+			if (!a_plain || a.hi > INT32_MAX || !is_constant(b)
+					|| !b.lo || b.lo > INT32_MAX)
+				return RANGE_ANY;
+			return {NO_LOCAL, a.lo / b.lo, a.hi / b.lo};
+		case I_32_REM_S:
+			if (!a_plain || a.hi > INT32_MAX || !is_constant(b)
+					|| !b.lo || b.lo > INT32_MAX)
+				return RANGE_ANY;
+			return {NO_LOCAL, 0, a.hi < b.lo - 1 ? a.hi : b.lo - 1};
+		default:
+			return RANGE_ANY;
+	}
+}
+
+static bool relation_of(uint32_t type, Relation &relation, bool &is_signed) {
+	is_signed = false;
+	switch (type) {
+		case I_32_EQ: relation = REL_EQ; return true;
+		case I_32_NE: relation = REL_NE; return true;
+		case I_32_LT_U: relation = REL_LT; return true;
+		case I_32_GT_U: relation = REL_GT; return true;
+		case I_32_LE_U: relation = REL_LE; return true;
+		default: break;
+	}
+	is_signed = true;
+	switch (type) {
+		case I_32_LT_S: relation = REL_LT; return true;
+		case I_32_GT_S: relation = REL_GT; return true;
+		case I_32_LE_S: relation = REL_LE; return true;
+		default: return false;
+	}
+}
+
+static uint32_t block_arity(const Instruction &inst) {
+	return inst.arg.block.type == EMPTY ? 0 : 1;
+}
+
+/* branches to a loop carry no values, to anything else its results */
+static void branch(Analysis &ctx, const AbstractState &state, uint32_t depth) {
+	if (depth >= ctx.controls.size() || !state.reachable)
+		return;
+	auto control = ctx.controls[ctx.controls.size() - 1 - depth];
+	AbstractState edge;
+	copy_state(edge, state);
+	set_results(edge, control->height, control->loop ? 0 : control->arity);
+	join_into(control->target, edge);
+}
+
+static const FunctionType *type_of_call(const Analysis &ctx,
+		const Instruction &inst) {
+	uint32_t type;
+	if (inst.type == INSTR_CALL) {
+		auto &types = *ctx.function_types;
+		if (inst.arg.uint32_val >= types.size())
+			return nullptr;
+		type = types[inst.arg.uint32_val];
+	} else {
+		type = inst.arg.indirect.type;
+	}
+	if (type >= ctx.module.function_types.size())
+		return nullptr;
+	return &ctx.module.function_types[type];
+}
+
+static void record_access(Analysis &ctx, size_t pos,
+		const AbstractState &state, Range address, uint32_t size) {
+	auto &access = ctx.accesses[pos];
+	access.kind = ACCESS_CHECKED;
+	if (!state.reachable)
+		return;
+	auto extent = static_cast<uint64_t>(address.hi)
+		+ ctx.code[pos].arg.memarg.offset + size;
+	if (address.base == NO_LOCAL && extent <= ctx.min_bytes) {
+		access.kind = ACCESS_STATIC;
+	} else if (extent <= UINT32_MAX) {
+		access.kind = ACCESS_HOISTED;
+		access.base = address.base;
+		access.extent = extent;
+	}
+}
+
+static size_t walk(Analysis &ctx, AbstractState &state, size_t pos);
+
+static void enter(Analysis &ctx, Control &control, bool loop,
+		size_t height, uint32_t arity) {
+	control.loop = loop;
+	control.height = height;
+	control.arity = arity;
+	control.target.reachable = false;
+	ctx.controls.push(&control);
+}
+
+static void leave(Analysis &ctx, AbstractState &state, Control &control) {
+	ctx.controls.resize(ctx.controls.size() - 1);
+	set_results(state, control.height, control.arity);
+	if (!control.loop)
+		join_into(state, control.target);
+}
+
+static size_t walk_block(Analysis &ctx, AbstractState &state, size_t pos) {
+	Control control;
+	enter(ctx, control, false, state.stack.size(),
+			block_arity(ctx.code[pos]));
+	auto end = walk(ctx, state, pos + 1);
+	leave(ctx, state, control);
+	return end + 1;
+}
+
+static size_t walk_if(Analysis &ctx, AbstractState &state, size_t pos) {
+	auto value = pop(state);
+	AbstractState other;
+	copy_state(other, state);
+	branch_on(value, state, other);
+
+	Control control;
+	enter(ctx, control, false, state.stack.size(),
+			block_arity(ctx.code[pos]));
+	auto end = walk(ctx, state, pos + 1);
+	if (end < ctx.code.size() && ctx.code[end].type == INSTR_ELSE)
+		end = walk(ctx, other, end + 1);
+	set_results(state, control.height, control.arity);
+	set_results(other, control.height, control.arity);
+	join_into(state, other);
+	leave(ctx, state, control);
+	return end + 1;
+}
+
+/* the constants in a loop, compared against they tell where it ends */
+static uint32_t widen_bound(const Analysis &ctx, size_t pos, uint32_t hi) {
+	uint64_t best = hi <= INT32_MAX ? INT32_MAX : UINT32_MAX;
+	for (auto i = pos; i < ctx.ends[pos]; i++) {
+		if (ctx.code[i].type != I_32_CONST)
+			continue;
+		uint64_t c = ctx.code[i].arg.uint32_val;
+		if (c && c - 1 >= hi && c - 1 < best)
+			best = c - 1;
+		else if (c >= hi && c < best)
+			best = c;
+	}
+	return best;
+}
+
+static bool writes(const Analysis &ctx, size_t loop, uint32_t idx) {
+	for (auto i = loop; i < ctx.ends[loop]; i++) {
+		auto type = ctx.code[i].type;
+		if ((type == LOCAL_SET || type == LOCAL_TEE)
+				&& ctx.code[i].arg.uint32_val == idx)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Iterates until the state at the top of the loop covers all back
+ * edges. Bounds that keep growing jump to a constant of the loop, so
+ * a counter compared against one stops there.
+ */
+static size_t walk_loop(Analysis &ctx, AbstractState &state, size_t pos) {
+	AbstractState head;
+	copy_state(head, state);
+	size_t end = pos;
+	for (int iteration = 0; iteration <= BOUNDS_MAX_ITERATIONS;
+			iteration++) {
+		Control control;
+		copy_state(state, head);
+		enter(ctx, control, true, state.stack.size(),
+				block_arity(ctx.code[pos]));
+		end = walk(ctx, state, pos + 1);
+		leave(ctx, state, control);
+		if (ctx.failed)
+			return ctx.code.size();
+
+		auto &back = control.target;
+		if (!back.reachable)
+			break;
+		bool stable = true;
+		for (size_t i = 0; i < head.locals.size(); i++)
+			stable &= includes(head.locals[i], back.locals[i]);
+		/* values below the loop only change when a local is written */
+		for (size_t i = 0; i < head.stack.size(); i++) {
+			auto &value = head.stack[i];
+			auto &other = back.stack[i];
+			if (includes(value.range, other.range)
+					&& (value.origin == NO_LOCAL
+						|| value.origin == other.origin)
+					&& (value.condition.local == NO_LOCAL
+						|| same_condition(value.condition,
+							other.condition)))
+				continue;
+			value = make_value(RANGE_ANY);
+			stable = false;
+		}
+		if (stable)
+			break;
+		if (iteration == BOUNDS_MAX_ITERATIONS) {
+			ctx.failed = true;
+			return ctx.code.size();
+		}
+
+		if (iteration + 1 == BOUNDS_MAX_ITERATIONS) {
+			/* whatever the loop writes can be anything */
+			for (uint32_t i = 0; i < head.locals.size(); i++) {
+				if (!writes(ctx, pos, i))
+					continue;
+				invalidate(head, i);
+				head.locals[i] = RANGE_ANY;
+			}
+			continue;
+		}
+		for (size_t i = 0; i < head.locals.size(); i++) {
+			auto &local = head.locals[i];
+			auto joined = join(local, back.locals[i]);
+			if (joined.base != local.base || is_any(joined)) {
+				local = RANGE_ANY;
+				continue;
+			}
+			if (joined.lo < local.lo)
+				local.lo = 0;
+			if (joined.hi > local.hi)
+				local.hi = widen_bound(ctx, pos, joined.hi);
+		}
+	}
+	return end + 1;
+}
+
+/* walks up to the end or else of the current block, returns where it is */
+static size_t walk(Analysis &ctx, AbstractState &state, size_t pos) {
+	auto &code = ctx.code;
+	while (pos < code.size()) {
+		if (ctx.failed || ++ctx.steps > BOUNDS_MAX_STEPS) {
+			ctx.failed = true;
+			return code.size();
+		}
+		auto &inst = code[pos];
+		switch (inst.type) {
+			case INSTR_END:
+			case INSTR_ELSE:
+				return pos;
+			case INSTR_BLOCK:
+				pos = walk_block(ctx, state, pos);
+				continue;
+			case INSTR_LOOP:
+				pos = walk_loop(ctx, state, pos);
+				continue;
+			case INSTR_IF:
+				pos = walk_if(ctx, state, pos);
+				continue;
+			case INSTR_UNREACHABLE:
+			case INSTR_RETURN:
+				state.reachable = false;
+				break;
+			case BR:
+				branch(ctx, state, inst.arg.uint32_val);
+				state.reachable = false;
+				break;
+			case BR_IF: {
+				auto value = pop(state);
+				AbstractState taken;
+				copy_state(taken, state);
+				branch_on(value, taken, state);
+				branch(ctx, taken, inst.arg.uint32_val);
+				break;
+			}
+			case INSTR_CALL:
+			case INSTR_CALL_INDIRECT: {
+				auto type = type_of_call(ctx, inst);
+				if (!type) {
+					ctx.failed = true;
+					return code.size();
+				}
+				if (inst.type == INSTR_CALL_INDIRECT)
+					pop(state);
+				for (size_t i = 0; i < type->parameters.size(); i++)
+					pop(state);
+				for (size_t i = 0; i < type->results.size(); i++)
+					state.stack.push(make_value(RANGE_ANY));
+				break;
+			}
+			case INSTR_NOP:
+				break;
+			case INSTR_DROP:
+			case GLOBAL_SET:
+				pop(state);
+				break;
+			case INSTR_SELECT: {
+				pop(state);
+				auto b = pop(state);
+				auto a = pop(state);
+				state.stack.push(make_value(join(a.range, b.range)));
+				break;
+			}
+			case LOCAL_GET:
+			case LOCAL_SET:
+			case LOCAL_TEE: {
+				auto idx = inst.arg.uint32_val;
+				if (idx >= state.locals.size()) {
+					ctx.failed = true;
+					return code.size();
+				}
+				if (inst.type != LOCAL_GET) {
+					auto value = pop(state);
+					write_local(state, idx, value.range);
+					if (inst.type == LOCAL_SET)
+						break;
+				}
+				auto value = make_value(read_local(state, idx));
+				value.origin = idx;
+				state.stack.push(value);
+				break;
+			}
+			case GLOBAL_GET:
+			case F_32_CONST:
+			case F_64_CONST:
+				state.stack.push(make_value(RANGE_ANY));
+				break;
+			case I_32_CONST:
+			/* i32 instructions only see the low half, this is how
+			 * the inliner clears locals */
+			case I_64_CONST:
+				state.stack.push(make_value({NO_LOCAL,
+						inst.arg.uint32_val,
+						inst.arg.uint32_val}));
+				break;
+			case I_32_LOAD:
+			case I_32_LOAD_8_S:
+			case I_32_LOAD_8_U: {
+				auto address = pop(state);
+				record_access(ctx, pos, state, address.range,
+						inst.type == I_32_LOAD ? 4 : 1);
+				state.stack.push(make_value(
+						inst.type == I_32_LOAD_8_U
+						? Range{NO_LOCAL, 0, UINT8_MAX}
+						: RANGE_ANY));
+				break;
+			}
+			case I_32_STORE: {
+				pop(state);
+				auto address = pop(state);
+				record_access(ctx, pos, state, address.range, 4);
+				break;
+			}
+			case I_32_EQZ: {
+				auto arg = pop(state);
+				auto value = make_value({NO_LOCAL, 0, 1});
+				value.condition = condition_of(arg);
+				value.condition.relation =
+					negate(value.condition.relation);
+				state.stack.push(value);
+				break;
+			}
+			case I_32_EQ:
+			case I_32_NE:
+			case I_32_LT_S:
+			case I_32_LT_U:
+			case I_32_GT_S:
+			case I_32_GT_U:
+			case I_32_LE_S:
+			case I_32_LE_U: {
+				auto b = pop(state);
+				auto a = pop(state);
+				auto value = make_value({NO_LOCAL, 0, 1});
+				Condition &condition = value.condition;
+				relation_of(inst.type, condition.relation,
+						condition.is_signed);
+				if (a.origin != NO_LOCAL && is_constant(b.range)) {
+					condition.local = a.origin;
+					condition.constant = b.range.lo;
+				} else if (b.origin != NO_LOCAL
+						&& is_constant(a.range)) {
+					condition.local = b.origin;
+					condition.relation = flip(condition.relation);
+					condition.constant = a.range.lo;
+				}
+				state.stack.push(value);
+				break;
+			}
+			case I_32_ADD:
+			case I_32_SUB:
+			case I_32_MUL:
+			case I_32_DIV_S:
+			case I_32_REM_S:
+			case I_32_AND:
+			case I_32_OR:
+			case I_32_SHL:
+			case I_32_SHR_S:
+			case I_64_ADD:
+			case I_64_SUB:
+			case I_64_MUL:
+			case I_64_DIV_U: {
+				auto b = pop(state);
+				auto a = pop(state);
+				state.stack.push(make_value(arithmetic(inst.type,
+						a.range, b.range)));
+				break;
+			}
+			default:
+				ctx.failed = true;
+				return code.size();
+		}
+		pos++;
+	}
+	return pos;
+}
+
+static bool find_ends(Analysis &ctx) {
+	frg::vector<size_t, frg_allocator> control;
+	ctx.ends.resize(ctx.code.size());
+	for (size_t i = 0; i < ctx.code.size(); i++) {
+		ctx.ends[i] = i;
+		switch (ctx.code[i].type) {
+			case INSTR_BLOCK:
+			case INSTR_LOOP:
+			case INSTR_IF:
+				control.push(i);
+				break;
+			case INSTR_END:
+				if (control.empty())
+					break;
+				ctx.ends[control[control.size() - 1]] = i;
+				control.resize(control.size() - 1);
+				break;
+			default:
+				break;
+		}
+	}
+	return control.empty();
+}
+
+/* the outermost loop around each access that can check it up front */
+static void choose_hosts(Analysis &ctx) {
+	frg::vector<size_t, frg_allocator> open;
+	ctx.hosts.resize(ctx.code.size());
+	for (size_t i = 0; i < ctx.code.size(); i++) {
+		ctx.hosts[i] = false;
+		while (!open.empty() && ctx.ends[open[open.size() - 1]] < i)
+			open.resize(open.size() - 1);
+		if (ctx.code[i].type == INSTR_LOOP)
+			open.push(i);
+
+		auto &access = ctx.accesses[i];
+		if (access.kind != ACCESS_HOISTED)
+			continue;
+		access.kind = ACCESS_CHECKED;
+		for (auto loop : open) {
+			if (ctx.ends[loop] - loop > BOUNDS_MAX_LOOP_SIZE
+					|| (access.base != NO_LOCAL
+						&& writes(ctx, loop, access.base)))
+				continue;
+			access.kind = ACCESS_HOISTED;
+			access.loop = loop;
+			bool found = false;
+			for (auto &guard : ctx.guards) {
+				if (guard.loop != loop || guard.base != access.base)
+					continue;
+				if (access.extent > guard.extent)
+					guard.extent = access.extent;
+				found = true;
+			}
+			if (!found) {
+				Guard guard;
+				guard.loop = loop;
+				guard.base = access.base;
+				guard.extent = access.extent;
+				ctx.guards.push(guard);
+			}
+			break;
+		}
+	}
+}
+
+static void emit(Analysis &ctx, Emission &out, size_t begin, size_t end);
+
+static void emit_instruction(Emission &out, uint32_t type, uint64_t arg) {
+	Instruction inst;
+	inst.type = type;
+	inst.cost = 0;
+	inst.arg.uint64_val = arg;
+	out.code.push(inst);
+}
+
+static void emit_block(Emission &out, uint32_t type, BinaryType block_type) {
+	Instruction inst;
+	inst.type = type;
+	inst.cost = 0;
+	inst.arg.uint64_val = 0;
+	inst.arg.block.type = block_type;
+	out.code.push(inst);
+}
+
+static void emit_loop(Analysis &ctx, Emission &out, size_t loop) {
+	auto inst = ctx.code[loop];
+	inst.cost = 0;
+	out.code.push(inst);
+	out.wrappers.push(false);
+	emit(ctx, out, loop + 1, ctx.ends[loop] + 1);
+}
+
+/* if (guards) { loop without checks } else { loop } */
+static void emit_versions(Analysis &ctx, Emission &out, size_t loop) {
+	bool first = true;
+	for (const auto &guard : ctx.guards) {
+		if (guard.loop != loop)
+			continue;
+		if (guard.base == NO_LOCAL)
+			emit_instruction(out, I_32_CONST, 0);
+		else
+			emit_instruction(out, LOCAL_GET, guard.base);
+		emit_instruction(out, INSTR_MEMORY_FITS, guard.extent);
+		if (!first)
+			emit_instruction(out, I_32_AND, 0);
+		first = false;
+	}
+	auto type = ctx.code[loop].arg.block.type;
+	emit_block(out, INSTR_IF, type);
+	out.wrappers.push(true);
+	out.unchecked.push(loop);
+	emit_loop(ctx, out, loop);
+	out.unchecked.resize(out.unchecked.size() - 1);
+	emit_block(out, INSTR_ELSE, EMPTY);
+	emit_loop(ctx, out, loop);
+	emit_instruction(out, INSTR_END, 0);
+	out.wrappers.resize(out.wrappers.size() - 1);
+}
+
+/* branches skip the ifs around copied loops */
+static uint32_t branch_depth(const Emission &out, uint32_t depth) {
+	for (size_t i = out.wrappers.size(); i-- > 0;) {
+		if (out.wrappers[i])
+			continue;
+		if (!depth--)
+			return out.wrappers.size() - 1 - i;
+	}
+	/* returns from the function */
+	return out.wrappers.size() + depth;
+}
+
+static uint32_t unchecked_type(uint32_t type) {
+	switch (type) {
+		case I_32_LOAD: return I_32_LOAD_UNCHECKED;
+		case I_32_LOAD_8_S: return I_32_LOAD_8_S_UNCHECKED;
+		case I_32_LOAD_8_U: return I_32_LOAD_8_U_UNCHECKED;
+		default: return I_32_STORE_UNCHECKED;
+	}
+}
+
+static void emit(Analysis &ctx, Emission &out, size_t begin, size_t end) {
+	for (auto pos = begin; pos < end; pos++) {
+		auto inst = ctx.code[pos];
+		inst.cost = 0;
+		switch (inst.type) {
+			case INSTR_LOOP:
+				if (ctx.hosts[pos]) {
+					emit_versions(ctx, out, pos);
+					pos = ctx.ends[pos];
+					continue;
+				}
+				out.wrappers.push(false);
+				break;
+			case INSTR_BLOCK:
+			case INSTR_IF:
+				out.wrappers.push(false);
+				break;
+			case INSTR_END:
+				if (!out.wrappers.empty())
+					out.wrappers.resize(out.wrappers.size() - 1);
+				break;
+			case BR:
+			case BR_IF:
+				inst.arg.uint32_val = branch_depth(out,
+						inst.arg.uint32_val);
+				break;
+			case I_32_LOAD:
+			case I_32_LOAD_8_S:
+			case I_32_LOAD_8_U:
+			case I_32_STORE: {
+				auto &access = ctx.accesses[pos];
+				bool unchecked = access.kind == ACCESS_STATIC;
+				if (access.kind == ACCESS_HOISTED)
+					for (auto loop : out.unchecked)
+						unchecked |= loop == access.loop;
+				if (!unchecked)
+					break;
+				inst.type = unchecked_type(inst.type);
+				if (access.kind == ACCESS_STATIC)
+					out.removed++;
+				else
+					out.hoisted++;
+				break;
+			}
+			default:
+				break;
+		}
+		out.code.push(inst);
+	}
+}
+
+static void translate(Analysis &ctx, Code &code, uint32_t num_params,
+		Emission &out) {
+	if (!find_ends(ctx))
+		return;
+
+	AbstractState state;
+	uint32_t frame_size = num_params + code.locals.size();
+	state.locals.resize(frame_size);
+	for (uint32_t i = 0; i < frame_size; i++)
+		state.locals[i] = i < num_params ? RANGE_ANY
+			: Range{NO_LOCAL, 0, 0};
+	state.reachable = true;
+
+	ctx.accesses.resize(ctx.code.size());
+	for (auto &access : ctx.accesses)
+		access.kind = ACCESS_CHECKED;
+	ctx.steps = 0;
+	ctx.failed = false;
+
+	Control function;
+	enter(ctx, function, false, 0, 0);
+	walk(ctx, state, 0);
+	ctx.controls.resize(0);
+	if (ctx.failed)
+		return;
+
+	choose_hosts(ctx);
+	for (const auto &guard : ctx.guards)
+		ctx.hosts[guard.loop] = true;
+
+	auto removed = out.removed, hoisted = out.hoisted;
+	out.code.resize(0);
+	out.wrappers.resize(0);
+	emit(ctx, out, 0, ctx.code.size());
+	if (out.removed == removed && out.hoisted == hoisted)
+		return;
+
+	code.expression.resize(out.code.size());
+	for (size_t i = 0; i < out.code.size(); i++)
+		code.expression[i] = out.code[i];
+	Interpreter::assign_block_sizes(code.expression);
+	Interpreter::assign_costs(code.expression);
+}
+
+void BoundsChecks::run(Module &module) {
+	uint64_t min_pages = 0;
+	bool has_memory = false;
+	for (const auto &import : module.imports) {
+		if (import.description != EXPORT_MEM)
+			continue;
+		min_pages = import.limit.template get<0>();
+		has_memory = true;
+		break;
+	}
+	if (!has_memory && module.memory_types.size()) {
+		min_pages = module.memory_types[0].template get<0>();
+		has_memory = true;
+	}
+	if (!has_memory)
+		return;
+
+	frg::vector<uint32_t, frg_allocator> function_types;
+	for (const auto &import : module.imports)
+		if (import.description == EXPORT_FUNC)
+			function_types.push(import.idx);
+	for (auto type : module.functions)
+		function_types.push(type);
+
+	Emission out;
+	out.removed = 0;
+	out.hoisted = 0;
+	for (size_t i = 0; i < module.function_code.size(); i++) {
+		auto &code = module.function_code[i];
+		if (i >= module.functions.size()
+				|| module.functions[i]
+				>= module.function_types.size())
+			continue;
+		Analysis ctx{module, code.expression};
+		ctx.function_types = &function_types;
+		ctx.min_bytes = min_pages * PAGE_SIZE;
+		translate(ctx, code, module.function_types[
+				module.functions[i]].parameters.size(), out);
+	}
+}
+
+} /* namespace bearwasm */
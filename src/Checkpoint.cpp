@@ -0,0 +1,281 @@
+#include <bearwasm/Checkpoint.h>
+#include <bearwasm/Util.h>
+#include <string.h>
+
+namespace bearwasm {
+
+static constexpr char CHECKPOINT_MAGIC[4] = {'B', 'W', 'C', 'P'};
+
+struct CheckpointFrame {
+	int32_t pc;
+	int32_t labelstack_size;
+	int32_t prev;
+	uint32_t locals;
+};
+
+struct CheckpointLabel {
+	int32_t pc_cont;
+	uint32_t loop;
+};
+
+/* a run of written pages, followed by its bytes */
+struct CheckpointRun {
+	uint32_t offset, size;
+};
+
+struct CheckpointMemory {
+	uint32_t pages;
+	uint32_t num_runs;
+};
+
+template<typename F>
+static void for_each_dirty_run(MemoryInstance &memory, F f) {
+	auto pages = memory.num_dirty_pages();
+	for (size_t page = 0; page < pages;) {
+		if (!memory.is_dirty(page)) {
+			page++;
+			continue;
+		}
+		auto first = page;
+		while (page < pages && memory.is_dirty(page))
+			page++;
+		f(first * DIRTY_PAGE_SIZE, (page - first) * DIRTY_PAGE_SIZE);
+	}
+}
+
+/* instructions in the code of a function, -1 for natives */
+static int code_size(const InterpreterState &state, int function) {
+	auto expression = state.functions[function].expression;
+	if (!expression)
+		return -1;
+	return expression->size();
+}
+
+/* pc may also be at the end, the function finished there */
+static bool valid_pc(const InterpreterState &state, int function, int pc) {
+	return pc >= 0 && pc <= code_size(state, function);
+}
+
+/* what the module allows memory to grow to, in pages */
+static uint32_t max_pages(const InterpreterState &state,
+		const Module *module, size_t memidx) {
+	auto imported = state.memory.size() - module->memory_types.size();
+	/* imported memory can not grow, resize() checks that */
+	if (memidx < imported)
+		return UINT32_MAX;
+	auto max = module->memory_types[memidx - imported].template get<1>();
+	return max ? max : 0x10000;
+}
+
+bool Checkpoint::save(VirtualMachine &vm, uint64_t module_hash,
+		DataSink *sink) {
+	auto &state = vm.state;
+	auto &stack = state.stack;
+	auto &callstack = state.callstack;
+	auto &labelstack = state.labelstack;
+
+	/* whatever the native waits for can not be saved with it, nor
+	 * the result of one that finished before the next resume() */
+	if (state.blocked || state.has_call_result)
+		return false;
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.module_hash = module_hash;
+	header.current_function = state.current_function;
+	header.pc = state.pc;
+	header.locals = state.locals;
+	header.num_functions = state.functions.size();
+	header.num_globals = state.globals.size();
+	header.num_memories = state.memory.size();
+	header.stack_size = stack.size();
+	header.callstack_size = callstack.size();
+	header.labelstack_size = labelstack.size();
+	header.fuel = state.fuel;
+	if (!stream_write(sink, header))
+		return false;
+
+	for (const auto &global : state.globals)
+		if (!stream_write(sink, global.value.uint64_val))
+			return false;
+
+	for (const auto &value : stack)
+		if (!stream_write(sink, value.uint64_val))
+			return false;
+
+	for (const auto &frame : callstack) {
+		CheckpointFrame entry;
+		entry.pc = frame.pc;
+		entry.labelstack_size = frame.labelstack_size;
+		entry.prev = frame.prev;
+		entry.locals = frame.locals;
+		if (!stream_write(sink, entry))
+			return false;
+	}
+
+	for (const auto &label : labelstack) {
+		CheckpointLabel entry;
+		entry.pc_cont = label.pc_cont;
+		entry.loop = label.loop;
+		if (!stream_write(sink, entry))
+			return false;
+	}
+
+	/* only what changed since init(), restore starts from there */
+	for (auto &memory : state.memory) {
+		CheckpointMemory entry;
+		entry.pages = memory.get_size() / PAGE_SIZE;
+		entry.num_runs = 0;
+		for_each_dirty_run(memory, [&] (size_t, size_t) {
+			entry.num_runs++;
+		});
+		if (!stream_write(sink, entry))
+			return false;
+
+		bool ok = true;
+		for_each_dirty_run(memory, [&] (size_t offset, size_t size) {
+			CheckpointRun run;
+			run.offset = offset;
+			run.size = size;
+			ok = ok && stream_write(sink, run)
+				&& sink->write(memory.data() + offset, size);
+		});
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+bool Checkpoint::restore(VirtualMachine &vm, uint64_t module_hash,
+		DataStream *stream) {
+	auto &state = vm.state;
+	if (vm.reset() != EXECUTION_FINISHED) {
+		log_warn("Unable to restore checkpoint: start did not finish\n");
+		return false;
+	}
+
+	auto fail = [&] (const char *what) {
+		log_warn("Unable to restore checkpoint: bad %s\n", what);
+		vm.reset();
+		return false;
+	};
+
+	auto header = stream_read<CheckpointHeader>(stream);
+	if (!header)
+		return fail("header");
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))
+			|| header->version != CHECKPOINT_VERSION
+			|| header->module_hash != module_hash)
+		return fail("header");
+	if (header->num_functions != state.functions.size()
+			|| header->num_globals != state.globals.size()
+			|| header->num_memories != state.memory.size())
+		return fail("instance layout");
+	if (header->current_function < 0 || static_cast<uint32_t>(
+				header->current_function) >= header->num_functions)
+		return fail("current function");
+	if (header->stack_size > state.stack.capacity()
+			|| header->callstack_size > state.callstack.capacity()
+			|| header->labelstack_size > state.labelstack.capacity())
+		return fail("stack sizes");
+	if (!header->callstack_size)
+		return fail("stack sizes");
+	if (!valid_pc(state, header->current_function, header->pc))
+		return fail("pc");
+	if (header->locals > header->stack_size || header->stack_size
+			- header->locals < state.callees[
+				header->current_function].frame_size)
+		return fail("locals");
+
+	for (auto &global : state.globals) {
+		auto value = stream_read<uint64_t>(stream);
+		if (!value)
+			return fail("globals");
+		global.value.uint64_val = *value;
+	}
+
+	state.stack.clear();
+	for (uint32_t i = 0; i < header->stack_size; i++) {
+		auto value = stream_read<uint64_t>(stream);
+		if (!value)
+			return fail("value stack");
+		state.stack.push(Value{*value});
+	}
+
+	state.callstack.clear();
+	for (uint32_t i = 0; i < header->callstack_size; i++) {
+		auto entry = stream_read<CheckpointFrame>(stream);
+		if (!entry || entry->prev < 0 || static_cast<uint32_t>(
+					entry->prev) >= header->num_functions
+				|| entry->locals > header->stack_size)
+			return fail("call stack");
+		/* the calls below this one opened the labels before it */
+		auto labels = state.callstack.empty() ? 0
+			: state.callstack.top().labelstack_size;
+		if ((entry->pc != PC_END && !valid_pc(state, entry->prev,
+						entry->pc))
+				|| entry->labelstack_size < labels
+				|| static_cast<uint32_t>(entry->labelstack_size)
+					> header->labelstack_size)
+			return fail("call stack");
+		Frame frame;
+		frame.pc = entry->pc;
+		frame.labelstack_size = entry->labelstack_size;
+		frame.prev = entry->prev;
+		frame.locals = entry->locals;
+		state.callstack.push(frame);
+	}
+
+	/* labels belong to the function the frame above them returns to */
+	uint32_t frame = 0;
+	for (uint32_t i = 0; i < header->labelstack_size; i++) {
+		while (frame + 1 < header->callstack_size && static_cast<uint32_t>(
+					state.callstack[frame + 1].labelstack_size) <= i)
+			frame++;
+		auto function = frame + 1 < header->callstack_size
+			? state.callstack[frame + 1].prev
+			: header->current_function;
+		auto entry = stream_read<CheckpointLabel>(stream);
+		if (!entry || !valid_pc(state, function, entry->pc_cont))
+			return fail("label stack");
+		Label label;
+		label.pc_cont = entry->pc_cont;
+		label.loop = entry->loop;
+		state.labelstack.push(label);
+	}
+
+	for (size_t i = 0; i < state.memory.size(); i++) {
+		auto &memory = state.memory[i];
+		auto entry = stream_read<CheckpointMemory>(stream);
+		uint32_t pages = memory.get_size() / PAGE_SIZE;
+		if (!entry || entry->pages < pages
+				|| entry->pages > max_pages(state, vm.get_module(), i)
+				|| !memory.can_resize(entry->pages))
+			return fail("memory");
+		if (entry->pages != pages)
+			memory.resize(entry->pages);
+
+		for (uint32_t i = 0; i < entry->num_runs; i++) {
+			auto run = stream_read<CheckpointRun>(stream);
+			if (!run || run->offset > static_cast<uint32_t>(
+						memory.get_size())
+					|| run->size > memory.get_size()
+						- run->offset)
+				return fail("memory");
+			if (!stream->read(memory.data() + run->offset,
+						run->size))
+				return fail("memory");
+			memory.mark_dirty(run->offset, run->size);
+		}
+	}
+
+	state.current_function = header->current_function;
+	state.pc = header->pc;
+	state.locals = header->locals;
+	state.fuel = header->fuel;
+	return true;
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,29 @@
+#include <bearwasm/Epoch.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+uint64_t global_epoch = 0;
+
+EpochTimer::EpochTimer(uint64_t interval) :
+	interval(interval ? interval : 1), thread(nullptr), stopping(false) {
+	thread = bearwasm_spawn_thread(timer_main, this);
+	if (!thread)
+		panic("Unable to spawn epoch timer\n");
+}
+
+/* takes up to one interval for the thread to notice */
+EpochTimer::~EpochTimer() {
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	bearwasm_join_thread(thread);
+}
+
+void EpochTimer::timer_main(void *arg) {
+	auto timer = static_cast<EpochTimer*>(arg);
+	while (!__atomic_load_n(&timer->stopping, __ATOMIC_ACQUIRE)) {
+		bearwasm_sleep(timer->interval);
+		increment_epoch();
+	}
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,220 @@
+#include <bearwasm/Executor.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+static constexpr size_t DEQUE_MASK = WORK_DEQUE_SIZE - 1;
+static_assert(!(WORK_DEQUE_SIZE & DEQUE_MASK),
+		"WORK_DEQUE_SIZE has to be a power of two");
+
+WorkDeque::WorkDeque() : top(0), bottom(0) {
+	for (auto &task : tasks)
+		task = nullptr;
+}
+
+bool WorkDeque::push(Task *task) {
+	auto b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+	auto t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+	if (b - t >= static_cast<int64_t>(WORK_DEQUE_SIZE))
+		return false;
+	__atomic_store_n(&tasks[b & DEQUE_MASK], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+Task *WorkDeque::take() {
+	auto b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	auto t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		/* empty */
+		__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+		return nullptr;
+	}
+
+	auto task = __atomic_load_n(&tasks[b & DEQUE_MASK], __ATOMIC_RELAXED);
+	if (t == b) {
+		/* last one, race the thieves for it */
+		if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			task = nullptr;
+		__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+Task *WorkDeque::steal() {
+	auto t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	auto b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return nullptr;
+
+	auto task = __atomic_load_n(&tasks[t & DEQUE_MASK], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return nullptr;
+	return task;
+}
+
+static void run_invocation(Task *task) {
+	auto invocation = static_cast<Invocation*>(task);
+	auto vm = invocation->vm;
+	vm->start(invocation->argc, invocation->argv);
+	invocation->status = vm->resume(BUDGET_UNLIMITED);
+	invocation->result = invocation->status == EXECUTION_FINISHED
+		? vm->get_result() : 0;
+	if (invocation->done)
+		invocation->done(invocation);
+}
+
+Executor::Executor(size_t num_workers) :
+	injected_head(0), locked(false), stopping(false), work_seq(0),
+	outstanding(0) {
+	if (!num_workers)
+		num_workers = 1;
+
+	/* all deques have to exist before the first worker steals */
+	workers.resize(num_workers);
+	for (size_t i = 0; i < num_workers; i++) {
+		workers[i] = new Worker;
+		workers[i]->executor = this;
+		workers[i]->index = i;
+		workers[i]->thread = nullptr;
+	}
+
+	for (auto worker : workers) {
+		worker->thread = bearwasm_spawn_thread(worker_main, worker);
+		if (!worker->thread)
+			panic("Unable to spawn executor worker\n");
+	}
+}
+
+Executor::~Executor() {
+	wait_idle();
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&work_seq, 1, __ATOMIC_RELEASE);
+	bearwasm_wake(&work_seq, UINT32_MAX);
+
+	/* others may still be stealing from a finished worker */
+	for (auto worker : workers)
+		bearwasm_join_thread(worker->thread);
+	for (auto worker : workers)
+		delete worker;
+}
+
+/* only held to move tasks in and out of the injection queue */
+void Executor::lock() {
+	while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE))
+		;
+}
+
+void Executor::unlock() {
+	__atomic_clear(&locked, __ATOMIC_RELEASE);
+}
+
+void Executor::submit(Task *task) {
+	__atomic_add_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+
+	lock();
+	injected.push(task);
+	unlock();
+
+	__atomic_add_fetch(&work_seq, 1, __ATOMIC_RELEASE);
+	bearwasm_wake(&work_seq, 1);
+}
+
+void Executor::submit(Invocation *invocation) {
+	invocation->run = run_invocation;
+	submit(static_cast<Task*>(invocation));
+}
+
+void Executor::wait_idle() {
+	while (true) {
+		auto count = __atomic_load_n(&outstanding, __ATOMIC_ACQUIRE);
+		if (!count)
+			return;
+		bearwasm_wait(&outstanding, count);
+	}
+}
+
+/*
+ * Moves a fair share of the injection queue into the worker's deque so
+ * the others can steal it from there. Returns one task to run.
+ */
+Task *Executor::grab_injected(Worker *worker) {
+	lock();
+	auto available = injected.size() - injected_head;
+	if (!available) {
+		unlock();
+		return nullptr;
+	}
+
+	auto batch = available / workers.size() + 1;
+	if (batch > WORK_DEQUE_SIZE / 2)
+		batch = WORK_DEQUE_SIZE / 2;
+	auto task = injected[injected_head++];
+	uint32_t pushed = 0;
+	for (size_t i = 1; i < batch; i++) {
+		if (!worker->deque.push(injected[injected_head]))
+			break;
+		injected_head++;
+		pushed++;
+	}
+	if (injected_head == injected.size()) {
+		injected.resize(0);
+		injected_head = 0;
+	}
+	unlock();
+
+	/* sleeping workers can steal the rest of the batch */
+	if (pushed) {
+		__atomic_add_fetch(&work_seq, 1, __ATOMIC_RELEASE);
+		bearwasm_wake(&work_seq, pushed);
+	}
+	return task;
+}
+
+Task *Executor::find_task(Worker *worker) {
+	if (auto task = worker->deque.take())
+		return task;
+	if (auto task = grab_injected(worker))
+		return task;
+
+	/* start with the next worker so thieves spread out */
+	for (size_t i = 1; i < workers.size(); i++) {
+		auto victim = workers[(worker->index + i) % workers.size()];
+		if (auto task = victim->deque.steal())
+			return task;
+	}
+	return nullptr;
+}
+
+void Executor::worker_main(void *arg) {
+	auto worker = static_cast<Worker*>(arg);
+	auto executor = worker->executor;
+
+	while (true) {
+		/* read before looking for work, a submit in between
+		 * changes it and the wait returns right away */
+		auto seq = __atomic_load_n(&executor->work_seq, __ATOMIC_ACQUIRE);
+
+		if (auto task = executor->find_task(worker)) {
+			task->run(task);
+			if (__atomic_sub_fetch(&executor->outstanding, 1,
+						__ATOMIC_ACQ_REL) == 0)
+				bearwasm_wake(&executor->outstanding, UINT32_MAX);
+			continue;
+		}
+
+		if (__atomic_load_n(&executor->stopping, __ATOMIC_ACQUIRE))
+			return;
+		bearwasm_wait(&executor->work_seq, seq);
+	}
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,213 @@
+#include <bearwasm/Inliner.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+/* new code of a function, kept in Inlining until all are done */
+struct InlinedFunction {
+	uint32_t function;
+	size_t code_start, code_size;
+	size_t locals_start, locals_size;
+};
+
+struct Inlining {
+	Inlining(const Module &module) : module(module) {}
+
+	const Module &module;
+	uint32_t num_imported;
+	frg::vector<uint8_t, frg_allocator> inlinable;
+	/* of every function that changed, one after the other */
+	frg::vector<Instruction, frg_allocator> code;
+	frg::vector<Local, frg_allocator> locals;
+	/* where the current caller's entries in locals start */
+	size_t locals_start;
+	/* its first local that holds inlined ones */
+	uint32_t caller_frame;
+	/* functions being expanded, the caller first */
+	uint32_t chain[INLINE_MAX_DEPTH + 1];
+	int num_inlined;
+};
+
+static uint32_t frame_size(const Module &module, uint32_t function) {
+	return module.function_types[module.functions[function]]
+		.parameters.size()
+		+ module.function_code[function].locals.size();
+}
+
+/* the body has to work without a frame of its own */
+static bool can_inline(const Code &code) {
+	const auto &body = code.expression;
+	if (body.size() - 1 > INLINE_MAX_SIZE)
+		return false;
+
+	size_t labels = 0;
+	for (size_t i = 0; i + 1 < body.size(); i++) {
+		switch (body[i].type) {
+			case INSTR_BLOCK:
+			case INSTR_LOOP:
+			case INSTR_IF:
+				labels++;
+				break;
+			case INSTR_END:
+				labels--;
+				break;
+			case BR:
+			case BR_IF:
+				if (body[i].arg.uint32_val >= labels)
+					return false;
+				break;
+			/* it may leave more than the results on the
+			 * stack, which only a frame of its own drops */
+			case INSTR_RETURN:
+				return false;
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+static Instruction make_instruction(uint32_t type, uint32_t arg) {
+	Instruction inst;
+	inst.type = type;
+	inst.cost = 0;
+	inst.arg.uint64_val = 0;
+	inst.arg.uint32_val = arg;
+	return inst;
+}
+
+static bool should_inline(const Inlining &ctx, uint32_t target, int depth) {
+	if (target < ctx.num_imported || depth == INLINE_MAX_DEPTH)
+		return false;
+	auto callee = target - ctx.num_imported;
+	if (callee >= ctx.inlinable.size() || !ctx.inlinable[callee])
+		return false;
+	for (int i = 0; i <= depth; i++)
+		if (ctx.chain[i] == callee)
+			return false;
+	return true;
+}
+
+static void expand(Inlining &ctx, uint32_t function, uint32_t base,
+		int depth);
+
+/* replaces a call by the body of callee, its frame starting at base */
+static void inline_call(Inlining &ctx, uint32_t callee, uint32_t base,
+		int depth) {
+	const auto &params = ctx.module.function_types[
+		ctx.module.functions[callee]].parameters;
+	const auto &locals = ctx.module.function_code[callee].locals;
+	uint32_t num_params = params.size();
+
+	/* the interpreter does not look at the types, the first callee
+	 * to use a local decides */
+	auto end = base + num_params + locals.size();
+	auto added = ctx.locals.size() - ctx.locals_start;
+	for (auto slot = ctx.caller_frame + added; slot < end; slot++) {
+		auto k = slot - base;
+		ctx.locals.push(k < num_params ? params[k]
+				: locals[k - num_params]);
+	}
+
+	/* the last argument is on top */
+	for (auto i = num_params; i-- > 0;)
+		ctx.code.push(make_instruction(LOCAL_SET, base + i));
+	for (size_t k = 0; k < locals.size(); k++) {
+		/* all 64 bits, whatever the type */
+		ctx.code.push(make_instruction(I_64_CONST, 0));
+		ctx.code.push(make_instruction(LOCAL_SET,
+					base + num_params + k));
+	}
+
+	expand(ctx, callee, base, depth);
+	ctx.num_inlined++;
+}
+
+/*
+ * Appends the code of function with its locals moved up by base. The
+ * body of an inlined callee goes without its end.
+ */
+static void expand(Inlining &ctx, uint32_t function, uint32_t base,
+		int depth) {
+	const auto &body = ctx.module.function_code[function].expression;
+	auto end = body.size();
+	if (depth)
+		end--;
+	/* callees inlined here put their frame after this one */
+	auto next = base + frame_size(ctx.module, function);
+	ctx.chain[depth] = function;
+
+	for (size_t i = 0; i < end; i++) {
+		auto inst = body[i];
+		inst.cost = 0;
+		switch (inst.type) {
+			case LOCAL_GET:
+			case LOCAL_SET:
+			case LOCAL_TEE:
+				inst.arg.uint32_val += base;
+				break;
+			case INSTR_CALL:
+				if (!should_inline(ctx, inst.arg.uint32_val,
+							depth))
+					break;
+				inline_call(ctx, inst.arg.uint32_val
+						- ctx.num_imported, next,
+						depth + 1);
+				continue;
+			default:
+				break;
+		}
+		ctx.code.push(inst);
+	}
+}
+
+void Inliner::run(Module &module) {
+	auto &codes = module.function_code;
+	Inlining ctx{module};
+	ctx.num_imported = 0;
+	for (const auto &import : module.imports)
+		if (import.description == EXPORT_FUNC)
+			ctx.num_imported++;
+	ctx.inlinable.resize(codes.size());
+	for (size_t i = 0; i < codes.size(); i++)
+		ctx.inlinable[i] = can_inline(codes[i]);
+	ctx.num_inlined = 0;
+
+	/* callees are copied from the decoded code, so nothing is
+	 * replaced before every caller is done */
+	frg::vector<InlinedFunction, frg_allocator> changed;
+	for (uint32_t i = 0; i < codes.size(); i++) {
+		ctx.chain[0] = i;
+		bool found = false;
+		for (const auto &inst : codes[i].expression)
+			if (inst.type == INSTR_CALL && should_inline(ctx,
+						inst.arg.uint32_val, 0))
+				found = true;
+		if (!found)
+			continue;
+
+		InlinedFunction entry;
+		entry.function = i;
+		entry.code_start = ctx.code.size();
+		entry.locals_start = ctx.locals.size();
+		ctx.locals_start = entry.locals_start;
+		ctx.caller_frame = frame_size(module, i);
+		expand(ctx, i, 0, 0);
+		entry.code_size = ctx.code.size() - entry.code_start;
+		entry.locals_size = ctx.locals.size() - entry.locals_start;
+		changed.push(entry);
+	}
+
+	for (const auto &entry : changed) {
+		auto &code = codes[entry.function];
+		code.expression.resize(entry.code_size);
+		for (size_t k = 0; k < entry.code_size; k++)
+			code.expression[k] = ctx.code[entry.code_start + k];
+		for (size_t k = 0; k < entry.locals_size; k++)
+			code.locals.push(ctx.locals[entry.locals_start + k]);
+		Interpreter::assign_block_sizes(code.expression);
+		Interpreter::assign_costs(code.expression);
+	}
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,87 @@
+#include <bearwasm/InstancePool.h>
+
+namespace bearwasm {
+
+InstancePool::InstancePool(Module *module, SetupFunction setup,
+		size_t max_idle) :
+	module(module), setup(setup), max_idle(max_idle), locked(false) {
+}
+
+InstancePool::~InstancePool() {
+	for (size_t i = 0; i < idle.size(); i++)
+		delete idle[i];
+	module->release();
+}
+
+/* only held for a push or pop, spinning is cheaper than a host mutex */
+void InstancePool::lock() {
+	while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE))
+		;
+}
+
+void InstancePool::unlock() {
+	__atomic_clear(&locked, __ATOMIC_RELEASE);
+}
+
+VirtualMachine *InstancePool::create() {
+	module->retain();
+	auto vm = new VirtualMachine(module);
+	if (setup)
+		setup(vm);
+	if (vm->init() != EXECUTION_FINISHED) {
+		delete vm;
+		return nullptr;
+	}
+	return vm;
+}
+
+void InstancePool::prefill(size_t count) {
+	if (count > max_idle)
+		count = max_idle;
+	for (size_t i = 0; i < count; i++) {
+		auto vm = create();
+		if (!vm)
+			return;
+		lock();
+		bool full = idle.size() >= max_idle;
+		if (!full)
+			idle.push(vm);
+		unlock();
+		if (full) {
+			delete vm;
+			return;
+		}
+	}
+}
+
+VirtualMachine *InstancePool::acquire() {
+	VirtualMachine *vm = nullptr;
+	lock();
+	if (idle.size()) {
+		vm = idle[idle.size() - 1];
+		idle.resize(idle.size() - 1);
+	}
+	unlock();
+
+	if (!vm)
+		vm = create();
+	return vm;
+}
+
+void InstancePool::release(VirtualMachine *vm) {
+	if (vm->reset() != EXECUTION_FINISHED) {
+		delete vm;
+		return;
+	}
+
+	lock();
+	bool full = idle.size() >= max_idle;
+	if (!full)
+		idle.push(vm);
+	unlock();
+
+	if (full)
+		delete vm;
+}
+
+} /* namespace bearwasm */
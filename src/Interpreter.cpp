@@ -1,107 +1,115 @@
 #include <bearwasm/Interpreter.h>
 
-#include <algorithm>
-#include <iterator>
-
 namespace bearwasm {
 
-static void pop_args(InterpreterState &state, int idx) {
-	auto &next = state.functions[idx];
-	const auto &params = next.signature.parameters;
-	for (size_t i = params.size() - 1; i >= 0; i--) {
-		auto value = state.stack.top();
-		state.stack.pop();
-		next.locals[i].value = value;
-		next.locals[i].type = params[i];
+/* every opcode of Opcodes.def, in the order of its handlers */
+static constexpr uint8_t opcodes[] = {
+#define BEARWASM_OPCODE(name, opcode, size, label, asm_label) opcode,
+#include <bearwasm/Opcodes.def>
+#undef BEARWASM_OPCODE
+};
+
+/* the handler in run() of every opcode, unknown ones included */
+struct HandlerTable {
+	HandlerTable(void *unknown, void *const *handlers) {
+		for (auto &entry : entries)
+			entry = unknown;
+		for (size_t i = 0; i < sizeof(opcodes); i++)
+			entries[opcodes[i]] = handlers[i];
 	}
+
+	void *entries[256];
+};
+
+/* the arguments stay where they are, the results replace them */
+static void invoke_native(InterpreterState &state, int idx) {
+	auto &native = state.functions[idx].native;
+	auto base = state.stack.size() - native.num_parameters;
+	native.thunk(native.function, &state, state.stack.begin() + base);
+	state.stack.resize(base + native.num_results);
 }
 
-static void invoke_function(InterpreterState &state, int idx,
-		const Expression *expression) {
-	FunctionInstance &instance = state.functions[idx];
-	if (instance.type == FUNCTION_NATIVE) {
-		auto value = instance.native_handler(&state);
-		state.stack.push(value);
-		return;
+/* false while a native call is blocked, else puts its result in place */
+static bool call_finished(InterpreterState &state) {
+	if (__atomic_load_n(&state.blocked, __ATOMIC_ACQUIRE))
+		return false;
+	if (state.has_call_result) {
+		state.stack[state.stack.size() - 1] = state.call_result;
+		state.has_call_result = false;
 	}
+	return true;
+}
 
-	pop_args(state, idx);
-
-	Frame frame;
-	frame.pc = state.pc;
-	frame.prev = state.current_function;
-	frame.prev_expr = expression;
-	frame.labelstack_size = state.labelstack.size();
-	state.callstack.push(frame);
-
-	state.current_function = idx;
-	state.pc = 0;
-	const auto num_params = state.functions[idx].signature.
-		parameters.size();
-	const auto num_locals = state.functions[idx].locals.size();
-	for (auto i = num_params; i < num_locals; i++)
-		state.functions[idx].locals[i].value.int32_val = 0;
+static int64_t slice_size(uint64_t budget, uint64_t fuel) {
+	auto size = budget < fuel ? budget : fuel;
+	return size < INT64_MAX ? static_cast<int64_t>(size) : INT64_MAX;
 }
 
-bool Interpreter::interpret(InterpreterState &state) {
-	uint64_t num_instr = 0;
+/* kept apart from the setjmp in interpret(), which would pessimize it */
+__attribute__((noinline))
+static ExecutionStatus run(InterpreterState &state, uint64_t budget) {
+	if (!call_finished(state))
+		return EXECUTION_BLOCKED;
+	if (!state.fuel)
+		return EXECUTION_OUT_OF_FUEL;
+	const auto slice = slice_size(budget, state.fuel);
+	int64_t remaining = slice;
+	const auto deadline = state.epoch_deadline;
 	auto &current_function = state.current_function;
 	auto pc = state.pc;
 	auto &functions = state.functions;
+	const Callee *callees = state.callees.data();
 	auto &stack = state.stack;
-	auto &memory = state.memory[0];
-	const Expression *expression = &functions[current_function]
-		.expression;
-
-	static void *dispatch_table[255] = {};
-	std::fill_n(dispatch_table, 255, &&instr_unknown);
-	dispatch_table[I_32_CONST] = &&i_32_const;
-	dispatch_table[I_64_CONST] = &&i_64_const;
-	dispatch_table[GLOBAL_GET] = &&global_get;
-	dispatch_table[GLOBAL_SET] = &&global_set;
-	dispatch_table[LOCAL_SET] = &&local_set;
-	dispatch_table[LOCAL_GET] = &&local_get;
-	dispatch_table[LOCAL_TEE] = &&local_tee;
-	dispatch_table[I_32_EQZ] = &&i_32_eqz;
-	dispatch_table[I_32_EQ] = &&i_32_eq;
-	dispatch_table[I_32_NE] = &&i_32_ne;
-	dispatch_table[I_32_LT_S] = &&i_32_lt_s;
-	dispatch_table[I_32_LT_U] = &&i_32_lt_u;
-	dispatch_table[I_32_GT_S] = &&i_32_gt_s;
-	dispatch_table[I_32_GT_U] = &&i_32_gt_u;
-	dispatch_table[I_32_LE_S] = &&i_32_le_s;
-	dispatch_table[I_32_LE_U] = &&i_32_le_u;
-	dispatch_table[I_32_ADD] = &&i_32_add;
-	dispatch_table[I_32_SUB] = &&i_32_sub;
-	dispatch_table[I_32_MUL] = &&i_32_mul;
-	dispatch_table[I_32_AND] = &&i_32_and;
-	dispatch_table[I_32_OR] = &&i_32_or;
-	dispatch_table[I_32_SHL] = &&i_32_shl;
-	dispatch_table[I_32_SHR_S] = &&i_32_shr_s;
-	dispatch_table[I_32_DIV_S] = &&i_32_div_s;
-	dispatch_table[I_32_REM_S] = &&i_32_rem_s;
-	dispatch_table[I_32_STORE] = &&i_32_store;
-	dispatch_table[I_32_LOAD] = &&i_32_load;
-	dispatch_table[I_32_LOAD_8_U] = &&i_32_load_8_u;
-	dispatch_table[I_32_LOAD_8_S] = &&i_32_load_8_s;
-	dispatch_table[INSTR_CALL] = &&instr_call;
-	dispatch_table[INSTR_RETURN] = &&instr_return;
-	dispatch_table[INSTR_BLOCK] = &&instr_block;
-	dispatch_table[INSTR_LOOP] = &&instr_loop;
-	dispatch_table[INSTR_IF] = &&instr_if;
-	dispatch_table[BR] = &&br;
-	dispatch_table[BR_IF] = &&br_if;
-	dispatch_table[INSTR_DROP] = &&instr_drop;
-	dispatch_table[INSTR_SELECT] = &&instr_select;
-	dispatch_table[INSTR_END] = &&instr_end;
+	/* nullptr without memory, nothing can access it then */
+	auto memory = state.memory.data();
+	const Expression *expression = callees[current_function].expression;
+	/* the stack never moves, this stays valid until the next call
+	 * or return */
+	Value *locals = stack.begin() + state.locals;
+	/* set by call and call_indirect */
+	uint32_t callee;
+
+	static void *const handlers[] = {
+#define BEARWASM_OPCODE(name, opcode, size, label, asm_label) &&label,
+#include <bearwasm/Opcodes.def>
+#undef BEARWASM_OPCODE
+	};
+	/* indexed by the opcode itself, so dispatch is a single load */
+	static const HandlerTable table{&&instr_unknown, handlers};
 #define DISPATCH() log_debug("pc %d\n", pc); \
 	instruction = (*expression)[pc++]; \
-	num_instr++; \
     log_debug("instr %d\n", instruction.type); \
-	goto *dispatch_table[instruction.type];
+	goto *table.entries[static_cast<uint8_t>(instruction.type)];
+/* for the instructions that end a basic block, after they moved pc to
+ * where execution continues. That is where a resume starts. */
+#define CHARGE_DISPATCH() remaining -= instruction.cost; \
+	if (__builtin_expect(remaining < 0, 0)) { \
+		state.pc = pc; \
+		goto out_of_budget; \
+	} \
+	DISPATCH();
+/* only where execution can repeat, straight-line code never checks */
+#define CHECK_EPOCH() if (__builtin_expect(current_epoch() >= deadline, 0)) { \
+		remaining -= instruction.cost; \
+		state.pc = pc; \
+		LEAVE(EXECUTION_INTERRUPTED); \
+	}
+#define TRAP(kind) { \
+		state.trap = kind; \
+		state.pc = pc - 1; \
+		LEAVE(EXECUTION_TRAPPED); \
+	}
+/* labels the current function opened, branching past them returns */
+#define FUNCTION_LABELS() (state.labelstack.size() \
+		- state.callstack.top().labelstack_size)
+/* the fuel used can exceed what was left by part of a block */
+#define LEAVE(status) { \
+		auto used = static_cast<uint64_t>(slice - remaining); \
+		state.fuel = used < state.fuel ? state.fuel - used : 0; \
+		return status; \
+	}
 
 	while (pc < expression->size()) {
-		num_instr++;
 		Instruction instruction;
 		DISPATCH();
 		i_32_const: {
@@ -112,7 +120,14 @@ bool Interpreter::interpret(InterpreterState &state) {
 			stack.emplace(instruction.arg.int64_val);
 			DISPATCH();
 		}
-		/* TODO: floating point const instructions */
+		f_32_const: {
+			stack.emplace(instruction.arg.float_val);
+			DISPATCH();
+		}
+		f_64_const: {
+			stack.emplace(instruction.arg.double_val);
+			DISPATCH();
+		}
 		global_get: {
 			auto idx = instruction.arg.uint32_val;
 			stack.push(state.globals[idx].value);
@@ -126,23 +141,18 @@ bool Interpreter::interpret(InterpreterState &state) {
 		}
 		local_set: {
 			auto idx = instruction.arg.uint32_val;
-			state.functions[current_function].locals[idx].
-				value = stack.top();
+			locals[idx] = stack.top();
 			stack.pop();
 			DISPATCH();
 		}
 		local_get: {
 			auto idx = instruction.arg.uint32_val;
-			auto local = state.functions[current_function].
-				locals[idx];
-			stack.push(local.value);
+			stack.push(locals[idx]);
 			DISPATCH();
 		}
 		local_tee: {
 			auto idx = instruction.arg.uint32_val;
-			auto value = stack.top();
-			state.functions[current_function].locals[idx].
-				value = value;
+			locals[idx] = stack.top();
 			DISPATCH();
 		}
 		i_32_eqz: {
@@ -277,6 +287,11 @@ bool Interpreter::interpret(InterpreterState &state) {
 			stack.pop();
 			auto arg1 = stack.top();
 			stack.pop();
+			if (__builtin_expect(!arg2.int32_val, 0))
+				TRAP(TRAP_DIVIDE_BY_ZERO);
+			if (__builtin_expect(arg2.int32_val == -1
+						&& arg1.int32_val == INT32_MIN, 0))
+				TRAP(TRAP_INTEGER_OVERFLOW);
 			stack.emplace(arg1.int32_val / arg2.int32_val);
 			DISPATCH();
 		}
@@ -285,7 +300,47 @@ bool Interpreter::interpret(InterpreterState &state) {
 			stack.pop();
 			auto arg1 = stack.top();
 			stack.pop();
-			stack.emplace(arg1.int32_val % arg2.int32_val);
+			if (__builtin_expect(!arg2.int32_val, 0))
+				TRAP(TRAP_DIVIDE_BY_ZERO);
+			/* INT32_MIN % -1 is undefined in C++ but 0 in wasm */
+			if (__builtin_expect(arg2.int32_val == -1, 0))
+				stack.emplace(0);
+			else
+				stack.emplace(arg1.int32_val % arg2.int32_val);
+			DISPATCH();
+		}
+		i_64_add: {
+			auto arg2 = stack.top();
+			stack.pop();
+			auto arg1 = stack.top();
+			stack.pop();
+			stack.emplace(arg1.uint64_val + arg2.uint64_val);
+			DISPATCH();
+		}
+		i_64_sub: {
+			auto arg2 = stack.top();
+			stack.pop();
+			auto arg1 = stack.top();
+			stack.pop();
+			stack.emplace(arg1.uint64_val - arg2.uint64_val);
+			DISPATCH();
+		}
+		i_64_mul: {
+			auto arg2 = stack.top();
+			stack.pop();
+			auto arg1 = stack.top();
+			stack.pop();
+			stack.emplace(arg1.uint64_val * arg2.uint64_val);
+			DISPATCH();
+		}
+		i_64_div_u: {
+			auto arg2 = stack.top();
+			stack.pop();
+			auto arg1 = stack.top();
+			stack.pop();
+			if (__builtin_expect(!arg2.uint64_val, 0))
+				TRAP(TRAP_DIVIDE_BY_ZERO);
+			stack.emplace(arg1.uint64_val / arg2.uint64_val);
 			DISPATCH();
 		}
 		i_32_store: {
@@ -294,23 +349,20 @@ bool Interpreter::interpret(InterpreterState &state) {
 			stack.pop();
 			auto i = stack.top().int32_val;
 			stack.pop();
-			auto limit = static_cast<int>(
-					i + memarg.offset + 4);
-			if (limit > memory.get_size())
-				panic("Reading too far!");
+			if (!memory->in_bounds(i, memarg.offset, sizeof(int32_t)))
+				TRAP(TRAP_OUT_OF_BOUNDS);
 			log_debug("Storing at: %d\n", i + memarg.offset);
-			memory.store<int32_t>(t, i + memarg.offset);
+			memory->store<int32_t>(t, i + memarg.offset);
 			DISPATCH();
 		}
 		i_32_load: {
 			auto memarg = instruction.arg.memarg;
 			auto i = stack.top().int32_val;
-			auto limit = static_cast<int>(i +
-					memarg.offset + 4);
-			if (limit > memory.get_size())
-				panic("Reading too far!");
+			stack.pop();
+			if (!memory->in_bounds(i, memarg.offset, sizeof(int32_t)))
+				TRAP(TRAP_OUT_OF_BOUNDS);
 			log_debug("reading from %d\n", i + memarg.offset);
-			auto result = memory.load<int32_t>(i + memarg.offset);
+			auto result = memory->load<int32_t>(i + memarg.offset);
 			stack.emplace(result);
 			DISPATCH();
 		}
@@ -318,103 +370,218 @@ bool Interpreter::interpret(InterpreterState &state) {
 			auto memarg = instruction.arg.memarg;
 			auto i = stack.top().int32_val;
 			stack.pop();
-			auto limit = static_cast<int>(i +
-					memarg.offset + 4);
-			if (limit > memory.get_size())
-				panic("Reading too far!");
+			if (!memory->in_bounds(i, memarg.offset, sizeof(uint8_t)))
+				TRAP(TRAP_OUT_OF_BOUNDS);
 			log_debug("reading from %d\n", i + memarg.offset);
-			auto result = memory.load<uint8_t>(i + memarg.offset);
+			auto result = memory->load<uint8_t>(i + memarg.offset);
 			stack.emplace(result);
 			DISPATCH();
 		}
 		i_32_load_8_s: {
 			auto memarg = instruction.arg.memarg;
-			auto i = stack.top().int32_val;;
+			auto i = stack.top().int32_val;
 			stack.pop();
-			auto limit = static_cast<int>(i +
-					memarg.offset + 4);
-			if (limit > memory.get_size())
-				panic("Reading too far!");
+			if (!memory->in_bounds(i, memarg.offset, sizeof(int8_t)))
+				TRAP(TRAP_OUT_OF_BOUNDS);
 			log_debug("reading from %d\n", i + memarg.offset);
-			auto result = memory.load<int8_t>(i + memarg.offset);
+			auto result = memory->load<int8_t>(i + memarg.offset);
 			stack.emplace(result);
 			DISPATCH();
 		}
-		instr_call: {
-			auto idx = instruction.arg.uint32_val;
-			state.pc = pc;
-			invoke_function(state, idx, expression);
-			pc = state.pc;
-			expression = &functions[current_function].expression;
+		/* BoundsChecks proved these in bounds, see Opcodes.def */
+		i_32_store_unchecked: {
+			auto memarg = instruction.arg.memarg;
+			auto t = stack.top().int32_val;
+			stack.pop();
+			auto i = stack.top().int32_val;
+			stack.pop();
+			memory->store<int32_t>(t, i + memarg.offset);
+			DISPATCH();
+		}
+		i_32_load_unchecked: {
+			auto memarg = instruction.arg.memarg;
+			auto i = stack.top().int32_val;
+			stack.pop();
+			stack.emplace(memory->load<int32_t>(i + memarg.offset));
+			DISPATCH();
+		}
+		i_32_load_8_u_unchecked: {
+			auto memarg = instruction.arg.memarg;
+			auto i = stack.top().int32_val;
+			stack.pop();
+			stack.emplace(memory->load<uint8_t>(i + memarg.offset));
 			DISPATCH();
 		}
+		i_32_load_8_s_unchecked: {
+			auto memarg = instruction.arg.memarg;
+			auto i = stack.top().int32_val;
+			stack.pop();
+			stack.emplace(memory->load<int8_t>(i + memarg.offset));
+			DISPATCH();
+		}
+		memory_fits: {
+			auto address = stack.top().uint32_val;
+			stack.pop();
+			stack.emplace(static_cast<int32_t>(memory->in_bounds(
+						address, 0,
+						instruction.arg.uint64_val)));
+			DISPATCH();
+		}
+		instr_call_indirect: {
+			auto call = instruction.arg.indirect;
+			auto slot = stack.top().uint32_val;
+			stack.pop();
+			/* a repeated slot was checked when it was cached */
+			auto &cache = state.indirect_caches[call.site];
+			if (slot != cache.slot) {
+				auto &table = state.tables[call.table]
+					.function_address;
+				if (slot >= table.size())
+					TRAP(TRAP_UNDEFINED_ELEMENT);
+				auto function = table[slot];
+				if (function < 0)
+					TRAP(TRAP_UNINITIALIZED_ELEMENT);
+				if (functions[function].type_id != call.type)
+					TRAP(TRAP_INDIRECT_CALL_MISMATCH);
+				cache.slot = slot;
+				cache.function = function;
+			}
+			callee = cache.function;
+			goto call_function;
+		}
+		instr_call:
+			callee = instruction.arg.uint32_val;
+		call_function: {
+			const auto &target = callees[callee];
+			if (__builtin_expect(!target.expression, 0)) {
+				state.pc = pc;
+				invoke_native(state, callee);
+				if (!call_finished(state)) {
+					remaining -= instruction.cost;
+					LEAVE(EXECUTION_BLOCKED);
+				}
+				CHECK_EPOCH();
+				CHARGE_DISPATCH();
+			}
+
+			Frame frame;
+			frame.pc = pc;
+			frame.labelstack_size = state.labelstack.size();
+			frame.prev = current_function;
+			frame.locals = state.locals;
+			state.callstack.push(frame);
+
+			state.locals = stack.size() - target.num_params;
+			locals = stack.begin() + state.locals;
+			for (auto i = target.num_params; i < target.frame_size; i++)
+				stack.emplace(static_cast<uint64_t>(0));
+			current_function = callee;
+			expression = target.expression;
+			pc = 0;
+			CHECK_EPOCH();
+			CHARGE_DISPATCH();
+		}
 		instr_return: {
 			auto frame = state.callstack.top();
 			state.callstack.pop();
-			if (frame.pc == PC_END) return true;
-			pc = frame.pc;
-			state.current_function = frame.prev;
-			expression = frame.prev_expr;
 
-			//restore labelstack
-			const auto size = state.labelstack.size();
-			for (size_t i = frame.labelstack_size; i < size; i++)
-				state.labelstack.pop();
-			DISPATCH();
+			/* the results go where the arguments were */
+			auto num_results = callees[current_function].num_results;
+			auto results = stack.end() - num_results;
+			for (uint32_t i = 0; i < num_results; i++)
+				locals[i] = results[i];
+			stack.resize(state.locals + num_results);
+			if (frame.pc == PC_END) {
+				remaining -= instruction.cost;
+				LEAVE(EXECUTION_FINISHED);
+			}
+
+			pc = frame.pc;
+			current_function = frame.prev;
+			expression = callees[frame.prev].expression;
+			state.locals = frame.locals;
+			locals = stack.begin() + frame.locals;
+			state.labelstack.resize(frame.labelstack_size);
+			CHARGE_DISPATCH();
 		}
 		instr_block: {
 			auto arg = instruction.arg.block;
 
 			Label label;
 			label.pc_cont = pc + arg.size;
+			label.loop = false;
 			state.labelstack.push(label);
-			DISPATCH();
+			CHARGE_DISPATCH();
 		}
 		instr_loop: {
 			Label label;
-			label.pc_cont = pc - 1;
+			label.pc_cont = pc;
+			label.loop = true;
 			state.labelstack.push(label);
-			DISPATCH();
+			CHARGE_DISPATCH();
+		}
+		instr_if: {
+			auto c = stack.top().int32_val;
+			stack.pop();
+			auto arg = instruction.arg.block;
+
+			/* size points just past the else if there is one,
+			 * otherwise past the end */
+			Label label;
+			label.pc_cont = pc + arg.size;
+			label.loop = false;
+			if ((*expression)[label.pc_cont - 1].type == INSTR_ELSE)
+				label.pc_cont += (*expression)[label.pc_cont - 1]
+					.arg.block.size;
+			if (c) {
+				state.labelstack.push(label);
+			} else {
+				pc += arg.size;
+				if (pc != label.pc_cont)
+					state.labelstack.push(label);
+			}
+			CHARGE_DISPATCH();
+		}
+		instr_else: {
+			/* end of the taken branch, skip the else branch */
+			pc += instruction.arg.block.size;
+			state.labelstack.pop();
+			CHARGE_DISPATCH();
 		}
-                instr_if: {
-                         auto c = stack.top().int32_val;
-			 stack.pop();
-                         auto arg = instruction.arg.block;
-
-                         Label label;
-                         label.pc_cont = pc + arg.size;
-                         state.labelstack.push(label);
-                         if (c) {
-                                 DISPATCH();
-                         } else {
-                                 /* TODO: properly handle else clause */
-                                 pc = label.pc_cont;
-				 state.labelstack.pop();
-                                 DISPATCH();
-                         }
-                }
 		br: {
 			auto idx = instruction.arg.uint32_val;
+			if (idx >= FUNCTION_LABELS())
+				goto instr_return;
 			for (unsigned int i = 0; i < idx; i++)
 				state.labelstack.pop();
-			auto &label = state.labelstack.top();
-			state.labelstack.pop();
+			auto label = state.labelstack.top();
 			pc = label.pc_cont;
-			DISPATCH();
+			if (label.loop) {
+				CHECK_EPOCH();
+			} else {
+				state.labelstack.pop();
+			}
+			CHARGE_DISPATCH();
 		}
 		br_if: {
 			auto c = stack.top().int32_val;
 			stack.pop();
 			if (!c) {
-				DISPATCH();
+				CHARGE_DISPATCH();
 			}
 			auto idx = instruction.arg.uint32_val;
+			if (idx >= FUNCTION_LABELS())
+				goto instr_return;
 			for (unsigned int i = 0; i < idx; i++)
 				state.labelstack.pop();
-			auto &label = state.labelstack.top();
-			state.labelstack.pop();
+			auto label = state.labelstack.top();
 			pc = label.pc_cont;
-			DISPATCH();
+			if (label.loop) {
+				CHECK_EPOCH();
+			} else {
+				state.labelstack.pop();
+			}
+			CHARGE_DISPATCH();
 		}
 		instr_drop: {
 			stack.pop();
@@ -432,103 +599,306 @@ bool Interpreter::interpret(InterpreterState &state) {
 			DISPATCH();
 		}
 		instr_end: {
-			if (state.labelstack.empty()) {
-				return true;
-			}
+			/* the end of the function body */
+			if (!FUNCTION_LABELS())
+				goto instr_return;
 			state.labelstack.pop();
+			CHARGE_DISPATCH();
+		}
+		instr_nop: {
 			DISPATCH();
 		}
+		instr_unreachable: {
+			TRAP(TRAP_UNREACHABLE);
+		}
 		instr_unknown: {
 				panic("Unknown instruction encountered %d",
-						(*expression)[pc].type);
+						instruction.type);
+		}
+	}
+	LEAVE(EXECUTION_FINISHED);
+
+out_of_budget:
+	LEAVE(state.fuel <= static_cast<uint64_t>(slice - remaining) ?
+			EXECUTION_OUT_OF_FUEL : EXECUTION_SUSPENDED);
+}
+
+ExecutionStatus Interpreter::interpret(InterpreterState &state,
+		uint64_t budget) {
+	TrapContext context;
+	context.state = &state;
+	context.prev = static_cast<TrapContext*>(bearwasm_get_trap_context());
+	bearwasm_set_trap_context(&context);
+
+	/* a trap left from an earlier run is not this one's */
+	state.trap = TRAP_NONE;
+	ExecutionStatus status;
+	if (__builtin_setjmp(context.jump_buffer))
+		status = EXECUTION_TRAPPED;
+	else
+		status = run(state, budget);
+
+	bearwasm_set_trap_context(context.prev);
+	return status;
+}
+
+/*
+ * Evaluates a constant expression (global initializers and segment
+ * offsets) straight from the stream. Only constants, global.get and
+ * the extended-const arithmetic are allowed there, so a small fixed
+ * stack is enough and nothing needs to be decoded or allocated.
+ */
+static frg::optional<Value> evaluate_constant(DataStream *stream,
+		const Globals &globals) {
+	static constexpr int CONSTANT_STACK_SIZE = 16;
+	Value stack[CONSTANT_STACK_SIZE];
+	int sp = 0;
+
+	while (true) {
+		auto instruction = stream_read<Instructions>(stream);
+		if (!instruction)
+			return frg::null_opt;
+
+		switch (*instruction) {
+			case INSTR_END:
+				if (sp != 1)
+					return frg::null_opt;
+				return stack[0];
+			case I_32_ADD:
+			case I_32_SUB:
+			case I_32_MUL:
+			case I_64_ADD:
+			case I_64_SUB:
+			case I_64_MUL: {
+				if (sp < 2)
+					return frg::null_opt;
+				auto arg2 = stack[--sp];
+				auto arg1 = stack[--sp];
+				switch (*instruction) {
+					case I_32_ADD:
+						stack[sp++] = arg1.uint32_val + arg2.uint32_val;
+						break;
+					case I_32_SUB:
+						stack[sp++] = arg1.uint32_val - arg2.uint32_val;
+						break;
+					case I_32_MUL:
+						stack[sp++] = arg1.uint32_val * arg2.uint32_val;
+						break;
+					case I_64_ADD:
+						stack[sp++] = arg1.uint64_val + arg2.uint64_val;
+						break;
+					case I_64_SUB:
+						stack[sp++] = arg1.uint64_val - arg2.uint64_val;
+						break;
+					default:
+						stack[sp++] = arg1.uint64_val * arg2.uint64_val;
+						break;
+				}
+				continue;
+			}
+			default:
+				break;
+		}
+
+		if (sp == CONSTANT_STACK_SIZE)
+			return frg::null_opt;
+
+		switch (*instruction) {
+			case I_32_CONST: {
+				auto value = decode_varint<int32_t>(stream);
+				if (!value)
+					return frg::null_opt;
+				stack[sp++] = *value;
+				break;
+			}
+			case I_64_CONST: {
+				auto value = decode_varint<int64_t>(stream);
+				if (!value)
+					return frg::null_opt;
+				stack[sp++] = *value;
+				break;
+			}
+			case F_32_CONST: {
+				auto value = stream_read<float>(stream);
+				if (!value)
+					return frg::null_opt;
+				stack[sp++] = *value;
+				break;
+			}
+			case F_64_CONST: {
+				auto value = stream_read<double>(stream);
+				if (!value)
+					return frg::null_opt;
+				stack[sp++] = *value;
+				break;
+			}
+			case GLOBAL_GET: {
+				auto idx = decode_varuint<uint32_t>(stream);
+				if (!idx || *idx >= globals.size())
+					return frg::null_opt;
+				stack[sp++] = globals[*idx].value;
+				break;
+			}
+			default:
+				log_warn("Instruction %d is not allowed in a "
+						"constant expression\n", *instruction);
+				return frg::null_opt;
 		}
 	}
-	return true;
 }
 
-frg::optional<GlobalValue> Interpreter::interpret_global(
-		DataStream *stream) {
+frg::optional<GlobalValue> Interpreter::interpret_global(DataStream *stream,
+		const Globals &globals) {
 	GlobalValue ret;
 	auto type = stream_read<BinaryType>(stream);
 	if (!type)
 	    panic("Could not read global type");
 	ret.type = *type;
-	ret.mut = static_cast<bool>(stream->get());
-
-	InterpreterState state;
-	state.functions.resize(1);
-	/* TODO: write a span so we can avoid copies */
-	auto start_pos = stream->tell();
-	state.functions[0].expression = decode_code(stream);
-	state.functions[0].size = stream->tell() - start_pos;
-	state.current_function = 0;
-	if(!interpret(state)) return frg::null_opt;
-
-	ret.value = state.stack.top();
-	state.stack.pop();
+	auto mut = stream_read<uint8_t>(stream);
+	if (!mut)
+		return frg::null_opt;
+	ret.mut = *mut;
+
+	auto value = evaluate_constant(stream, globals);
+	if (!value)
+		return frg::null_opt;
+	ret.value = *value;
 	return ret;
 }
 
-frg::optional<uint32_t> Interpreter::interpret_offset(
-		DataStream *stream) {
-	InterpreterState state;
-	state.functions.resize(1);
-	/* TODO: write a span so we can avoid copies */
-	auto start_pos = stream->tell();
-	state.functions[0].expression = decode_code(stream);
-	state.functions[0].size = stream->tell() - start_pos;
-	state.current_function = 0;
-	if(!interpret(state)) return frg::null_opt;
-
-	return state.stack.top().uint32_val;
+frg::optional<uint32_t> Interpreter::interpret_offset(DataStream *stream,
+		const Globals &globals) {
+	auto value = evaluate_constant(stream, globals);
+	if (!value)
+		return frg::null_opt;
+	return value->uint32_val;
 }
 
-frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
-        DataStream *stream) {
-	frg::vector<Instruction, frg_allocator> ret;
+/* every branch target is right after one of these */
+static bool ends_block(uint32_t type) {
+	switch (type) {
+		case INSTR_UNREACHABLE:
+		case INSTR_BLOCK:
+		case INSTR_LOOP:
+		case INSTR_IF:
+		case INSTR_ELSE:
+		case INSTR_END:
+		case BR:
+		case BR_IF:
+		case INSTR_RETURN:
+		case INSTR_CALL:
+		case INSTR_CALL_INDIRECT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void Interpreter::assign_block_sizes(Expression &out) {
+	frg::vector<size_t, frg_allocator> control;
+	for (size_t i = 0; i < out.size(); i++) {
+		switch (out[i].type) {
+			case INSTR_BLOCK:
+			case INSTR_LOOP:
+			case INSTR_IF:
+				control.push(i);
+				break;
+			case INSTR_ELSE: {
+				auto &start = control[control.size() - 1];
+				out[start].arg.block.size = i - start;
+				start = i;
+				break;
+			}
+			case INSTR_END: {
+				if (control.empty())
+					break;
+				auto start = control[control.size() - 1];
+				control.resize(control.size() - 1);
+				out[start].arg.block.size = i - start;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+void Interpreter::assign_costs(Expression &out) {
+	uint32_t length = 0;
+	for (auto &inst : out) {
+		length++;
+		if (ends_block(inst.type)) {
+			inst.cost = length;
+			length = 0;
+		}
+	}
+}
+
+/*
+ * Decodes a single expression straight into out. Nested blocks are
+ * tracked on an explicit control stack holding the index of their
+ * opening instruction, whose size is patched once the matching end
+ * (or else) is reached.
+ */
+void Interpreter::decode_code(DataStream *stream, Expression &out) {
+	frg::vector<size_t, frg_allocator> control;
 
-	auto instruction = stream_read<Instructions>(stream);
-	if (!instruction)
-		panic("Unable to read instruction");
 	while (true) {
+		auto instruction = stream_read<Instructions>(stream);
+		if (!instruction)
+			panic("Unable to read instruction");
+
 		Instruction inst;
+		inst.type = *instruction;
+		inst.cost = 0;
 
 		if (*instruction == INSTR_END) {
-			inst.type = *instruction;
-			ret.push(inst);
-			return ret;
+			out.push(inst);
+			if (control.empty()) {
+				assign_costs(out);
+				return;
+			}
+			auto start = control[control.size() - 1];
+			control.resize(control.size() - 1);
+			out[start].arg.block.size = out.size() - 1 - start;
+			continue;
+		}
+
+		if (*instruction == INSTR_ELSE) {
+			if (control.empty() ||
+					out[control[control.size() - 1]].type
+					!= INSTR_IF)
+				panic("else without matching if");
+			/* the if jumps to the start of the else branch, the
+			 * else itself jumps past the end */
+			auto &start = control[control.size() - 1];
+			out[start].arg.block.size = out.size() - start;
+			start = out.size();
+			inst.arg.block.type = EMPTY;
+			out.push(inst);
+			continue;
 		}
 
-		auto arg_size = instruction_sizes.find(*instruction);
-		if (arg_size == instruction_sizes.end())
+		auto arg_size = instruction_sizes[*instruction];
+		if (arg_size == SIZE_UNKNOWN || arg_size == SIZE_INTERNAL)
 			panic("Don't know size of instruction %d",
 				*instruction);
 
-		switch (arg_size->template get<1>()) {
+		switch (arg_size) {
 			case SIZE_BLOCK: {
-				/* TODO: free this somewhere */
-				Block block;
 				auto type = stream_read<BinaryType>(stream);
 				if (!type)
 					panic("Unable to read block type");
-				block.type = *type;
-
-				auto instructions = decode_code(stream);
-				block.size = instructions.size();
-				inst.arg.block = block;
-				inst.type = *instruction;
-				ret.push(inst);
-				std::copy(instructions.begin(), instructions.end(),
-						std::back_inserter(ret));
-				instruction = stream_read<Instructions>(stream);
-				continue;
+				inst.arg.block.type = *type;
+				inst.arg.block.size = 0;
+				control.push(out.size());
+				break;
 			}
 			case SIZE_U8: {
 				auto value = stream_read<uint8_t>(stream);
 				if (!value)
 					panic("Unable to read value");
 				inst.arg.uint8_val = *value;
-				inst.type = *instruction;
 				break;
 			}
 			case SIZE_I32: {
@@ -536,7 +906,6 @@ frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
 				if (!value)
 					panic("Unable to read value");
 				inst.arg.int32_val = *value;
-				inst.type = *instruction;
 				break;
 			}
 			case SIZE_I64: {
@@ -544,7 +913,6 @@ frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
 				if (!value)
 					panic("Unable to read value");
 				inst.arg.int64_val = *value;
-				inst.type = *instruction;
 				break;
 			}
 			case SIZE_U32: {
@@ -552,7 +920,6 @@ frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
 				if (!value)
 					panic("Unable to read value");
 				inst.arg.uint32_val = *value;
-				inst.type = *instruction;
 				break;
 			}
 			case SIZE_U64: {
@@ -560,13 +927,24 @@ frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
 				if (!value)
 					panic("Unable to read value");
 				inst.arg.uint64_val = *value;
-				inst.type = *instruction;
 				break;
 			}
-			case SIZE_0: {
-				inst.type = *instruction;
+			case SIZE_F32: {
+				auto value = stream_read<float>(stream);
+				if (!value)
+					panic("Unable to read value");
+				inst.arg.float_val = *value;
+				break;
+			}
+			case SIZE_F64: {
+				auto value = stream_read<double>(stream);
+				if (!value)
+					panic("Unable to read value");
+				inst.arg.double_val = *value;
 				break;
 			}
+			case SIZE_0:
+				break;
 			case SIZE_MEMARG: {
 				auto align = decode_varuint<uint32_t>(stream);
 				auto offset = decode_varuint<uint32_t>(stream);
@@ -577,18 +955,259 @@ frg::vector<Instruction, frg_allocator> Interpreter::decode_code(
 				arg.offset = *offset;
 
 				inst.arg.memarg = arg;
-				inst.type = *instruction;
+				break;
+			}
+			case SIZE_INDIRECT: {
+				auto type = decode_varuint<uint32_t>(stream);
+				auto table = decode_varuint<uint32_t>(stream);
+				if (!type || !table)
+					panic("Unable to read value");
+				if (*table > 0xff)
+					panic("call_indirect on table %d", *table);
+				inst.arg.indirect.type = *type;
+				inst.arg.indirect.site = 0;
+				inst.arg.indirect.table = *table;
 				break;
 			}
 			default:
 				panic("Unable to handle size");
 		}
-		ret.push(inst);
+		out.push(inst);
+	}
+}
+
+MemoryInstance::MemoryInstance(int size) :
+	size(0), initial_size(size * PAGE_SIZE), capacity(0), bytes(nullptr),
+	image(nullptr), image_offset(0), owned(true) {
+	resize(size);
+}
+
+MemoryInstance::MemoryInstance(int size, void *image, size_t image_offset) :
+	size(0), initial_size(size * PAGE_SIZE), capacity(0), bytes(nullptr),
+	image(image), image_offset(image_offset), owned(true) {
+	map_image();
+}
 
-		instruction = stream_read<Instructions>(stream);
+MemoryInstance::MemoryInstance(char *base, int size) :
+	size(size * PAGE_SIZE), initial_size(size * PAGE_SIZE),
+	capacity(size * PAGE_SIZE), bytes(base), image(nullptr),
+	image_offset(0), owned(false) {
+	dirty.resize((num_dirty_pages() + 63) / 64);
+	clear_dirty();
+}
+
+/* (re)maps the initial size from the image, all pages clean */
+void MemoryInstance::map_image() {
+	if (bytes)
+		bearwasm_unmap_memory(bytes, capacity);
+	size = initial_size;
+	capacity = initial_size;
+	bytes = nullptr;
+	if (capacity) {
+		bytes = static_cast<char*>(bearwasm_map_image(image,
+					image_offset, capacity));
+		if (!bytes)
+			panic("Unable to map %d bytes of snapshot\n", size);
 	}
 
-	return ret;
+	dirty.resize((num_dirty_pages() + 63) / 64);
+	clear_dirty();
+}
+
+MemoryInstance::MemoryInstance(MemoryInstance &&other) :
+	size(other.size), initial_size(other.initial_size),
+	capacity(other.capacity), bytes(other.bytes), image(other.image),
+	image_offset(other.image_offset), owned(other.owned),
+	dirty(std::move(other.dirty)), ranges(std::move(other.ranges)) {
+	other.size = 0;
+	other.capacity = 0;
+	other.bytes = nullptr;
+}
+
+MemoryInstance::~MemoryInstance() {
+	if (bytes && owned)
+		bearwasm_unmap_memory(bytes, capacity);
+}
+
+void MemoryInstance::resize(int new_size) {
+	size_t new_bytes = static_cast<size_t>(new_size) * PAGE_SIZE;
+	if (!owned && new_bytes != static_cast<size_t>(size))
+		panic("Memory from the embedder can not be resized\n");
+	/* moving would copy the ranges and lose their mappings */
+	if (new_bytes > capacity && ranges.size())
+		panic("Memory with mapped ranges can not grow past "
+				"%d pages\n", static_cast<int>(capacity / PAGE_SIZE));
+	if (new_bytes > capacity) {
+		auto new_mapping = static_cast<char*>(
+				bearwasm_map_memory(new_bytes));
+		if (!new_mapping)
+			panic("Unable to map %d pages of memory\n", new_size);
+		if (bytes) {
+			memcpy(new_mapping, bytes, size);
+			bearwasm_unmap_memory(bytes, capacity);
+		}
+		bytes = new_mapping;
+		capacity = new_bytes;
+	} else if (new_bytes < static_cast<size_t>(size)) {
+		/* the tail has to read as zero if it is grown into again */
+		bearwasm_discard_memory(bytes + new_bytes, size - new_bytes);
+	}
+	size = new_bytes;
+
+	auto old_words = dirty.size();
+	dirty.resize((num_dirty_pages() + 63) / 64);
+	for (size_t i = old_words; i < dirty.size(); i++)
+		dirty[i] = 0;
+}
+
+const char *MemoryInstance::string_view(uint32_t address,
+		size_t &length) const {
+	if (address >= static_cast<uint32_t>(size))
+		return nullptr;
+	for (auto p = bytes + address; p < bytes + size; p++) {
+		if (!*p) {
+			length = p - (bytes + address);
+			return bytes + address;
+		}
+	}
+	return nullptr;
+}
+
+bool MemoryInstance::map_range(uint32_t address, size_t size, void *image,
+		size_t offset, bool writable) {
+	if (!owned || !size || address % DIRTY_PAGE_SIZE
+			|| offset % DIRTY_PAGE_SIZE
+			|| !in_bounds(address, 0, size))
+		return false;
+	/* resetting a snapshot's memory maps its initial size again */
+	if (this->image && address + size
+			> static_cast<size_t>(initial_size))
+		return false;
+
+	/* memory sizes are whole wasm pages, so rounding up stays inside */
+	size = (size + DIRTY_PAGE_SIZE - 1) & ~(DIRTY_PAGE_SIZE - 1);
+	if (!bearwasm_map_image_at(bytes + address, image, offset, size,
+				writable))
+		return false;
+	ranges.push(MappedRange{address, size, image, offset, writable});
+
+	/* the image contents are what reset() goes back to */
+	for (auto page = address / DIRTY_PAGE_SIZE;
+			page < (address + size) / DIRTY_PAGE_SIZE; page++)
+		dirty[page / 64] &= ~(static_cast<uint64_t>(1) << (page % 64));
+	return true;
+}
+
+void MemoryInstance::map_ranges() {
+	for (const auto &range : ranges)
+		if (!bearwasm_map_image_at(bytes + range.address, range.image,
+					range.offset, range.size,
+					range.writable))
+			panic("Unable to map a range at %d into memory "
+					"again\n", static_cast<int>(range.address));
+}
+
+bool MemoryInstance::read_only(uint32_t address, size_t size) const {
+	for (const auto &range : ranges)
+		if (!range.writable && address < range.address + range.size
+				&& range.address < address + size)
+			return true;
+	return false;
+}
+
+bool MemoryInstance::gather(uint32_t iovs, uint32_t count,
+		GuestBuffer *buffers, bool writable) {
+	static constexpr uint32_t IOVEC_SIZE = 8;
+	if (!in_bounds(iovs, 0, static_cast<uint64_t>(count) * IOVEC_SIZE))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++) {
+		auto address = load<uint32_t>(iovs + i * IOVEC_SIZE);
+		auto length = load<uint32_t>(iovs + i * IOVEC_SIZE + 4);
+		if (!in_bounds(address, 0, length)
+				|| (writable && read_only(address, length)))
+			return false;
+		buffers[i].base = bytes + address;
+		buffers[i].length = length;
+	}
+
+	if (writable)
+		for (uint32_t i = 0; i < count; i++)
+			mark_dirty(static_cast<char*>(buffers[i].base) - bytes,
+					buffers[i].length);
+	return true;
+}
+
+void MemoryInstance::reset(
+		const frg::vector<DataEntry, ArenaAllocator> &segments,
+		int memidx) {
+	/* whoever lent it decides what it contains */
+	if (!owned) {
+		clear_dirty();
+		return;
+	}
+
+	if (image && size != initial_size) {
+		/* growing copied the image away, map it again */
+		map_image();
+		map_ranges();
+		return;
+	}
+
+	/* the grown part is discarded by resize, the dirty
+	 * bits still describe the rest */
+	size_t floor = initial_size;
+	for (const auto &range : ranges) {
+		auto end = (range.address + range.size + PAGE_SIZE - 1)
+			/ PAGE_SIZE * PAGE_SIZE;
+		if (end > floor)
+			floor = end;
+	}
+	if (static_cast<size_t>(size) != floor)
+		resize(floor / PAGE_SIZE);
+
+	/* discard runs of dirty pages with one call each */
+	auto pages = num_dirty_pages();
+	for (size_t page = 0; page < pages;) {
+		if (!is_dirty(page)) {
+			page++;
+			continue;
+		}
+		auto first = page;
+		while (page < pages && is_dirty(page))
+			page++;
+		auto end = page * DIRTY_PAGE_SIZE;
+		if (end > static_cast<size_t>(size))
+			end = size;
+		bearwasm_discard_memory(bytes + first * DIRTY_PAGE_SIZE,
+				end - first * DIRTY_PAGE_SIZE);
+	}
+
+	for (const auto &segment : segments) {
+		if (image)
+			break;
+		if (segment.memidx != memidx || !segment.bytes.size())
+			continue;
+		size_t start = static_cast<uint32_t>(segment.offset);
+		size_t end = start + segment.bytes.size();
+		for (auto page = start / DIRTY_PAGE_SIZE;
+				page * DIRTY_PAGE_SIZE < end; page++) {
+			if (!is_dirty(page))
+				continue;
+			auto from = page * DIRTY_PAGE_SIZE;
+			auto to = from + DIRTY_PAGE_SIZE;
+			if (from < start)
+				from = start;
+			if (to > end)
+				to = end;
+			if (read_only(from, to - from))
+				continue;
+			memcpy(bytes + from, segment.bytes.data() + (from - start),
+					to - from);
+		}
+	}
+
+	clear_dirty();
 }
 
 } /* namespace bearwasm */
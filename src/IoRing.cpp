@@ -0,0 +1,226 @@
+#include <bearwasm/IoRing.h>
+#include <bearwasm/Util.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace bearwasm {
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned wait_for,
+		unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_for, flags,
+			nullptr, 0);
+}
+
+static uint32_t *ring_field(void *ring, uint32_t offset) {
+	return reinterpret_cast<uint32_t*>(static_cast<char*>(ring) + offset);
+}
+
+IoRing::IoRing(unsigned entries) :
+	ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+	sq_ring_size(0), cq_ring_size(0), sqes(nullptr), sqes_size(0),
+	pending(0), submitted(0), locked(false), waiting(false) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd = io_uring_setup(entries, &params);
+	if (ring_fd < 0)
+		return;
+
+	sq_ring_size = params.sq_off.array
+		+ params.sq_entries * sizeof(uint32_t);
+	cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(io_uring_cqe);
+	/* older kernels map the two rings separately */
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && cq_ring_size > sq_ring_size)
+		sq_ring_size = cq_ring_size;
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (single_mmap)
+		cq_ring = sq_ring;
+	else
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_CQ_RING);
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqe_map != MAP_FAILED)
+		sqes = static_cast<io_uring_sqe*>(sqe_map);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || !sqes) {
+		release();
+		return;
+	}
+
+	sq_head = ring_field(sq_ring, params.sq_off.head);
+	sq_tail = ring_field(sq_ring, params.sq_off.tail);
+	sq_mask = ring_field(sq_ring, params.sq_off.ring_mask);
+	sq_array = ring_field(sq_ring, params.sq_off.array);
+	cq_head = ring_field(cq_ring, params.cq_off.head);
+	cq_tail = ring_field(cq_ring, params.cq_off.tail);
+	cq_mask = ring_field(cq_ring, params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(
+			static_cast<char*>(cq_ring) + params.cq_off.cqes);
+	cq_entries = params.cq_entries;
+}
+
+IoRing::~IoRing() {
+	release();
+}
+
+void IoRing::release() {
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+	sqes = nullptr;
+	sq_ring = cq_ring = MAP_FAILED;
+	ring_fd = -1;
+}
+
+void IoRing::lock() {
+	while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE))
+		;
+}
+
+void IoRing::unlock() {
+	__atomic_clear(&locked, __ATOMIC_RELEASE);
+}
+
+/* hands over what was queued, with the lock held unless wait_for */
+void IoRing::enter(unsigned wait_for) {
+	int ret = io_uring_enter(ring_fd, wait_for ? 0 : pending, wait_for,
+			wait_for ? IORING_ENTER_GETEVENTS : 0);
+	if (ret >= 0) {
+		if (!wait_for) {
+			pending -= ret;
+			submitted += ret;
+		}
+	} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		log_warn("io_uring_enter failed with %d\n", errno);
+	}
+}
+
+bool IoRing::submit(IoRequest *request) {
+	if (!valid())
+		return false;
+	lock();
+	/* also never more than the completion queue can hold */
+	auto tail = *sq_tail;
+	auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head > *sq_mask || pending + submitted >= cq_entries) {
+		unlock();
+		return false;
+	}
+
+	auto index = tail & *sq_mask;
+	auto sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (request->operation == IO_NOP)
+		sqe->opcode = IORING_OP_NOP;
+	else
+		sqe->opcode = request->operation == IO_READ
+			? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->fd = request->fd;
+	sqe->addr = reinterpret_cast<uint64_t>(request->buffers);
+	sqe->len = request->count;
+	sqe->off = static_cast<uint64_t>(request->offset);
+	sqe->user_data = reinterpret_cast<uint64_t>(request);
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	pending++;
+	/* complete() would only see it after something else finished */
+	if (waiting)
+		enter(0);
+	unlock();
+	return true;
+}
+
+unsigned IoRing::complete(unsigned wait_for) {
+	if (!valid())
+		return 0;
+	lock();
+	if (pending)
+		enter(0);
+	if (wait_for) {
+		waiting = true;
+		unlock();
+		enter(wait_for);
+		lock();
+		waiting = false;
+	}
+	unlock();
+
+	/* done may queue the next request, that goes out next time */
+	unsigned count = 0;
+	while (true) {
+		lock();
+		auto head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			unlock();
+			break;
+		}
+		auto cqe = &cqes[head & *cq_mask];
+		auto request = reinterpret_cast<IoRequest*>(cqe->user_data);
+		auto result = cqe->res;
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		submitted--;
+		unlock();
+		count++;
+		request->done(request, result);
+	}
+	return count;
+}
+
+IoWorker::IoWorker(IoRing *ring) :
+	ring(ring), thread(nullptr) {
+	stop.operation = IO_NOP;
+	stop.fd = -1;
+	stop.buffers = nullptr;
+	stop.count = 0;
+	stop.offset = 0;
+	stop.done = stop_done;
+	stop.finished = false;
+	/* without a ring nothing is ever blocked on it */
+	if (!ring->valid())
+		return;
+	thread = bearwasm_spawn_thread(worker_main, this);
+	if (!thread)
+		panic("Unable to spawn I/O worker\n");
+}
+
+IoWorker::~IoWorker() {
+	if (!thread)
+		return;
+	/* a full ring empties without our help */
+	while (!ring->submit(&stop))
+		bearwasm_sleep(1000);
+	bearwasm_join_thread(thread);
+}
+
+void IoWorker::stop_done(IoRequest *request, int32_t) {
+	static_cast<StopRequest*>(request)->finished = true;
+}
+
+void IoWorker::worker_main(void *arg) {
+	auto worker = static_cast<IoWorker*>(arg);
+	auto ring = worker->ring;
+
+	/* done is called right here, so finished needs no atomics */
+	while (!worker->stop.finished || ring->in_flight())
+		ring->complete(1);
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <signal.h>
+#include <string.h>
+#include <bearwasm/Trap.h>
+#include <bearwasm/LinuxHost.h>
+#include <bearwasm/host.hpp>
+
+void *frg_allocator::allocate(size_t size) {
+	return malloc(size);
+}
+
+void frg_allocator::free(void *p) {
+	if (p)
+            ::free(p);
+}
+
+void frg_allocator::deallocate(void *p, size_t n) {
+        (void) n;
+        ::free(p);
+}
+
+void bearwasm_abort() {
+	exit(1);
+}
+
+void bearwasm_log(int level, const char *str) {
+	(void)level;
+	printf("%s", str);
+}
+
+void *bearwasm_map_memory(size_t size) {
+	auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	return p;
+}
+
+bool bearwasm_protect_memory(void *p, size_t size) {
+	return !mprotect(p, size, PROT_NONE);
+}
+
+void bearwasm_unmap_memory(void *p, size_t size) {
+	munmap(p, size);
+}
+
+/* private pages read as zero, or as the file they map, again
+ * after MADV_DONTNEED */
+void bearwasm_discard_memory(void *p, size_t size) {
+	madvise(p, size, MADV_DONTNEED);
+}
+
+struct MemoryImage {
+	int fd;
+};
+
+void *bearwasm_create_image(size_t size) {
+	int fd = memfd_create("bearwasm-snapshot", MFD_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return nullptr;
+	}
+	return new MemoryImage{fd};
+}
+
+bool bearwasm_write_image(void *image, size_t offset, const void *data,
+		size_t size) {
+	auto fd = static_cast<MemoryImage*>(image)->fd;
+	auto buf = static_cast<const char*>(data);
+	while (size) {
+		auto written = pwrite(fd, buf, size, offset);
+		if (written <= 0)
+			return false;
+		buf += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+void *bearwasm_map_image(void *image, size_t offset, size_t size) {
+	auto fd = static_cast<MemoryImage*>(image)->fd;
+	auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, offset);
+	if (p == MAP_FAILED)
+		return nullptr;
+	return p;
+}
+
+void *bearwasm_open_image(int fd) {
+	int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own < 0)
+		return nullptr;
+	return new MemoryImage{own};
+}
+
+/* the handle may also come from bearwasm_open_image */
+bool bearwasm_map_image_at(void *address, void *image, size_t offset,
+		size_t size, bool writable) {
+	auto fd = static_cast<MemoryImage*>(image)->fd;
+	auto p = mmap(address, size, writable ? PROT_READ | PROT_WRITE
+			: PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset);
+	return p != MAP_FAILED;
+}
+
+struct Thread {
+	pthread_t thread;
+	void (*function)(void *arg);
+	void *arg;
+};
+
+static void *thread_entry(void *arg) {
+	auto thread = static_cast<Thread*>(arg);
+	thread->function(thread->arg);
+	return nullptr;
+}
+
+void *bearwasm_spawn_thread(void (*function)(void *arg), void *arg) {
+	auto thread = new Thread{pthread_t{}, function, arg};
+	if (pthread_create(&thread->thread, nullptr, thread_entry, thread)) {
+		delete thread;
+		return nullptr;
+	}
+	return thread;
+}
+
+void bearwasm_join_thread(void *handle) {
+	auto thread = static_cast<Thread*>(handle);
+	pthread_join(thread->thread, nullptr);
+	delete thread;
+}
+
+void bearwasm_wait(uint32_t *addr, uint32_t expected) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, nullptr,
+			nullptr, 0);
+}
+
+void bearwasm_wake(uint32_t *addr, uint32_t count) {
+	if (count > INT32_MAX)
+		count = INT32_MAX;
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, nullptr,
+			nullptr, 0);
+}
+
+void bearwasm_sleep(uint64_t microseconds) {
+	timespec ts;
+	ts.tv_sec = microseconds / 1000000;
+	ts.tv_nsec = (microseconds % 1000000) * 1000;
+	nanosleep(&ts, nullptr);
+}
+
+static thread_local void *trap_context;
+
+void *bearwasm_get_trap_context() {
+	return trap_context;
+}
+
+void bearwasm_set_trap_context(void *context) {
+	trap_context = context;
+}
+
+static void fault_handler(int sig, siginfo_t *info, void *) {
+	bearwasm::handle_fault(info->si_addr);
+
+	/* not from a guest, crash on it as usual */
+	signal(sig, SIG_DFL);
+}
+
+/* SA_NODEFER since handle_fault unwinds instead of returning */
+void bearwasm_install_fault_handlers() {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	for (auto sig : {SIGSEGV, SIGBUS})
+		sigaction(sig, &action, nullptr);
+}
+
+/* existing mappings keep the memfd alive */
+void bearwasm_destroy_image(void *image) {
+	auto memory_image = static_cast<MemoryImage*>(image);
+	close(memory_image->fd);
+	delete memory_image;
+}
@@ -2,11 +2,25 @@
 #include <bearwasm/Util.h>
 #include <bearwasm/BinaryFormat.h>
 #include <bearwasm/Interpreter.h>
+#include <bearwasm/Inliner.h>
+#include <bearwasm/BoundsChecks.h>
 
 namespace bearwasm {
 
-Module::Module(DataStream *stream) :
-	stream(stream), function_names(frg::hash<int>{}) {
+Module::Module() :
+	allocator(&arena), function_types(allocator), type_ids(allocator),
+	functions(allocator),
+	tables(allocator), memory_types(allocator), globals(allocator),
+	exports(allocator), function_code(allocator),
+	function_names(frg::hash<int>{}, allocator), data(allocator),
+	imports(allocator), start_function(-1), num_indirect_calls(0),
+	stream(nullptr), translate_flags(0),
+	refcount(1) {
+}
+
+Module::Module(DataStream *stream, uint32_t translate_flags) : Module() {
+	this->stream = stream;
+	this->translate_flags = translate_flags;
 
 	if(!verify_signature()) {
 		panic("Error verifiying module signature\n");
@@ -20,6 +34,15 @@ Module::Module(DataStream *stream) :
 	read_sections();
 }
 
+void Module::retain() {
+	__atomic_fetch_add(&refcount, 1, __ATOMIC_RELAXED);
+}
+
+void Module::release() {
+	if (!__atomic_sub_fetch(&refcount, 1, __ATOMIC_ACQ_REL))
+		delete this;
+}
+
 bool Module::verify_signature() {
 	auto c = stream->get();
 	if (!c) return false;
@@ -36,93 +59,146 @@ bool Module::verify_signature() {
 void Module::read_sections() {
 	while (auto id = stream_read<uint8_t>(stream)) {
 		auto length = decode_varuint<uint32_t>(stream);
-		switch (*id) {
-			case SECTION_TYPE:
-				parse_type_section();
-				dump_function_types();
-				break;
-			case SECTION_IMPORT:
-				parse_import_section();
-				dump_imports();
-				break;
-			case SECTION_FUNCTION:
-				parse_function_section();
-				dump_functions();
-				break;
-			case SECTION_TABLE:
-				parse_table_section();
-				dump_tables();
-				break;
-			case SECTION_MEMORY:
-				parse_memory_section();
-				dump_memory();
-				break;
-			case SECTION_GLOBAL:
-				parse_global_section();
-				dump_globals();
-				break;
-			case SECTION_EXPORT:
-				parse_export_section();
-				dump_exports();
-				break;
-			case SECTION_CODE:
-				parse_code_section();
-				dump_code();
-				break;
-			case SECTION_DATA:
-				parse_data_section();
-				break;
-			case SECTION_CUSTOM:
-				parse_custom_section(*length);
-				break;
-			default:
-				log_warn("Encountered unknown section with id %d\n",
-					static_cast<int>(*id));
-				stream->seek(*length, DataStream::BWASM_SEEK_CUR);
-				break;
-		}
+		if (!length)
+			panic("Error reading section length");
+		parse_section(*id, *length);
 	}
 }
 
-void Module::parse_type_section() {
-	auto num_types = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_types; i++) {
-		FunctionType function_type;
+void Module::translate_code() {
+	Inliner::run(*this);
+	if (translate_flags & TRANSLATE_BOUNDS_CHECKS)
+		BoundsChecks::run(*this);
+}
+
+void Module::parse_section(uint8_t id, uint32_t length) {
+	switch (id) {
+		case SECTION_TYPE:
+			parse_type_section();
+			dump_function_types();
+			break;
+		case SECTION_IMPORT:
+			parse_import_section();
+			dump_imports();
+			break;
+		case SECTION_FUNCTION:
+			parse_function_section();
+			dump_functions();
+			break;
+		case SECTION_TABLE:
+			parse_table_section();
+			dump_tables();
+			break;
+		case SECTION_MEMORY:
+			parse_memory_section();
+			dump_memory();
+			break;
+		case SECTION_GLOBAL:
+			parse_global_section();
+			dump_globals();
+			break;
+		case SECTION_EXPORT:
+			parse_export_section();
+			dump_exports();
+			break;
+		case SECTION_START:
+			parse_start_section();
+			break;
+		case SECTION_ELEMENT:
+			parse_element_section();
+			break;
+		case SECTION_CODE:
+			parse_code_section();
+			translate_code();
+			dump_code();
+			break;
+		case SECTION_DATA:
+			parse_data_section();
+			break;
+		case SECTION_CUSTOM:
+			parse_custom_section(length);
+			break;
+		default:
+			log_warn("Encountered unknown section with id %d\n",
+				static_cast<int>(id));
+			stream->seek(length, DataStream::BWASM_SEEK_CUR);
+			break;
+	}
+}
 
+static void read_value_types(DataStream *stream,
+		frg::vector<BinaryType, ArenaAllocator> &types) {
+	auto num_types = decode_varuint<uint32_t>(stream);
+	if (!num_types)
+		panic("Error reading number of value types");
+	types.resize(*num_types);
+	if (!stream->read(reinterpret_cast<char*>(types.data()), *num_types))
+		panic("Error reading value types");
+}
+
+void Module::parse_type_section() {
+	auto num_types = decode_varuint<uint32_t>(stream);
+	if (!num_types)
+		panic("Error reading number of types");
+	function_types.resize(*num_types);
+	for (auto &function_type : function_types) {
+		function_type = FunctionType{allocator};
 		auto start = stream_read<uint8_t>(stream);
-		if (*start != 0x60)
+		if (!start || *start != 0x60)
 			panic("Expected 0x60 while parsing type section");
 
-		auto num_params = stream_read<uint8_t>(stream);
-		for (int j = 0; j < *num_params; j++) {
-			auto type = stream_read<BinaryType>(stream);
-			function_type.parameters.push(*type);
-		}
+		read_value_types(stream, function_type.parameters);
+		read_value_types(stream, function_type.results);
+	}
+	assign_type_ids();
+}
 
-		auto num_results = stream_read<uint8_t>(stream);
-		for (int j = 0; j < *num_results; j++) {
-			auto type = stream_read<BinaryType>(stream);
-			function_type.results.push(*type);
+void Module::assign_type_ids() {
+	type_ids.resize(function_types.size());
+	for (size_t i = 0; i < function_types.size(); i++) {
+		auto &type = function_types[i];
+		type_ids[i] = i;
+		for (size_t k = 0; k < i; k++) {
+			auto &other = function_types[k];
+			if (type_ids[k] != k
+					|| type.parameters.size()
+					!= other.parameters.size()
+					|| type.results.size()
+					!= other.results.size())
+				continue;
+			bool equal = true;
+			for (size_t n = 0; n < type.parameters.size(); n++)
+				equal &= type.parameters[n] == other.parameters[n];
+			for (size_t n = 0; n < type.results.size(); n++)
+				equal &= type.results[n] == other.results[n];
+			if (equal) {
+				type_ids[i] = k;
+				break;
+			}
 		}
-
-		function_types.push(function_type);
 	}
 }
 
 void Module::parse_function_section() {
-	auto num_functions = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_functions; i++) {
+	auto num_functions = decode_varuint<uint32_t>(stream);
+	if (!num_functions)
+		panic("Error reading number of functions");
+	functions.resize(*num_functions);
+	for (auto &function : functions) {
 		auto type_idx = decode_varuint<uint32_t>(stream);
 		if (!type_idx)
 			panic("Error reading type idx in function section");
-		functions.push(*type_idx);
+		function = *type_idx;
 	}
 }
 
 void Module::parse_table_section() {
-	auto num_tables = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_tables; i++) {
-		Table table;
+	auto num_tables = decode_varuint<uint32_t>(stream);
+	if (!num_tables)
+		panic("Error reading number of tables");
+	tables.resize(*num_tables);
+	for (auto &table : tables) {
+		table = Table{allocator};
 		auto table_type = stream_read<TableType>(stream);
 		if (!table_type)
 			panic("Error reading table type!");
@@ -133,25 +209,34 @@ void Module::parse_table_section() {
 			panic("Error reading limit");
 		table.limit = *limit;
 
-		tables.push(table);
+		table.data.resize(table.limit.template get<0>());
+		for (auto &element : table.data)
+			element = ELEMENT_NULL;
 	}
 }
 
 void Module::parse_memory_section() {
-	auto num_memory_types = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_memory_types; i++) {
+	auto num_memory_types = decode_varuint<uint32_t>(stream);
+	if (!num_memory_types)
+		panic("Error reading number of memory types");
+	memory_types.resize(*num_memory_types);
+	for (auto &memory_type : memory_types) {
 		/* memory types are just limits */
-		auto memory_type = decode_limit(stream);
-		if (!memory_type)
+		auto limit = decode_limit(stream);
+		if (!limit)
 			panic("Error reading memory type");
-		memory_types.push(*memory_type);
+		memory_type = *limit;
 	}
 }
 
 void Module::parse_global_section() {
-	auto num_global_types = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_global_types; i++) {
-		auto ret = Interpreter::interpret_global(stream);
+	auto num_global_types = decode_varuint<uint32_t>(stream);
+	if (!num_global_types)
+		panic("Error reading number of globals");
+	/* globals are pushed one by one as later initializers
+	 * may only refer to the ones before them */
+	for (uint32_t i = 0; i < *num_global_types; i++) {
+		auto ret = Interpreter::interpret_global(stream, globals);
 		if (!ret)
 			panic("Error decoding global");
 		globals.push(*ret);
@@ -159,9 +244,11 @@ void Module::parse_global_section() {
 }
 
 void Module::parse_export_section() {
-	auto num_exports = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_exports; i++) {
-		auto name = read_string(stream);
+	auto num_exports = decode_varuint<uint32_t>(stream);
+	if (!num_exports)
+		panic("Error reading number of exports");
+	for (uint32_t i = 0; i < *num_exports; i++) {
+		auto name = read_string(stream, allocator);
 		if (!name)
 			panic("Unable to read export name");
 		auto type = stream->get();
@@ -171,8 +258,8 @@ void Module::parse_export_section() {
 		if (!index)
 			panic("Unable to read export index");
 
-		Export exp;
-		exp.name = *name;
+		Export exp{allocator};
+		exp.name = std::move(*name);
 		exp.index = *index;
 		switch (*type) {
 			case EXPORT_FUNC:
@@ -194,34 +281,207 @@ void Module::parse_export_section() {
 	}
 }
 
+void Module::parse_start_section() {
+	auto index = decode_varuint<uint32_t>(stream);
+	if (!index)
+		panic("Error reading start function index");
+	size_t num_functions = functions.size();
+	for (const auto &import : imports)
+		if (import.description == EXPORT_FUNC)
+			num_functions++;
+	if (*index >= num_functions)
+		panic("Start function %u does not exist\n", *index);
+	start_function = *index;
+}
+
 void Module::parse_code_section() {
-	auto num_functions = stream_read<uint8_t>(stream);
-	for (int i = 0; i < num_functions; i++) {
-		Code code;
-
-		auto size = decode_varuint<uint32_t>(stream);
-		if (!size)
-			panic("Unable to read function size");
-		code.size = *size;
-
-		auto num_locals = stream_read<uint8_t>(stream);
-		for (int j = 0; j < num_locals;) {
-			auto count = decode_varuint<uint32_t>(stream);
-			if (!count)
-				panic("Unable to read local count");
-			auto type = stream_read<BinaryType>(stream);
-			for (size_t k = 0; k < *count; k++)
-				code.locals.push(*type);
-			j += *count;
+	auto num_functions = decode_varuint<uint32_t>(stream);
+	if (!num_functions)
+		panic("Error reading number of function bodies");
+	function_code.resize(function_code.size() + *num_functions);
+	for (uint32_t i = 0; i < *num_functions; i++)
+		parse_code_entry(function_code[function_code.size()
+				- *num_functions + i]);
+}
+
+void Module::parse_code_entry(Code &code) {
+	code = Code{allocator};
+
+	auto size = decode_varuint<uint32_t>(stream);
+	if (!size)
+		panic("Unable to read function size");
+	code.size = *size;
+
+	/* locals come in runs of (count, type) */
+	auto num_entries = decode_varuint<uint32_t>(stream);
+	if (!num_entries)
+		panic("Unable to read number of local entries");
+	for (uint32_t i = 0; i < *num_entries; i++) {
+		auto count = decode_varuint<uint32_t>(stream);
+		if (!count)
+			panic("Unable to read local count");
+		auto type = stream_read<BinaryType>(stream);
+		if (!type)
+			panic("Unable to read local type");
+		/* first never exceeds the limit, so this can not wrap */
+		auto first = code.locals.size();
+		if (*count > MAX_LOCALS - first)
+			panic("More than %u locals in a function\n", MAX_LOCALS);
+		code.locals.resize(first + *count);
+		for (size_t k = first; k < code.locals.size(); k++)
+			code.locals[k] = *type;
+	}
+
+	auto start_pos = stream->tell();
+	Interpreter::decode_code(stream, code.expression);
+	code.size = stream->tell() - start_pos;
+
+	/* the function section comes first, it declares the signature */
+	uint32_t index = &code - function_code.data();
+	if (index >= functions.size()
+			|| functions[index] >= function_types.size())
+		panic("Code for undeclared function %u\n", index);
+	size_t frame_size = function_types[functions[index]].parameters.size()
+		+ code.locals.size();
+	size_t num_functions = functions.size();
+	for (const auto &import : imports)
+		if (import.description == EXPORT_FUNC)
+			num_functions++;
+
+	/* the decoder does not know the module, indices are checked here
+	 * so the interpreter can use them as they are */
+	for (auto &inst : code.expression) {
+		switch (inst.type) {
+			case LOCAL_GET:
+			case LOCAL_SET:
+			case LOCAL_TEE:
+				if (inst.arg.uint32_val >= frame_size)
+					panic("Function %u uses unknown local %u\n",
+						index, inst.arg.uint32_val);
+				break;
+			case GLOBAL_GET:
+			case GLOBAL_SET:
+				if (inst.arg.uint32_val >= globals.size())
+					panic("Function %u uses unknown global %u\n",
+						index, inst.arg.uint32_val);
+				break;
+			case INSTR_CALL:
+				if (inst.arg.uint32_val >= num_functions)
+					panic("Function %u calls unknown function "
+						"%u\n", index, inst.arg.uint32_val);
+				break;
+			case INSTR_CALL_INDIRECT: {
+				auto &call = inst.arg.indirect;
+				if (call.type >= type_ids.size())
+					panic("call_indirect with unknown type %d\n",
+						call.type);
+				call.type = type_ids[call.type];
+				if (num_indirect_calls == MAX_INDIRECT_CALLS)
+					panic("More than %u call_indirect\n",
+						MAX_INDIRECT_CALLS);
+				call.site = num_indirect_calls++;
+				break;
+			}
+			default:
+				break;
 		}
+	}
+}
 
-		auto start_pos = stream->tell();
-		auto instructions = Interpreter::decode_code(stream);
+/* ref.func or ref.null, as the items of element segments with flag 4 */
+static frg::optional<uint32_t> read_element_expression(DataStream *stream) {
+	auto opcode = stream_read<uint8_t>(stream);
+	if (!opcode)
+		return frg::null_opt;
+
+	uint32_t ret;
+	if (*opcode == 0xD2) {
+		auto function = decode_varuint<uint32_t>(stream);
+		if (!function)
+			return frg::null_opt;
+		ret = *function;
+	} else if (*opcode == 0xD0) {
+		if (!stream_read<uint8_t>(stream))
+			return frg::null_opt;
+		ret = ELEMENT_NULL;
+	} else {
+		return frg::null_opt;
+	}
 
-		code.size = stream->tell() - start_pos;
-		code.expression = instructions;
+	auto end = stream_read<uint8_t>(stream);
+	if (!end || *end != INSTR_END)
+		return frg::null_opt;
+	return ret;
+}
 
-		function_code.push(code);		
+/*
+ * Active segments are applied to the initial table contents right
+ * away. Passive and declarative ones are skipped, there is no
+ * table.init to use them.
+ */
+void Module::parse_element_section() {
+	auto num_entries = decode_varuint<uint32_t>(stream);
+	if (!num_entries)
+		panic("Error reading number of element segments");
+
+	size_t num_functions = functions.size();
+	for (const auto &import : imports)
+		if (import.description == EXPORT_FUNC)
+			num_functions++;
+
+	for (uint32_t i = 0; i < *num_entries; i++) {
+		/* bit 0 passive or declarative, bit 1 explicit table index
+		 * or declarative, bit 2 expressions instead of indices */
+		auto flags = decode_varuint<uint32_t>(stream);
+		if (!flags || *flags > 7)
+			panic("Error reading element segment flags");
+		bool active = !(*flags & 1);
+
+		uint32_t table_idx = 0;
+		if (active && (*flags & 2)) {
+			auto idx = decode_varuint<uint32_t>(stream);
+			if (!idx)
+				panic("Error reading element segment table");
+			table_idx = *idx;
+		}
+		frg::optional<uint32_t> offset = 0;
+		if (active) {
+			offset = Interpreter::interpret_offset(stream, globals);
+			if (!offset)
+				panic("Error reading element segment offset");
+		}
+		/* elemkind or reftype, both can only be functions */
+		if ((*flags & 3) && !stream_read<uint8_t>(stream))
+			panic("Error reading element kind");
+
+		auto count = decode_varuint<uint32_t>(stream);
+		if (!count)
+			panic("Error reading number of elements");
+
+		Table *table = nullptr;
+		if (active) {
+			if (table_idx >= tables.size())
+				panic("Element segment refers to unknown table %d\n",
+						table_idx);
+			table = &tables[table_idx];
+			if (*offset > table->data.size()
+					|| *count > table->data.size() - *offset)
+				panic("Element segment does not fit in table\n");
+		}
+
+		for (uint32_t k = 0; k < *count; k++) {
+			auto function = *flags & 4
+				? read_element_expression(stream)
+				: decode_varuint<uint32_t>(stream);
+			if (!function)
+				panic("Error reading element");
+			if (*function != ELEMENT_NULL
+					&& *function >= num_functions)
+				panic("Element refers to unknown function %d\n",
+						*function);
+			if (table)
+				table->data[*offset + k] = *function;
+		}
 	}
 }
 
@@ -229,12 +489,13 @@ void Module::parse_data_section() {
 	auto num_entries = decode_varuint<uint32_t>(stream);
 	if (!num_entries)
 		panic("Error reading number of data entries");
-	for (size_t i = 0; i < *num_entries; i++) {
-		DataEntry entry;
+	data.resize(*num_entries);
+	for (auto &entry : data) {
+		entry = DataEntry{allocator};
 		auto memidx = decode_varuint<uint32_t>(stream);
 		if (!memidx)
 			panic("Error reading memidx");
-		auto offset = Interpreter::interpret_offset(stream);
+		auto offset = Interpreter::interpret_offset(stream, globals);
 		if (!offset)
 			panic("Error reading offset");
 
@@ -244,16 +505,15 @@ void Module::parse_data_section() {
 		auto num_bytes = decode_varuint<uint32_t>(stream);
 		if (!num_bytes)
 			panic("Error reading size of bytes");
-		for (size_t j = 0; j < *num_bytes; j++) {
-			auto byte = stream_read<uint8_t>(stream);
-			entry.bytes.push(*byte);
-		}
-
-		data.push(entry);
+		entry.bytes.resize(*num_bytes);
+		if (!stream->read(reinterpret_cast<char*>(entry.bytes.data()),
+					*num_bytes))
+			panic("Error reading data segment");
 	}
 }
 
-void Module::parse_custom_section(int length) {
+void Module::parse_custom_section(uint32_t length) {
+	auto start_pos = stream->tell();
 	auto name = read_string(stream);
 	if (!name)
 		panic("Error reading name of custom section");
@@ -267,16 +527,17 @@ void Module::parse_custom_section(int length) {
 		auto num_names = decode_varuint<uint32_t>(stream);
 		if (!num_names) panic("Error reading number of names");
 
-		for (int i = 0; i < num_names; i++) {
+		for (uint32_t i = 0; i < *num_names; i++) {
 			auto name_index = decode_varuint<uint32_t>(stream);
-			auto name = read_string(stream);
+			auto name = read_string(stream, allocator);
 			if (!name) panic("Error reading function name");
-			function_names.insert(*name_index, *name);
+			function_names.insert(*name_index, std::move(*name));
 		}
 	} else {
 		log_warn("Encountered unknown custom section %s\n",
 			(*name).data());
-		stream->seek(length - (*name).size(), DataStream::BWASM_SEEK_CUR);
+		stream->seek(length - (stream->tell() - start_pos),
+				DataStream::BWASM_SEEK_CUR);
 	}
 }
 
@@ -285,26 +546,56 @@ void Module::parse_import_section() {
 	if (!num_entries)
 		panic("Error reading num entries of import");
 
-	for (int i = 0; i < num_entries; i++) {
-		Import import;
+	imports.resize(*num_entries);
+	for (auto &import : imports) {
+		import = Import{allocator};
 
-		auto module = read_string(stream);
+		auto module = read_string(stream, allocator);
 		if (!module) panic("error reading import module!");
-		import.module = *module;
+		import.module = std::move(*module);
 
-		auto name = read_string(stream);
+		auto name = read_string(stream, allocator);
 		if (!name) panic("error reading import name!");
-		import.name = *name;
+		import.name = std::move(*name);
 
 		auto description = stream_read<uint8_t>(stream);
 		if (!description) panic("error reading import desc!");
 		import.description = *description;
-
-		auto idx = decode_varuint<uint32_t>(stream);
-		if (!idx) panic ("error reading import idx");
-		import.idx = *idx;
-
-		imports.push(import);
+		import.idx = 0;
+		import.limit = frg::make_tuple(0u, 0u);
+
+		switch (import.description) {
+			case EXPORT_FUNC: {
+				auto idx = decode_varuint<uint32_t>(stream);
+				if (!idx) panic ("error reading import idx");
+				import.idx = *idx;
+				break;
+			}
+			case EXPORT_TABLE: {
+				auto table_type = stream_read<TableType>(stream);
+				auto limit = decode_limit(stream);
+				if (!table_type || !limit)
+					panic("error reading imported table");
+				import.limit = *limit;
+				break;
+			}
+			case EXPORT_MEM: {
+				auto limit = decode_limit(stream);
+				if (!limit) panic("error reading imported memory");
+				import.limit = *limit;
+				break;
+			}
+			case EXPORT_GLOBAL: {
+				auto type = stream_read<uint8_t>(stream);
+				auto mutability = stream_read<uint8_t>(stream);
+				if (!type || !mutability)
+					panic("error reading imported global");
+				import.idx = *type;
+				break;
+			}
+			default:
+				panic("unkown import descriptor");
+		}
 	}
 }
 
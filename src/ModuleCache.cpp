@@ -0,0 +1,420 @@
+#include <bearwasm/ModuleCache.h>
+#include <bearwasm/Util.h>
+#include <string.h>
+
+namespace bearwasm {
+
+static constexpr char CACHE_MAGIC[4] = {'B', 'W', 'M', 'C'};
+
+struct CacheFunctionType {
+	CacheBlob results, parameters;
+};
+
+struct CacheTable {
+	uint32_t type;
+	uint32_t min, max;
+	CacheBlob data;
+};
+
+struct CacheLimit {
+	uint32_t min, max;
+};
+
+struct CacheGlobal {
+	uint8_t type;
+	uint8_t mut;
+	uint8_t padding[6];
+	uint64_t value;
+};
+
+struct CacheExport {
+	uint32_t kind;
+	int32_t index;
+	CacheBlob name;
+};
+
+struct CacheCode {
+	uint32_t size;
+	CacheBlob locals, expression;
+};
+
+struct CacheName {
+	uint32_t index;
+	CacheBlob name;
+};
+
+struct CacheData {
+	int32_t memidx;
+	int32_t offset;
+	CacheBlob bytes;
+};
+
+struct CacheImport {
+	CacheBlob module, name;
+	int32_t description, idx;
+	CacheLimit limit;
+};
+
+namespace {
+
+class CacheWriter {
+public:
+	size_t append(const void *data, size_t size, size_t align) {
+		auto offset = (buffer.size() + align - 1) & ~(align - 1);
+		buffer.resize(offset + size);
+		/* empty arrays may not have storage at all */
+		if (size)
+			memcpy(buffer.data() + offset, data, size);
+		return offset;
+	}
+
+	template<typename T>
+	CacheBlob append_array(const T *data, size_t count) {
+		CacheBlob blob;
+		blob.offset = append(data, count * sizeof(T), alignof(T));
+		blob.count = count;
+		return blob;
+	}
+
+	template<typename V>
+	CacheBlob append_vector(const V &vector) {
+		return append_array(vector.data(), vector.size());
+	}
+
+	frg::vector<char, frg_allocator> buffer;
+};
+
+class CacheReader {
+public:
+	CacheReader(const char *data, size_t size) :
+		data(data), size(size) {
+	}
+
+	template<typename T>
+	const T *array(CacheBlob blob) const {
+		if (blob.offset % alignof(T) || blob.offset > size)
+			return nullptr;
+		if (blob.count > (size - blob.offset) / sizeof(T))
+			return nullptr;
+		return reinterpret_cast<const T*>(data + blob.offset);
+	}
+
+	template<typename V>
+	bool read_vector(CacheBlob blob, V &vector) const {
+		using T = typename V::value_type;
+		auto elements = array<T>(blob);
+		if (!elements)
+			return false;
+		vector.resize(blob.count);
+		memcpy(vector.data(), elements, blob.count * sizeof(T));
+		return true;
+	}
+
+	frg::optional<String> string(CacheBlob blob,
+			ArenaAllocator allocator) const {
+		auto chars = array<char>(blob);
+		if (!chars)
+			return frg::null_opt;
+		return String(chars, blob.count, allocator);
+	}
+private:
+	const char *data;
+	size_t size;
+};
+
+} /* anonymous namespace */
+
+uint64_t ModuleCache::hash(const char *data, size_t size, uint64_t seed) {
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= static_cast<uint8_t>(data[i]);
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+bool ModuleCache::write(Module &module, uint64_t module_hash,
+		DataSink *sink) {
+	CacheWriter writer;
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	writer.append(&header, sizeof(header), alignof(CacheHeader));
+
+	frg::vector<CacheFunctionType, frg_allocator> function_types;
+	for (const auto &type : module.function_types) {
+		CacheFunctionType entry;
+		entry.results = writer.append_vector(type.results);
+		entry.parameters = writer.append_vector(type.parameters);
+		function_types.push(entry);
+	}
+	header.function_types = writer.append_vector(function_types);
+	header.functions = writer.append_vector(module.functions);
+
+	frg::vector<CacheTable, frg_allocator> tables;
+	for (const auto &table : module.tables) {
+		CacheTable entry;
+		entry.type = table.type;
+		entry.min = table.limit.template get<0>();
+		entry.max = table.limit.template get<1>();
+		entry.data = writer.append_vector(table.data);
+		tables.push(entry);
+	}
+	header.tables = writer.append_vector(tables);
+
+	frg::vector<CacheLimit, frg_allocator> memory_types;
+	for (const auto &type : module.memory_types) {
+		CacheLimit entry;
+		entry.min = type.template get<0>();
+		entry.max = type.template get<1>();
+		memory_types.push(entry);
+	}
+	header.memory_types = writer.append_vector(memory_types);
+
+	frg::vector<CacheGlobal, frg_allocator> globals;
+	for (const auto &global : module.globals) {
+		CacheGlobal entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.type = global.type;
+		entry.mut = global.mut;
+		entry.value = global.value.uint64_val;
+		globals.push(entry);
+	}
+	header.globals = writer.append_vector(globals);
+
+	frg::vector<CacheExport, frg_allocator> exports;
+	auto add_exports = [&] (const frg::vector<Export, ArenaAllocator> &list,
+			ExportType kind) {
+		for (const auto &exp : list) {
+			CacheExport entry;
+			entry.kind = kind;
+			entry.index = exp.index;
+			entry.name = writer.append_array(exp.name.data(),
+					exp.name.size());
+			exports.push(entry);
+		}
+	};
+	add_exports(module.exports.func, EXPORT_FUNC);
+	add_exports(module.exports.table, EXPORT_TABLE);
+	add_exports(module.exports.mem, EXPORT_MEM);
+	add_exports(module.exports.global, EXPORT_GLOBAL);
+	header.exports = writer.append_vector(exports);
+
+	frg::vector<CacheCode, frg_allocator> function_code;
+	frg::vector<CacheName, frg_allocator> function_names;
+	for (size_t i = 0; i < module.function_code.size(); i++) {
+		const auto &code = module.function_code[i];
+		CacheCode entry;
+		entry.size = code.size;
+		entry.locals = writer.append_vector(code.locals);
+		entry.expression = writer.append_vector(code.expression);
+		function_code.push(entry);
+
+		auto name_it = module.function_names.find(i);
+		if (name_it != module.function_names.end()) {
+			const auto &name = name_it->template get<1>();
+			CacheName name_entry;
+			name_entry.index = i;
+			name_entry.name = writer.append_array(name.data(),
+					name.size());
+			function_names.push(name_entry);
+		}
+	}
+	header.function_code = writer.append_vector(function_code);
+	header.function_names = writer.append_vector(function_names);
+
+	frg::vector<CacheData, frg_allocator> data;
+	for (const auto &entry : module.data) {
+		CacheData data_entry;
+		data_entry.memidx = entry.memidx;
+		data_entry.offset = entry.offset;
+		data_entry.bytes = writer.append_vector(entry.bytes);
+		data.push(data_entry);
+	}
+	header.data = writer.append_vector(data);
+
+	frg::vector<CacheImport, frg_allocator> imports;
+	for (const auto &import : module.imports) {
+		CacheImport entry;
+		entry.module = writer.append_array(import.module.data(),
+				import.module.size());
+		entry.name = writer.append_array(import.name.data(),
+				import.name.size());
+		entry.description = import.description;
+		entry.idx = import.idx;
+		entry.limit.min = import.limit.template get<0>();
+		entry.limit.max = import.limit.template get<1>();
+		imports.push(entry);
+	}
+	header.imports = writer.append_vector(imports);
+
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.module_hash = module_hash;
+	header.instruction_size = sizeof(Instruction);
+	header.start_function = module.start_function;
+	header.num_indirect_calls = module.num_indirect_calls;
+	memcpy(writer.buffer.data(), &header, sizeof(header));
+
+	return sink->write(writer.buffer.data(), writer.buffer.size());
+}
+
+Module *ModuleCache::load(const char *data, size_t size,
+		uint64_t module_hash) {
+	CacheReader reader{data, size};
+	auto header = reader.array<CacheHeader>({0, 1});
+	if (!header)
+		return nullptr;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))
+			|| header->version != CACHE_VERSION
+			|| header->instruction_size != sizeof(Instruction)
+			|| header->module_hash != module_hash)
+		return nullptr;
+
+	auto module = new Module();
+	auto allocator = module->allocator;
+	module->start_function = header->start_function;
+	module->num_indirect_calls = header->num_indirect_calls;
+	auto fail = [&] (const char *what) -> Module * {
+		log_warn("Discarding module cache: bad %s\n", what);
+		module->release();
+		return nullptr;
+	};
+
+	auto function_types = reader.array<CacheFunctionType>(
+			header->function_types);
+	if (!function_types)
+		return fail("types");
+	module->function_types.resize(header->function_types.count);
+	for (size_t i = 0; i < header->function_types.count; i++) {
+		auto &type = module->function_types[i];
+		type = FunctionType{allocator};
+		if (!reader.read_vector(function_types[i].results, type.results)
+				|| !reader.read_vector(function_types[i].parameters,
+					type.parameters))
+			return fail("types");
+	}
+	module->assign_type_ids();
+
+	if (!reader.read_vector(header->functions, module->functions))
+		return fail("functions");
+
+	auto tables = reader.array<CacheTable>(header->tables);
+	if (!tables)
+		return fail("tables");
+	module->tables.resize(header->tables.count);
+	for (size_t i = 0; i < header->tables.count; i++) {
+		auto &table = module->tables[i];
+		table = Table{allocator};
+		table.type = static_cast<TableType>(tables[i].type);
+		table.limit = frg::make_tuple(tables[i].min, tables[i].max);
+		if (!reader.read_vector(tables[i].data, table.data))
+			return fail("tables");
+	}
+
+	auto memory_types = reader.array<CacheLimit>(header->memory_types);
+	if (!memory_types)
+		return fail("memory types");
+	for (size_t i = 0; i < header->memory_types.count; i++)
+		module->memory_types.push(frg::make_tuple(memory_types[i].min,
+					memory_types[i].max));
+
+	auto globals = reader.array<CacheGlobal>(header->globals);
+	if (!globals)
+		return fail("globals");
+	module->globals.resize(header->globals.count);
+	for (size_t i = 0; i < header->globals.count; i++) {
+		auto &global = module->globals[i];
+		global.type = static_cast<BinaryType>(globals[i].type);
+		global.mut = globals[i].mut;
+		global.value.uint64_val = globals[i].value;
+	}
+
+	auto exports = reader.array<CacheExport>(header->exports);
+	if (!exports)
+		return fail("exports");
+	for (size_t i = 0; i < header->exports.count; i++) {
+		auto name = reader.string(exports[i].name, allocator);
+		if (!name)
+			return fail("exports");
+		Export exp{allocator};
+		exp.name = std::move(*name);
+		exp.index = exports[i].index;
+		switch (exports[i].kind) {
+			case EXPORT_FUNC:
+				module->exports.func.push(exp);
+				break;
+			case EXPORT_TABLE:
+				module->exports.table.push(exp);
+				break;
+			case EXPORT_MEM:
+				module->exports.mem.push(exp);
+				break;
+			case EXPORT_GLOBAL:
+				module->exports.global.push(exp);
+				break;
+			default:
+				return fail("exports");
+		}
+	}
+
+	auto function_code = reader.array<CacheCode>(header->function_code);
+	if (!function_code)
+		return fail("code");
+	module->function_code.resize(header->function_code.count);
+	for (size_t i = 0; i < header->function_code.count; i++) {
+		auto &code = module->function_code[i];
+		code = Code{allocator};
+		code.size = function_code[i].size;
+		if (!reader.read_vector(function_code[i].locals, code.locals)
+				|| !reader.read_vector(function_code[i].expression,
+					code.expression))
+			return fail("code");
+	}
+
+	auto function_names = reader.array<CacheName>(header->function_names);
+	if (!function_names)
+		return fail("names");
+	for (size_t i = 0; i < header->function_names.count; i++) {
+		auto name = reader.string(function_names[i].name, allocator);
+		if (!name)
+			return fail("names");
+		module->function_names.insert(function_names[i].index,
+				std::move(*name));
+	}
+
+	auto data_entries = reader.array<CacheData>(header->data);
+	if (!data_entries)
+		return fail("data");
+	module->data.resize(header->data.count);
+	for (size_t i = 0; i < header->data.count; i++) {
+		auto &entry = module->data[i];
+		entry = DataEntry{allocator};
+		entry.memidx = data_entries[i].memidx;
+		entry.offset = data_entries[i].offset;
+		if (!reader.read_vector(data_entries[i].bytes, entry.bytes))
+			return fail("data");
+	}
+
+	auto imports = reader.array<CacheImport>(header->imports);
+	if (!imports)
+		return fail("imports");
+	module->imports.resize(header->imports.count);
+	for (size_t i = 0; i < header->imports.count; i++) {
+		auto &import = module->imports[i];
+		auto import_module = reader.string(imports[i].module, allocator);
+		auto import_name = reader.string(imports[i].name, allocator);
+		if (!import_module || !import_name)
+			return fail("imports");
+		import = Import{allocator};
+		import.module = std::move(*import_module);
+		import.name = std::move(*import_name);
+		import.description = imports[i].description;
+		import.idx = imports[i].idx;
+		import.limit = frg::make_tuple(imports[i].limit.min,
+				imports[i].limit.max);
+	}
+
+	return module;
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,103 @@
+#include <bearwasm/Scheduler.h>
+
+namespace bearwasm {
+
+/* GreenThread::wait_state */
+enum {
+	/* in the executor's queue or running a slice */
+	THREAD_RUNNING,
+	/* left a slice blocked, only finish_call() brings it back */
+	THREAD_PARKED,
+	/* finish_call() came before the slice that blocked ended */
+	THREAD_WOKEN,
+};
+
+Scheduler::Scheduler(Executor *executor, uint64_t time_slice) :
+	executor(executor), time_slice(time_slice ? time_slice : 1),
+	live(0) {
+}
+
+void Scheduler::spawn(GreenThread *thread) {
+	thread->run = run_slice;
+	thread->scheduler = this;
+	thread->slices = 0;
+	thread->wait_state = THREAD_RUNNING;
+	thread->vm->set_unblocked_handler(unblocked, thread);
+	thread->vm->start(thread->argc, thread->argv);
+	__atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+	executor->submit(static_cast<Task*>(thread));
+}
+
+void Scheduler::run_slice(Task *task) {
+	auto thread = static_cast<GreenThread*>(task);
+	auto scheduler = thread->scheduler;
+
+	thread->slices++;
+	thread->status = thread->vm->resume(scheduler->time_slice);
+	if (thread->status == EXECUTION_SUSPENDED) {
+		/* counted as outstanding before this slice is done, so
+		 * wait_idle() can not return in between */
+		scheduler->executor->submit(task);
+		return;
+	}
+
+	if (thread->status == EXECUTION_BLOCKED) {
+		uint32_t running = THREAD_RUNNING;
+		if (__atomic_compare_exchange_n(&thread->wait_state, &running,
+					THREAD_PARKED, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+			return;
+		/* already finished, or a native finished its own call
+		 * earlier and the next slice finds out which it was */
+		__atomic_store_n(&thread->wait_state, THREAD_RUNNING,
+				__ATOMIC_RELAXED);
+		scheduler->executor->submit(task);
+		return;
+	}
+
+	if (thread->status == EXECUTION_FINISHED)
+		thread->result = thread->vm->get_result();
+	scheduler->finished(thread);
+}
+
+void Scheduler::unblocked(void *data) {
+	auto thread = static_cast<GreenThread*>(data);
+
+	auto state = __atomic_load_n(&thread->wait_state, __ATOMIC_ACQUIRE);
+	while (true) {
+		if (state == THREAD_PARKED) {
+			if (__atomic_compare_exchange_n(&thread->wait_state,
+						&state, THREAD_RUNNING, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+				thread->scheduler->executor->submit(
+						static_cast<Task*>(thread));
+				return;
+			}
+			continue;
+		}
+		/* its slice has not ended yet, run_slice() resubmits it */
+		if (__atomic_compare_exchange_n(&thread->wait_state, &state,
+					THREAD_WOKEN, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+			return;
+	}
+}
+
+void Scheduler::finished(GreenThread *thread) {
+	if (thread->done)
+		thread->done(thread);
+	if (__atomic_sub_fetch(&live, 1, __ATOMIC_ACQ_REL) == 0)
+		bearwasm_wake(&live, UINT32_MAX);
+}
+
+void Scheduler::wait_idle() {
+	while (true) {
+		auto count = __atomic_load_n(&live, __ATOMIC_ACQUIRE);
+		if (!count)
+			return;
+		bearwasm_wait(&live, count);
+	}
+}
+
+} /* namespace bearwasm */
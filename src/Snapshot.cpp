@@ -0,0 +1,80 @@
+#include <bearwasm/Snapshot.h>
+#include <bearwasm/VirtualMachine.h>
+#include <bearwasm/Util.h>
+
+namespace bearwasm {
+
+static bool is_zero_page(const char *page) {
+	for (size_t i = 0; i < DIRTY_PAGE_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, page + i, sizeof(word));
+		if (word)
+			return false;
+	}
+	return true;
+}
+
+Snapshot::Snapshot(VirtualMachine &vm) :
+	module(vm.module), image(nullptr), refcount(1) {
+	module->retain();
+	auto &state = vm.state;
+
+	size_t image_size = 0;
+	memories.resize(state.memory.size());
+	for (size_t i = 0; i < state.memory.size(); i++) {
+		memories[i].offset = image_size;
+		memories[i].pages = state.memory[i].get_size() / PAGE_SIZE;
+		image_size += state.memory[i].get_size();
+	}
+
+	if (image_size) {
+		image = bearwasm_create_image(image_size);
+		if (!image)
+			panic("Unable to create snapshot image\n");
+	}
+
+	/* the image starts out zeroed, only pages with data
+	 * are written so the rest stays a hole */
+	for (size_t i = 0; i < state.memory.size(); i++) {
+		auto &memory = state.memory[i];
+		size_t size = memory.get_size();
+		for (size_t page = 0; page < size;) {
+			if (is_zero_page(memory.data() + page)) {
+				page += DIRTY_PAGE_SIZE;
+				continue;
+			}
+			auto first = page;
+			while (page < size && !is_zero_page(memory.data() + page))
+				page += DIRTY_PAGE_SIZE;
+			if (!bearwasm_write_image(image,
+						memories[i].offset + first,
+						memory.data() + first, page - first))
+				panic("Unable to write snapshot image\n");
+		}
+	}
+
+	globals.resize(state.globals.size());
+	for (size_t i = 0; i < state.globals.size(); i++)
+		globals[i] = state.globals[i];
+
+	tables.resize(state.tables.size());
+	for (size_t i = 0; i < state.tables.size(); i++)
+		tables[i] = state.tables[i];
+}
+
+Snapshot::~Snapshot() {
+	if (image)
+		bearwasm_destroy_image(image);
+	module->release();
+}
+
+void Snapshot::retain() {
+	__atomic_fetch_add(&refcount, 1, __ATOMIC_RELAXED);
+}
+
+void Snapshot::release() {
+	if (!__atomic_sub_fetch(&refcount, 1, __ATOMIC_ACQ_REL))
+		delete this;
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,150 @@
+#include <bearwasm/StreamingDecoder.h>
+#include <bearwasm/BinaryFormat.h>
+#include <bearwasm/Util.h>
+#include <string.h>
+
+namespace bearwasm {
+
+StreamingDecoder::StreamingDecoder(uint32_t translate_flags) :
+	consumed(0), module(new Module()), decoder_state(DECODE_HEADER),
+	section_id(0), section_length(0), code_entries_left(0) {
+	module->translate_flags = translate_flags;
+}
+
+StreamingDecoder::~StreamingDecoder() {
+	if (module)
+		module->release();
+}
+
+void StreamingDecoder::feed(const char *data, size_t size) {
+	auto old_size = buffer.size();
+	buffer.resize(old_size + size);
+	memcpy(buffer.data() + old_size, data, size);
+
+	while (step())
+		;
+
+	/* only the start of a section or function body is left over,
+	 * move it to the front so the buffer does not grow with the file */
+	if (consumed) {
+		auto left = available();
+		memmove(buffer.data(), buffer.data() + consumed, left);
+		buffer.resize(left);
+		consumed = 0;
+	}
+}
+
+Module *StreamingDecoder::finish() {
+	if (decoder_state != DECODE_SECTION_HEADER || available())
+		panic("Module binary ended in the middle of a section");
+
+	auto ret = module;
+	module = nullptr;
+	return ret;
+}
+
+frg::optional<uint32_t> StreamingDecoder::peek_varuint(size_t &length) {
+	uint32_t ret = 0;
+	int shift = 0;
+	for (length = 0; length < available(); length++) {
+		if (length == 5)
+			panic("LEB128 value too long");
+		auto c = static_cast<uint8_t>(buffer[consumed + length]);
+		ret |= static_cast<uint32_t>(c & 0x7f) << shift;
+		shift += 7;
+		if (!(c & 0x80)) {
+			length++;
+			return ret;
+		}
+	}
+	return frg::null_opt;
+}
+
+/*
+ * Parses the next unit (header, section or function body) if all of
+ * its bytes are buffered. Returns false when more input is needed.
+ */
+bool StreamingDecoder::step() {
+	switch (decoder_state) {
+		case DECODE_HEADER: {
+			if (available() < 8)
+				return false;
+			MemoryStream stream{buffer.data() + consumed, 8};
+			module->stream = &stream;
+			if (!module->verify_signature())
+				panic("Error verifiying module signature\n");
+			auto version = stream_read<uint32_t>(&stream);
+			log_info("Webassembly version %d\n", *version);
+			module->stream = nullptr;
+
+			consumed += 8;
+			decoder_state = DECODE_SECTION_HEADER;
+			return true;
+		}
+		case DECODE_SECTION_HEADER: {
+			if (available() < 2)
+				return false;
+			auto id = static_cast<uint8_t>(buffer[consumed]);
+			consumed++;
+			size_t length_size;
+			auto length = peek_varuint(length_size);
+			if (!length) {
+				consumed--;
+				return false;
+			}
+			consumed += length_size;
+
+			section_id = id;
+			section_length = *length;
+			decoder_state = id == SECTION_CODE ? DECODE_CODE_COUNT
+				: DECODE_SECTION;
+			return true;
+		}
+		case DECODE_SECTION: {
+			if (available() < section_length)
+				return false;
+			MemoryStream stream{buffer.data() + consumed, section_length};
+			module->stream = &stream;
+			module->parse_section(section_id, section_length);
+			module->stream = nullptr;
+
+			consumed += section_length;
+			decoder_state = DECODE_SECTION_HEADER;
+			return true;
+		}
+		case DECODE_CODE_COUNT: {
+			size_t count_size;
+			auto count = peek_varuint(count_size);
+			if (!count)
+				return false;
+			consumed += count_size;
+
+			code_entries_left = *count;
+			decoder_state = code_entries_left ? DECODE_CODE_ENTRY
+				: DECODE_SECTION_HEADER;
+			return true;
+		}
+		case DECODE_CODE_ENTRY: {
+			size_t size_size;
+			auto body_size = peek_varuint(size_size);
+			if (!body_size || available() < size_size + *body_size)
+				return false;
+			MemoryStream stream{buffer.data() + consumed,
+				size_size + *body_size};
+			module->stream = &stream;
+			module->parse_code_entry(module->function_code.emplace_back());
+			module->stream = nullptr;
+
+			consumed += size_size + *body_size;
+			if (!--code_entries_left) {
+				module->translate_code();
+				module->dump_code();
+				decoder_state = DECODE_SECTION_HEADER;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+} /* namespace bearwasm */
@@ -0,0 +1,69 @@
+#include <bearwasm/Trap.h>
+#include <bearwasm/Interpreter.h>
+
+namespace bearwasm {
+
+const char *trap_name(TrapKind kind) {
+	switch (kind) {
+		case TRAP_NONE:
+			return "no trap";
+		case TRAP_UNREACHABLE:
+			return "unreachable executed";
+		case TRAP_OUT_OF_BOUNDS:
+			return "out of bounds memory access";
+		case TRAP_DIVIDE_BY_ZERO:
+			return "integer divide by zero";
+		case TRAP_INTEGER_OVERFLOW:
+			return "integer overflow";
+		case TRAP_STACK_OVERFLOW:
+			return "stack overflow";
+		case TRAP_UNDEFINED_ELEMENT:
+			return "undefined element";
+		case TRAP_UNINITIALIZED_ELEMENT:
+			return "uninitialized element";
+		case TRAP_INDIRECT_CALL_MISMATCH:
+			return "indirect call type mismatch";
+		case TRAP_EXIT:
+			return "program exited";
+	}
+	return "unknown trap";
+}
+
+/*
+ * The interpreter checks division itself, so only memory faults get
+ * here. They are only ours if they hit a guard page of the running
+ * instance, or one of its memories, where read only or truncated
+ * files are mapped. Anything else is a crash, whatever state->trap
+ * was left at.
+ */
+void handle_fault(void *address) {
+	auto context = static_cast<TrapContext*>(bearwasm_get_trap_context());
+	if (!context)
+		return;
+
+	auto state = context->state;
+	auto kind = TRAP_NONE;
+	if (state->stack.is_guard(address)
+			|| state->callstack.is_guard(address)
+			|| state->labelstack.is_guard(address)) {
+		kind = TRAP_STACK_OVERFLOW;
+	} else {
+		for (const auto &memory : state->memory)
+			if (memory.contains(address))
+				kind = TRAP_OUT_OF_BOUNDS;
+	}
+	if (kind == TRAP_NONE)
+		return;
+	state->trap = kind;
+	__builtin_longjmp(context->jump_buffer, 1);
+}
+
+void raise_trap(TrapKind kind) {
+	auto context = static_cast<TrapContext*>(bearwasm_get_trap_context());
+	if (!context)
+		panic("Trap outside of the interpreter: %s\n", trap_name(kind));
+	context->state->trap = kind;
+	__builtin_longjmp(context->jump_buffer, 1);
+}
+
+} /* namespace bearwasm */
@@ -1,4 +1,5 @@
 #include <bearwasm/Util.h>
+#include <string.h>
 
 namespace bearwasm {
 
@@ -7,7 +8,7 @@ frg::optional<Limit> decode_limit(DataStream *stream) {
 	auto min = decode_varuint<uint32_t>(stream);
 	if (!min || !has_max)
 		return frg::null_opt;
-	frg::optional<uint8_t> max = 0;
+	frg::optional<uint32_t> max = 0;
 	if (*has_max) {
 		max = decode_varuint<uint32_t>(stream);
 		if (!max)
@@ -16,10 +17,11 @@ frg::optional<Limit> decode_limit(DataStream *stream) {
 	return frg::make_tuple(*min, *max);
 }
 
-frg::optional<frg::string<frg_allocator>> read_string(DataStream *stream) {
-	frg::string<frg_allocator> ret;
+frg::optional<frg::string<ArenaAllocator>> read_string(
+		DataStream *stream, ArenaAllocator allocator) {
+	frg::string<ArenaAllocator> ret{allocator};
 
-	auto length = stream_read<uint8_t>(stream);
+	auto length = decode_varuint<uint32_t>(stream);
 	if (!length) return frg::null_opt;
 
 	ret.resize(*length);
@@ -28,4 +30,47 @@ frg::optional<frg::string<frg_allocator>> read_string(DataStream *stream) {
 	return ret;
 }
 
+MemoryStream::MemoryStream(const char *data, size_t size) :
+	data(data), size(size), pos(0) {
+}
+
+frg::optional<char> MemoryStream::get() {
+	if (pos >= size)
+		return frg::null_opt;
+	return data[pos++];
+}
+
+bool MemoryStream::read(char *buf, size_t num) {
+	if (num > size - pos)
+		return false;
+	if (!num)
+		return true;
+	memcpy(buf, data + pos, num);
+	pos += num;
+	return true;
+}
+
+int MemoryStream::seek(long offset, SeekType type) {
+	long base = 0;
+	switch (type) {
+		case BWASM_SEEK_SET:
+			base = 0;
+			break;
+		case BWASM_SEEK_CUR:
+			base = pos;
+			break;
+		case BWASM_SEEK_END:
+			base = size;
+			break;
+	}
+	if (base + offset < 0 || static_cast<size_t>(base + offset) > size)
+		return -1;
+	pos = base + offset;
+	return 0;
+}
+
+long MemoryStream::tell() {
+	return pos;
+}
+
 } /* namespace bearwasm */
@@ -4,48 +4,218 @@
 namespace bearwasm {
 
 VirtualMachine::VirtualMachine(DataStream *stream) :
-	module(stream), handlers(frg::hash<frg::string<
-		       frg_allocator>>{})	{
+	VirtualMachine(new Module(stream)) {
+}
+
+VirtualMachine::VirtualMachine(Module *module) :
+	module(module), snapshot(nullptr), natives(frg::hash<frg::string<
+		       frg_allocator>>{}),
+	memories(frg::hash<frg::string<frg_allocator>>{}) {
 
 	asm_state = new ASMInterpreterState;
 }
 
-void VirtualMachine::init() {
+VirtualMachine::~VirtualMachine() {
+	delete asm_state;
+	if (snapshot)
+		snapshot->release();
+	module->release();
+}
+
+ExecutionStatus VirtualMachine::init() {
 	build_import_instances();
 	build_function_instances();
+	build_table_instances();
 	build_memory_instances();
 	build_data_instances();
-	state.globals = module.globals;
+
+	/* copied element by element, state must not
+	 * allocate from the module's arena */
+	initial_globals.resize(module->globals.size());
+	for (size_t i = 0; i < module->globals.size(); i++)
+		initial_globals[i] = module->globals[i];
+	state.globals.resize(initial_globals.size());
+
+	clear_dirty();
+	reset_state();
+	return run_start();
+}
+
+void VirtualMachine::init(Snapshot *snapshot) {
+	if (snapshot->module != module)
+		panic("Snapshot belongs to a different module\n");
+	snapshot->retain();
+	this->snapshot = snapshot;
+
+	build_import_instances();
+	build_function_instances();
+	/* imported memories are not the snapshot's to restore */
+	for (auto i = state.memory.size(); i < snapshot->memories.size(); i++)
+		state.memory.emplace_back(snapshot->memories[i].pages,
+				snapshot->image, snapshot->memories[i].offset);
+	state.tables.resize(snapshot->tables.size());
+	for (size_t i = 0; i < snapshot->tables.size(); i++)
+		state.tables[i] = snapshot->tables[i];
+
+	initial_globals.resize(snapshot->globals.size());
+	for (size_t i = 0; i < snapshot->globals.size(); i++)
+		initial_globals[i] = snapshot->globals[i];
+	state.globals.resize(initial_globals.size());
+
+	reset_state();
+}
+
+ExecutionStatus VirtualMachine::reset() {
+	for (size_t i = 0; i < state.memory.size(); i++)
+		state.memory[i].reset(module->data, i);
+	reset_state();
+	if (snapshot)
+		return EXECUTION_FINISHED;
+	return run_start();
+}
+
+/* pages the data segments wrote are what reset() goes back to, those
+ * the start function writes stay dirty so that it runs on them again */
+void VirtualMachine::clear_dirty() {
+	for (auto &memory : state.memory)
+		memory.clear_dirty();
+}
+
+/* the trap stays for get_trap() if it did not finish */
+ExecutionStatus VirtualMachine::run_start() {
+	if (module->start_function < 0)
+		return EXECUTION_FINISHED;
+
+	auto status = EXECUTION_FINISHED;
+	auto &function = state.functions[module->start_function];
+	if (function.type == FUNCTION_NATIVE) {
+		function.native.thunk(function.native.function, &state,
+				state.stack.end());
+		if (state.blocked)
+			status = EXECUTION_BLOCKED;
+	} else {
+		start_function(module->start_function);
+		status = Interpreter::interpret(state);
+	}
+	reset_stacks();
+	return status;
+}
+
+/* everything but memory, which init and reset set up differently */
+void VirtualMachine::reset_state() {
+	for (size_t i = 0; i < initial_globals.size(); i++)
+		state.globals[i] = initial_globals[i];
+	state.fuel = BUDGET_UNLIMITED;
+	state.epoch_deadline = EPOCH_NEVER;
+	state.trap = TRAP_NONE;
+	state.blocked = false;
+	state.has_call_result = false;
+	state.indirect_caches.resize(module->num_indirect_calls);
+	for (auto &cache : state.indirect_caches)
+		cache.slot = UINT32_MAX;
+	reset_stacks();
+}
+
+void VirtualMachine::reset_stacks() {
+	state.stack.clear();
+	state.labelstack.clear();
+	state.callstack.clear();
 
 	Frame frame;
 	frame.pc = PC_END;
 	frame.prev = 0;
-	frame.prev_expr = 0;
+	frame.locals = 0;
 	frame.labelstack_size = 0;
 	state.callstack.push(frame);
+	state.pc = 0;
+	state.locals = 0;
 }
 
-void VirtualMachine::register_handler(const frg::string<frg_allocator> &name,
-		NativeHandler handler) {
-	handlers[name] = handler;
+/* natives are looked up as module.name */
+static frg::string<frg_allocator> native_key(const char *module,
+		size_t module_size, const char *name, size_t name_size) {
+	frg::string<frg_allocator> key;
+	key.resize(module_size + 1 + name_size);
+	memcpy(key.data(), module, module_size);
+	key.data()[module_size] = '.';
+	memcpy(key.data() + module_size + 1, name, name_size);
+	return key;
 }
 
-int VirtualMachine::execute(int argc, char **argv) {
-	state.current_function = -1;
-	for (const auto &func : module.exports.func)
-		if (func.name == "main")
-			state.current_function = func.index;
-	if (state.current_function == -1)
+void VirtualMachine::register_native(const char *module, const char *name,
+		const NativeFunction &native) {
+	natives[native_key(module, strlen(module), name, strlen(name))] =
+		native;
+}
+
+void VirtualMachine::register_memory(const char *module, const char *name,
+		char *base, int pages) {
+	memories[native_key(module, strlen(module), name, strlen(name))] =
+		BorrowedMemory{base, pages};
+}
+
+void VirtualMachine::register_memory(const char *module, const char *name,
+		MemoryInstance &memory) {
+	register_memory(module, name, memory.data(),
+			memory.get_size() / PAGE_SIZE);
+}
+
+MemoryInstance *VirtualMachine::get_memory(const char *name) {
+	for (const auto &memory : module->exports.mem)
+		if (memory.name == name
+				&& static_cast<size_t>(memory.index)
+				< state.memory.size())
+			return &state.memory[memory.index];
+	return nullptr;
+}
+
+void VirtualMachine::set_host_data(void *data) {
+	state.host_data = data;
+}
+
+void VirtualMachine::set_unblocked_handler(void (*handler)(void *data),
+		void *data) {
+	state.unblocked = handler;
+	state.unblocked_data = data;
+}
+
+ExecutionStatus VirtualMachine::execute(int argc, char **argv) {
+	start(argc, argv);
+	return resume(BUDGET_UNLIMITED);
+}
+
+int VirtualMachine::find_function(const char *name) {
+	for (const auto &func : module->exports.func)
+		if (func.name == name)
+			return func.index;
+	return -1;
+}
+
+void VirtualMachine::start_function(int index) {
+	auto &function = state.functions[index];
+	if (function.type != FUNCTION_WASM)
+		panic("Can not start native function %d\n", index);
+	reset_stacks();
+	const auto &callee = state.callees[index];
+	for (uint32_t i = 0; i < callee.frame_size; i++)
+		state.stack.emplace(static_cast<uint64_t>(0));
+	state.current_function = index;
+}
+
+void VirtualMachine::start(int argc, char **argv) {
+	auto main = find_function("main");
+	if (main < 0)
 		panic("Could not find main function!");
+	start_function(main);
 
+	/* main may also be declared without them */
+	const auto num_params = state.callees[main].num_params;
 	//argc
-	state.functions[state.current_function].locals[0].value.int32_val =
-		static_cast<int32_t>(argc);
-	state.functions[state.current_function].locals[0].type = I_32;
+	if (num_params > 0)
+		state.stack[0] = static_cast<int32_t>(argc);
 	//argv
-	state.functions[state.current_function].locals[1].value.int32_val =
-		static_cast<int32_t>(1);
-	state.functions[state.current_function].locals[1].type = I_32;
+	if (num_params > 1)
+		state.stack[1] = static_cast<int32_t>(1);
 
 	int offset = 0;
 	for (int i = 0; i < argc; i++) {
@@ -56,9 +226,32 @@ int VirtualMachine::execute(int argc, char **argv) {
 		state.memory[0].copy(arg, length, location);
 		offset += length;
 	}
-	Interpreter::interpret(state);
-	auto res = state.stack.top();
-	return res.int32_val;
+}
+
+ExecutionStatus VirtualMachine::resume(uint64_t budget) {
+	return Interpreter::interpret(state, budget);
+}
+
+void VirtualMachine::set_fuel(uint64_t fuel) {
+	state.fuel = fuel;
+}
+
+uint64_t VirtualMachine::get_fuel() {
+	return state.fuel;
+}
+
+TrapKind VirtualMachine::get_trap() {
+	return state.trap;
+}
+
+void VirtualMachine::set_epoch_deadline(uint64_t ticks) {
+	auto now = current_epoch();
+	state.epoch_deadline = ticks < EPOCH_NEVER - now ? now + ticks
+		: EPOCH_NEVER;
+}
+
+int VirtualMachine::get_result() {
+	return state.stack.top().int32_val;
 }
 
 int VirtualMachine::execute_asm(int argc, char **argv) {
@@ -66,7 +259,7 @@ int VirtualMachine::execute_asm(int argc, char **argv) {
 	asm_state->pc = 0;
 
 	asm_state->expression_no = -1;
-	for (const auto &func : module.exports.func)
+	for (const auto &func : module->exports.func)
 		if (func.name == "main")
 			asm_state->expression_no = func.index;
 	if (asm_state->expression_no == -1)
@@ -79,10 +272,10 @@ int VirtualMachine::execute_asm(int argc, char **argv) {
 	for (size_t i = 0; i < state.functions.size(); i++) {
 		const auto &instance = state.functions[i];
 		asm_state->expressions[i] = new uint8_t[instance.size];
-		memcpy(asm_state->expressions[i], instance.expression.data(), instance.size);
-		asm_state->expression_arg_no[i] = instance.signature.parameters.size();
-		asm_state->locals[i] = new uint64_t[instance.locals.size()];
-		for (size_t j = 0; j < instance.locals.size(); j++)
+		memcpy(asm_state->expressions[i], instance.expression->data(), instance.size);
+		asm_state->expression_arg_no[i] = state.callees[i].num_params;
+		asm_state->locals[i] = new uint64_t[state.callees[i].frame_size];
+		for (size_t j = 0; j < state.callees[i].frame_size; j++)
 			asm_state->locals[i][j] = 0;
 	}
 
@@ -115,67 +308,130 @@ int VirtualMachine::execute_asm(int argc, char **argv) {
 }
 
 void VirtualMachine::build_function_instances() {
-	for (size_t i = 0; i < module.function_code.size(); i++) {
+	for (size_t i = 0; i < module->function_code.size(); i++) {
 		FunctionInstance instance;
 		instance.type = FUNCTION_WASM;
-		instance.expression = module.function_code[i].expression;
-		instance.size = instance.expression.size() * sizeof(Instruction);
-		instance.signature = module.function_types[module.functions[i]];
-		auto name_it = module.function_names.find(i);
-		if (name_it != module.function_names.end())
-			instance.name = name_it->template get<1>();
-		for (const auto param : instance.signature.parameters) {
-			LocalInstance local_instance;
-			local_instance.type = param;
-			local_instance.value.int32_val = 0;
-			instance.locals.push(local_instance);
-		}
-		for (auto &local : module.function_code[i].locals) {
-			LocalInstance local_instance;
-			local_instance.type = local;
-			local_instance.value.int32_val = 0;
-			instance.locals.push(local_instance);
-		}
+		instance.expression = &module->function_code[i].expression;
+		instance.size = instance.expression->size() * sizeof(Instruction);
+		instance.signature = &module->function_types[module->functions[i]];
+		instance.type_id = module->type_ids[module->functions[i]];
+		instance.name = nullptr;
+		auto name_it = module->function_names.find(i);
+		if (name_it != module->function_names.end())
+			instance.name = &name_it->template get<1>();
 		state.functions.push(instance);
+
+		Callee callee;
+		callee.expression = instance.expression;
+		callee.num_params = instance.signature->parameters.size();
+		callee.frame_size = callee.num_params
+			+ module->function_code[i].locals.size();
+		callee.num_results = instance.signature->results.size();
+		state.callees.push(callee);
     }
 }
 
+void VirtualMachine::build_table_instances() {
+	state.tables.resize(module->tables.size());
+	for (size_t i = 0; i < module->tables.size(); i++) {
+		auto &table = module->tables[i];
+		auto &instance = state.tables[i];
+		instance.max = table.limit.template get<1>();
+		instance.function_address.resize(table.data.size());
+		/* ELEMENT_NULL becomes -1 */
+		for (size_t k = 0; k < table.data.size(); k++)
+			instance.function_address[k] =
+				static_cast<int>(table.data[k]);
+	}
+}
+
 void VirtualMachine::build_memory_instances() {
-	for (auto &mem : module.memory_types)
+	for (auto &mem : module->memory_types)
 		state.memory.emplace_back(mem.template get<0>());
 }
 
 void VirtualMachine::build_import_instances() {
-	for (auto &import : module.imports) {
+	for (auto &import : module->imports) {
 		switch(import.description) {
 			case EXPORT_FUNC: {
-				if (import.module == "env") {
-					FunctionInstance instance;
-					instance.type = FUNCTION_NATIVE;
-
-					auto handler = handlers.find(import.name);
-					if(handler == handlers.end())
-						panic("could not resolve "
-					   "native import %s",
-							import.name.data());
-					instance.native_handler =
-						handler->template get<1>();
-
-					state.functions.push(instance);
-				}
+				if (static_cast<size_t>(import.idx) >=
+						module->function_types.size())
+					panic("Import %s has unknown type %d\n",
+						import.name.data(), import.idx);
+
+				FunctionInstance instance;
+				instance.type = FUNCTION_NATIVE;
+				instance.signature =
+					&module->function_types[import.idx];
+				instance.type_id = module->type_ids[import.idx];
+				instance.expression = nullptr;
+				instance.name = nullptr;
+
+				auto native = natives.find(native_key(
+					import.module.data(), import.module.size(),
+					import.name.data(), import.name.size()));
+				if(native == natives.end())
+					panic("could not resolve native import %s.%s\n",
+						import.module.data(),
+						import.name.data());
+				instance.native = native->template get<1>();
+				if (!native_matches(instance.native,
+							*instance.signature))
+					panic("Host function %s does not match the "
+						"type of its import\n",
+						import.name.data());
+
+				state.functions.push(instance);
+
+				Callee callee;
+				callee.expression = nullptr;
+				callee.num_params = instance.native.num_parameters;
+				callee.frame_size = callee.num_params;
+				callee.num_results = instance.native.num_results;
+				state.callees.push(callee);
+				break;
+			}
+			case EXPORT_MEM: {
+				auto memory = memories.find(native_key(
+					import.module.data(), import.module.size(),
+					import.name.data(), import.name.size()));
+				if (memory == memories.end())
+					panic("could not resolve memory import %s.%s\n",
+						import.module.data(),
+						import.name.data());
+				auto &borrowed = memory->template get<1>();
+				auto max = import.limit.template get<1>();
+				if (static_cast<uint32_t>(borrowed.pages)
+						< import.limit.template get<0>()
+						|| (max && static_cast<uint32_t>(
+								borrowed.pages) > max))
+					panic("Memory %s does not fit its import\n",
+						import.name.data());
+				state.memory.emplace_back(borrowed.base,
+						borrowed.pages);
 				break;
 			}
 			default:
-				panic("unkown import descriptor");
+				panic("Imported tables and globals are not "
+					"supported, %s.%s\n",
+					import.module.data(),
+					import.name.data());
 		}
 	}
 }
 
 void VirtualMachine::build_data_instances() {
-	for (auto &data : module.data) {
-		state.memory[data.memidx].copy(
-				reinterpret_cast<char*>(data.bytes.data()),
-				data.bytes.size(), data.offset);
+	for (auto &data : module->data) {
+		if (static_cast<size_t>(data.memidx) >= state.memory.size())
+			panic("Data segment refers to unknown memory %d\n",
+					data.memidx);
+		auto &memory = state.memory[data.memidx];
+		auto offset = static_cast<uint32_t>(data.offset);
+		if (data.bytes.size() > static_cast<size_t>(memory.get_size())
+				|| offset > memory.get_size() - data.bytes.size())
+			panic("Data segment does not fit in memory\n");
+		memory.copy(reinterpret_cast<const char*>(data.bytes.data()),
+				data.bytes.size(), offset);
 	}
 }
 
@@ -0,0 +1,586 @@
+#include <bearwasm/Wasi.h>
+#include <bearwasm/Trap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+namespace bearwasm {
+
+enum WasiErrno : int32_t {
+	WASI_ESUCCESS = 0,
+	WASI_E2BIG = 1,
+	WASI_EACCES = 2,
+	WASI_EAGAIN = 6,
+	WASI_EBADF = 8,
+	WASI_EEXIST = 20,
+	WASI_EFAULT = 21,
+	WASI_EINTR = 27,
+	WASI_EINVAL = 28,
+	WASI_EIO = 29,
+	WASI_EISDIR = 31,
+	WASI_ELOOP = 32,
+	WASI_EMFILE = 33,
+	WASI_ENAMETOOLONG = 37,
+	WASI_ENOENT = 44,
+	WASI_ENOSPC = 51,
+	WASI_ENOSYS = 52,
+	WASI_ENOTDIR = 54,
+	WASI_ENOTEMPTY = 55,
+	WASI_ENOTSUP = 58,
+	WASI_EPERM = 63,
+	WASI_EPIPE = 64,
+	WASI_ESPIPE = 70,
+	WASI_ENOTCAPABLE = 76,
+};
+
+enum WasiFiletype : uint8_t {
+	WASI_FILETYPE_UNKNOWN = 0,
+	WASI_FILETYPE_BLOCK_DEVICE = 1,
+	WASI_FILETYPE_CHARACTER_DEVICE = 2,
+	WASI_FILETYPE_DIRECTORY = 3,
+	WASI_FILETYPE_REGULAR_FILE = 4,
+	WASI_FILETYPE_SOCKET_STREAM = 6,
+	WASI_FILETYPE_SYMBOLIC_LINK = 7,
+};
+
+/* oflags and fdflags of path_open */
+static constexpr int32_t WASI_O_CREAT = 1;
+static constexpr int32_t WASI_O_DIRECTORY = 2;
+static constexpr int32_t WASI_O_EXCL = 4;
+static constexpr int32_t WASI_O_TRUNC = 8;
+static constexpr int32_t WASI_FDFLAG_APPEND = 1;
+static constexpr int32_t WASI_FDFLAG_NONBLOCK = 4;
+/* rights_base bits that ask for reading and writing */
+static constexpr uint64_t WASI_RIGHT_FD_READ = 1 << 1;
+static constexpr uint64_t WASI_RIGHT_FD_WRITE = 1 << 6;
+static constexpr uint8_t WASI_PREOPENTYPE_DIR = 0;
+
+static int32_t wasi_errno(int error) {
+	switch (error) {
+		case 0: return WASI_ESUCCESS;
+		case E2BIG: return WASI_E2BIG;
+		case EACCES: return WASI_EACCES;
+		case EAGAIN: return WASI_EAGAIN;
+		case EBADF: return WASI_EBADF;
+		case EEXIST: return WASI_EEXIST;
+		case EFAULT: return WASI_EFAULT;
+		case EINTR: return WASI_EINTR;
+		case EINVAL: return WASI_EINVAL;
+		case EIO: return WASI_EIO;
+		case EISDIR: return WASI_EISDIR;
+		case ELOOP: return WASI_ELOOP;
+		case EMFILE: return WASI_EMFILE;
+		case ENAMETOOLONG: return WASI_ENAMETOOLONG;
+		case ENOENT: return WASI_ENOENT;
+		case ENOSPC: return WASI_ENOSPC;
+		case ENOSYS: return WASI_ENOSYS;
+		case ENOTDIR: return WASI_ENOTDIR;
+		case ENOTEMPTY: return WASI_ENOTEMPTY;
+		case EOPNOTSUPP: return WASI_ENOTSUP;
+		case EPERM: return WASI_EPERM;
+		case EPIPE: return WASI_EPIPE;
+		case ESPIPE: return WASI_ESPIPE;
+		default: return WASI_EIO;
+	}
+}
+
+static uint8_t wasi_filetype(mode_t mode) {
+	switch (mode & S_IFMT) {
+		case S_IFBLK: return WASI_FILETYPE_BLOCK_DEVICE;
+		case S_IFCHR: return WASI_FILETYPE_CHARACTER_DEVICE;
+		case S_IFDIR: return WASI_FILETYPE_DIRECTORY;
+		case S_IFREG: return WASI_FILETYPE_REGULAR_FILE;
+		case S_IFSOCK: return WASI_FILETYPE_SOCKET_STREAM;
+		case S_IFLNK: return WASI_FILETYPE_SYMBOLIC_LINK;
+		default: return WASI_FILETYPE_UNKNOWN;
+	}
+}
+
+/* only relative paths that stay below their directory */
+static bool contained_path(const std::string &path) {
+	if (path.empty() || path[0] == '/')
+		return false;
+	size_t start = 0;
+	while (start <= path.size()) {
+		auto end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+		if (path.compare(start, end - start, "..") == 0
+				&& end - start == 2)
+			return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+/*
+ * openat() that stays below dirfd, also where a directory on the way is
+ * a symlink. Kernels without openat2() get one component at a time,
+ * none of them followed if it is a symlink. A symlink at the end is
+ * never followed either way.
+ */
+static int open_beneath(int dirfd, const std::string &path, int flags) {
+	open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_NOFOLLOW;
+	how.mode = flags & O_CREAT ? 0644 : 0;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	int fd = syscall(SYS_openat2, dirfd, path.c_str(), &how, sizeof(how));
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+
+	int parent = dirfd;
+	size_t start = 0;
+	size_t end;
+	while ((end = path.find('/', start)) != std::string::npos) {
+		if (end > start) {
+			auto component = path.substr(start, end - start);
+			fd = openat(parent, component.c_str(), O_PATH
+					| O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			int error = errno;
+			if (parent != dirfd)
+				close(parent);
+			errno = error;
+			if (fd < 0)
+				return -1;
+			parent = fd;
+		}
+		start = end + 1;
+	}
+	auto last = start < path.size() ? path.substr(start) : ".";
+	fd = openat(parent, last.c_str(), flags | O_NOFOLLOW, 0644);
+	int error = errno;
+	if (parent != dirfd)
+		close(parent);
+	errno = error;
+	return fd;
+}
+
+template<typename T>
+static bool store(MemoryInstance &memory, uint32_t address, T value) {
+	auto p = memory.writable_view(address, sizeof(T));
+	if (!p)
+		return false;
+	memcpy(p, &value, sizeof(T));
+	return true;
+}
+
+/* the imports, as friends of WasiContext */
+struct WasiCalls {
+	static WasiContext *context(InterpreterState *state) {
+		return static_cast<WasiContext*>(state->host_data);
+	}
+
+	static MemoryInstance *memory(InterpreterState *state) {
+		if (!state->memory.size())
+			return nullptr;
+		return &state->memory[0];
+	}
+
+	/* the argv and environ layout: pointers at list, strings at buf */
+	static int32_t put_strings(InterpreterState *state,
+			const std::vector<std::string> &strings, uint32_t list,
+			uint32_t buf) {
+		auto mem = memory(state);
+		if (!mem)
+			return WASI_EFAULT;
+		for (auto &s : strings) {
+			auto dest = mem->writable_view(buf, s.size() + 1);
+			if (!dest || !store<uint32_t>(*mem, list, buf))
+				return WASI_EFAULT;
+			memcpy(dest, s.c_str(), s.size() + 1);
+			list += 4;
+			buf += s.size() + 1;
+		}
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t put_sizes(InterpreterState *state,
+			const std::vector<std::string> &strings, uint32_t count,
+			uint32_t size) {
+		auto mem = memory(state);
+		uint32_t total = 0;
+		for (auto &s : strings)
+			total += s.size() + 1;
+		if (!mem || !store<uint32_t>(*mem, count, strings.size())
+				|| !store<uint32_t>(*mem, size, total))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t args_get(InterpreterState *state, uint32_t argv,
+			uint32_t buf) {
+		return put_strings(state, context(state)->args, argv, buf);
+	}
+
+	static int32_t args_sizes_get(InterpreterState *state, uint32_t argc,
+			uint32_t size) {
+		return put_sizes(state, context(state)->args, argc, size);
+	}
+
+	static int32_t environ_get(InterpreterState *state, uint32_t environ,
+			uint32_t buf) {
+		return put_strings(state, context(state)->environment,
+				environ, buf);
+	}
+
+	static int32_t environ_sizes_get(InterpreterState *state,
+			uint32_t count, uint32_t size) {
+		return put_sizes(state, context(state)->environment, count,
+				size);
+	}
+
+	static int32_t clock_time_get(InterpreterState *state, uint32_t id,
+			uint64_t precision, uint32_t time) {
+		(void)precision;
+		static const clockid_t clocks[] = {CLOCK_REALTIME,
+			CLOCK_MONOTONIC, CLOCK_PROCESS_CPUTIME_ID,
+			CLOCK_THREAD_CPUTIME_ID};
+		if (id >= sizeof(clocks) / sizeof(clocks[0]))
+			return WASI_EINVAL;
+		timespec ts;
+		if (clock_gettime(clocks[id], &ts))
+			return wasi_errno(errno);
+		auto mem = memory(state);
+		uint64_t ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		if (!mem || !store(*mem, time, ns))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t fd_close(InterpreterState *state, int32_t fd) {
+		auto ctx = context(state);
+		auto file = ctx->get_fd(fd);
+		if (!file)
+			return WASI_EBADF;
+		if (fd == 1)
+			ctx->flush();
+		/* the stdio descriptors belong to the host */
+		if (fd > 2 && close(file->host_fd))
+			return wasi_errno(errno);
+		file->host_fd = -1;
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t fd_fdstat_get(InterpreterState *state, int32_t fd,
+			uint32_t stat) {
+		auto file = context(state)->get_fd(fd);
+		if (!file)
+			return WASI_EBADF;
+		struct stat st;
+		if (fstat(file->host_fd, &st))
+			return wasi_errno(errno);
+		int flags = fcntl(file->host_fd, F_GETFL);
+
+		/* filetype, pad, fdflags, pad, rights_base, rights_inheriting;
+		 * rights are not restricted so every bit is reported */
+		char fdstat[24] = {};
+		fdstat[0] = wasi_filetype(st.st_mode);
+		uint16_t fdflags = 0;
+		if (flags >= 0 && (flags & O_APPEND))
+			fdflags |= WASI_FDFLAG_APPEND;
+		if (flags >= 0 && (flags & O_NONBLOCK))
+			fdflags |= WASI_FDFLAG_NONBLOCK;
+		memcpy(fdstat + 2, &fdflags, 2);
+		memset(fdstat + 8, 0xff, 16);
+
+		auto mem = memory(state);
+		auto dest = mem ? mem->writable_view(stat, sizeof(fdstat))
+			: nullptr;
+		if (!dest)
+			return WASI_EFAULT;
+		memcpy(dest, fdstat, sizeof(fdstat));
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t fd_prestat_get(InterpreterState *state, int32_t fd,
+			uint32_t prestat) {
+		auto file = context(state)->get_fd(fd);
+		if (!file || file->preopen.empty())
+			return WASI_EBADF;
+		auto mem = memory(state);
+		if (!mem || !store<uint32_t>(*mem, prestat,
+					WASI_PREOPENTYPE_DIR)
+				|| !store<uint32_t>(*mem, prestat + 4,
+					file->preopen.size()))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t fd_prestat_dir_name(InterpreterState *state,
+			int32_t fd, uint32_t path, uint32_t length) {
+		auto file = context(state)->get_fd(fd);
+		if (!file || file->preopen.empty())
+			return WASI_EBADF;
+		if (length < file->preopen.size())
+			return WASI_ENAMETOOLONG;
+		auto mem = memory(state);
+		auto dest = mem ? mem->writable_view(path,
+				file->preopen.size()) : nullptr;
+		if (!dest)
+			return WASI_EFAULT;
+		memcpy(dest, file->preopen.data(), file->preopen.size());
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t transfer(InterpreterState *state, int32_t fd,
+			uint32_t iovs, uint32_t count, uint32_t result,
+			bool write) {
+		auto ctx = context(state);
+		auto file = ctx->get_fd(fd);
+		if (!file)
+			return WASI_EBADF;
+		if (count > WASI_MAX_IOVS)
+			return WASI_EINVAL;
+		auto mem = memory(state);
+		/* free while the guest runs, only a blocked call uses it */
+		auto buffers = ctx->pending_io.iovs;
+		if (!mem || !mem->gather(iovs, count, buffers, !write))
+			return WASI_EFAULT;
+
+		size_t total = 0;
+		for (uint32_t i = 0; i < count; i++)
+			total += buffers[i].length;
+
+		ssize_t done;
+		if (write && fd == 1
+				&& ctx->stdout_size + total
+				<= WASI_STDOUT_BUFFER_SIZE) {
+			for (uint32_t i = 0; i < count; i++) {
+				memcpy(ctx->stdout_buffer + ctx->stdout_size,
+						buffers[i].base,
+						buffers[i].length);
+				ctx->stdout_size += buffers[i].length;
+			}
+			done = total;
+		} else {
+			/* keep what was buffered in front of this, so
+			 * stderr never overtakes stdout */
+			ctx->flush();
+			if (ctx->ring) {
+				auto &io = ctx->pending_io;
+				io.operation = write ? IO_WRITE : IO_READ;
+				io.fd = file->host_fd;
+				io.buffers = buffers;
+				io.count = count;
+				io.offset = -1;
+				io.done = transfer_done;
+				io.state = state;
+				io.result_address = result;
+				/* the worker may finish it before submit()
+				 * returns, done right here if the ring is full */
+				block_call(state);
+				if (ctx->ring->submit(&io))
+					return WASI_ESUCCESS;
+				state->blocked = false;
+			}
+			auto iov = reinterpret_cast<iovec*>(buffers);
+			done = write ? writev(file->host_fd, iov, count)
+				: readv(file->host_fd, iov, count);
+			if (done < 0)
+				return wasi_errno(errno);
+		}
+		if (!store<uint32_t>(*mem, result, done))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static void transfer_done(IoRequest *request, int32_t result) {
+		auto &io = *static_cast<WasiContext::PendingIo*>(request);
+		int32_t error = WASI_ESUCCESS;
+		if (result < 0)
+			error = wasi_errno(-result);
+		else if (!store<uint32_t>(*memory(io.state),
+					io.result_address, result))
+			error = WASI_EFAULT;
+		finish_call(io.state, error);
+	}
+
+	static int32_t fd_read(InterpreterState *state, int32_t fd,
+			uint32_t iovs, uint32_t count, uint32_t nread) {
+		return transfer(state, fd, iovs, count, nread, false);
+	}
+
+	static int32_t fd_write(InterpreterState *state, int32_t fd,
+			uint32_t iovs, uint32_t count, uint32_t nwritten) {
+		return transfer(state, fd, iovs, count, nwritten, true);
+	}
+
+	static int32_t fd_seek(InterpreterState *state, int32_t fd,
+			int64_t offset, uint32_t whence, uint32_t result) {
+		auto ctx = context(state);
+		auto file = ctx->get_fd(fd);
+		if (!file)
+			return WASI_EBADF;
+		/* SET, CUR and END share their values with POSIX */
+		if (whence > 2)
+			return WASI_EINVAL;
+		if (fd == 1)
+			ctx->flush();
+		auto position = lseek(file->host_fd, offset, whence);
+		if (position < 0)
+			return wasi_errno(errno);
+		auto mem = memory(state);
+		if (!mem || !store<uint64_t>(*mem, result, position))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t path_open(InterpreterState *state, int32_t dirfd,
+			uint32_t dirflags, uint32_t path, uint32_t path_length,
+			uint32_t oflags, uint64_t rights_base,
+			uint64_t rights_inheriting, uint32_t fdflags,
+			uint32_t result) {
+		(void)dirflags;
+		(void)rights_inheriting;
+		auto ctx = context(state);
+		auto dir = ctx->get_fd(dirfd);
+		if (!dir)
+			return WASI_EBADF;
+		auto mem = memory(state);
+		auto name = mem ? mem->view(path, path_length) : nullptr;
+		if (!name)
+			return WASI_EFAULT;
+		std::string relative{name, path_length};
+		if (relative.find('\0') != std::string::npos
+				|| !contained_path(relative))
+			return WASI_ENOTCAPABLE;
+
+		bool read = rights_base & WASI_RIGHT_FD_READ;
+		bool write = rights_base & WASI_RIGHT_FD_WRITE;
+		int flags = O_CLOEXEC;
+		flags |= write ? (read ? O_RDWR : O_WRONLY) : O_RDONLY;
+		if (oflags & WASI_O_CREAT)
+			flags |= O_CREAT;
+		if (oflags & WASI_O_DIRECTORY)
+			flags |= O_DIRECTORY;
+		if (oflags & WASI_O_EXCL)
+			flags |= O_EXCL;
+		if (oflags & WASI_O_TRUNC)
+			flags |= O_TRUNC;
+		if (fdflags & WASI_FDFLAG_APPEND)
+			flags |= O_APPEND;
+		if (fdflags & WASI_FDFLAG_NONBLOCK)
+			flags |= O_NONBLOCK;
+
+		int host_fd = open_beneath(dir->host_fd, relative, flags);
+		/* openat2() found a way out of the directory */
+		if (host_fd < 0 && errno == EXDEV)
+			return WASI_ENOTCAPABLE;
+		if (host_fd < 0)
+			return wasi_errno(errno);
+		int32_t fd = ctx->fds.size();
+		ctx->fds.push_back({host_fd, std::string{}});
+		if (!store<uint32_t>(*mem, result, fd))
+			return WASI_EFAULT;
+		return WASI_ESUCCESS;
+	}
+
+	static void proc_exit(InterpreterState *state, int32_t code) {
+		auto ctx = context(state);
+		ctx->flush();
+		ctx->exit_code = code;
+		raise_trap(TRAP_EXIT);
+	}
+
+	static int32_t random_get(InterpreterState *state, uint32_t buf,
+			uint32_t length) {
+		auto mem = memory(state);
+		auto dest = mem ? mem->writable_view(buf, length) : nullptr;
+		if (!dest)
+			return WASI_EFAULT;
+		while (length) {
+			auto got = getrandom(dest, length, 0);
+			if (got < 0) {
+				if (errno == EINTR)
+					continue;
+				return wasi_errno(errno);
+			}
+			dest += got;
+			length -= got;
+		}
+		return WASI_ESUCCESS;
+	}
+
+	static int32_t sched_yield(InterpreterState *state) {
+		(void)state;
+		return WASI_ESUCCESS;
+	}
+};
+
+WasiContext::WasiContext(std::vector<std::string> args,
+		std::vector<std::string> environment) :
+	args(std::move(args)), environment(std::move(environment)),
+	stdout_size(0), ring(nullptr), exit_code(0) {
+	for (int fd = 0; fd < 3; fd++)
+		fds.push_back({fd, std::string{}});
+}
+
+WasiContext::~WasiContext() {
+	flush();
+	for (size_t fd = 3; fd < fds.size(); fd++)
+		if (fds[fd].host_fd >= 0)
+			close(fds[fd].host_fd);
+}
+
+bool WasiContext::preopen(const char *path, const char *guest_path) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	fds.push_back({fd, std::string{guest_path}});
+	return true;
+}
+
+WasiContext::Fd *WasiContext::get_fd(int32_t fd) {
+	if (fd < 0 || static_cast<size_t>(fd) >= fds.size()
+			|| fds[fd].host_fd < 0)
+		return nullptr;
+	return &fds[fd];
+}
+
+void WasiContext::flush() {
+	size_t written = 0;
+	while (written < stdout_size) {
+		auto n = write(1, stdout_buffer + written,
+				stdout_size - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	stdout_size = 0;
+}
+
+void WasiContext::attach(VirtualMachine &vm) {
+	static const char *module = "wasi_snapshot_preview1";
+#define WASI_FUNCTION(name) \
+	vm.register_function(module, #name, &WasiCalls::name)
+	WASI_FUNCTION(args_get);
+	WASI_FUNCTION(args_sizes_get);
+	WASI_FUNCTION(environ_get);
+	WASI_FUNCTION(environ_sizes_get);
+	WASI_FUNCTION(clock_time_get);
+	WASI_FUNCTION(fd_close);
+	WASI_FUNCTION(fd_fdstat_get);
+	WASI_FUNCTION(fd_prestat_get);
+	WASI_FUNCTION(fd_prestat_dir_name);
+	WASI_FUNCTION(fd_read);
+	WASI_FUNCTION(fd_write);
+	WASI_FUNCTION(fd_seek);
+	WASI_FUNCTION(path_open);
+	WASI_FUNCTION(proc_exit);
+	WASI_FUNCTION(random_get);
+	WASI_FUNCTION(sched_yield);
+#undef WASI_FUNCTION
+	vm.set_host_data(this);
+}
+
+} /* namespace bearwasm */
@@ -20,14 +20,16 @@ static int isdigit(char c) {
 static const char *digits_upper = "0123456789ABCDEF";
 static const char *digits_lower = "0123456789abcdef";
 
-static char *num_fmt(uint64_t i, int base, int padding, char pad_with, int handle_signed, int upper, int len) {
+static constexpr int NUM_BUF_SIZE = 50;
+
+/* formats into the end of buf, which holds NUM_BUF_SIZE chars */
+static char *num_fmt(char *buf, uint64_t i, int base, int padding, char pad_with, int handle_signed, int upper, int len) {
 	int neg = (signed)i < 0 && handle_signed;
 
 	if (neg)
 		i = (unsigned)(-((signed)i));
 
-	static char buf[50];
-	char *ptr = buf + 49;
+	char *ptr = buf + NUM_BUF_SIZE - 1;
 	*ptr = '\0';
 
 	const char *digits = upper ? digits_upper : digits_lower;
@@ -54,6 +56,7 @@ static char *num_fmt(uint64_t i, int base, int padding, char pad_with, int handl
 void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 	uint64_t i;
 	char *s;
+	char num_buf[NUM_BUF_SIZE];
 
 	while(*fmt && len) {
 		if (*fmt != '%') {
@@ -97,7 +100,7 @@ void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 				else
 					i = va_arg(arg, int);
 
-				char *c = num_fmt(i, 10, padding, pad_with, 1, 0, -1);
+				char *c = num_fmt(num_buf, i, 10, padding, pad_with, 1, 0, -1);
 				while (*c) {
 					FMT_PUT(buf, len, *c);
 					c++;
@@ -111,7 +114,7 @@ void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 				else
 					i = va_arg(arg, int);
 
-				char *c = num_fmt(i, 10, padding, pad_with, 0, 0, -1);
+				char *c = num_fmt(num_buf, i, 10, padding, pad_with, 0, 0, -1);
 				while (*c) {
 					FMT_PUT(buf, len, *c);
 					c++;
@@ -125,7 +128,7 @@ void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 				else
 					i = va_arg(arg, int);
 
-				char *c = num_fmt(i, 8, padding, pad_with, 0, 0, -1);
+				char *c = num_fmt(num_buf, i, 8, padding, pad_with, 0, 0, -1);
 				while (*c) {
 					FMT_PUT(buf, len, *c);
 					c++;
@@ -140,7 +143,7 @@ void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 				else
 					i = va_arg(arg, int);
 
-				char *c = num_fmt(i, 16, padding, pad_with, 0, upper, wide ? 16 : 8);
+				char *c = num_fmt(num_buf, i, 16, padding, pad_with, 0, upper, wide ? 16 : 8);
 				while (*c) {
 					FMT_PUT(buf, len, *c);
 					c++;
@@ -152,7 +155,7 @@ void vsnprintf(char *buf, size_t len, const char *fmt, va_list arg) {
 			case 'p': {
 				i = (uint64_t)(va_arg(arg, void *));
 
-				char *c = num_fmt(i, 16, padding, pad_with, 0, upper, 16);
+				char *c = num_fmt(num_buf, i, 16, padding, pad_with, 0, upper, 16);
 				while (*c) {
 					FMT_PUT(buf, len, *c);
 					c++;
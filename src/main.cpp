@@ -1,91 +1,290 @@
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
 #include <bearwasm/VirtualMachine.h>
+#include <bearwasm/StreamingDecoder.h>
+#include <bearwasm/ModuleCache.h>
+#include <bearwasm/Epoch.h>
+#include <bearwasm/Wasi.h>
+#include <bearwasm/LinuxHost.h>
 #include <bearwasm/host.hpp>
 
-void *frg_allocator::allocate(size_t size) {
-	return malloc(size);
-}
-
-void frg_allocator::free(void *p) {
-	if (p)
-            ::free(p);
-}
-
-void frg_allocator::deallocate(void *p, size_t n) {
-        (void) n;
-        ::free(p);
-}
+static constexpr size_t CHUNK_SIZE = 65536;
 
-class FileStream : public bearwasm::DataStream {
+class FileSink : public bearwasm::DataSink {
 public:
-	FileStream(const std::string &path) : stream(path) {
+	FileSink(FILE *file) : file(file) {
 	}
 
-	frg::optional<char> get() {
-		char c = stream.get();
-		if (c == EOF) return frg::null_opt;
-		return c;
+	bool write(const char *buf, size_t size) {
+		return fwrite(buf, 1, size, file) == size;
 	}
+private:
+	FILE *file;
+};
 
-	bool read(char *buf, size_t size) {
-		return !(stream.read(buf, size).fail());
+struct MappedFile {
+	const char *data;
+	size_t size;
+};
+
+static bool map_file(const char *path, MappedFile &file) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return false;
 	}
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
 
-	int seek(long pos, SeekType type) {
-		bool success = false;
-		switch (type) {
-			case BWASM_SEEK_SET:
-				success = !(stream.seekg(pos).fail());
-			case BWASM_SEEK_CUR:
-				success = !(stream.seekg(pos,
-							std::ios::cur).fail());
-			case BWASM_SEEK_END:
-				success =!(stream.seekg(pos,
-							std::ios::end).fail());
-		}
-		return success ? 0 : -1;
+	file.data = static_cast<const char*>(data);
+	file.size = st.st_size;
+	return true;
+}
+
+static void unmap_file(MappedFile &file) {
+	munmap(const_cast<char*>(file.data), file.size);
+}
+
+/*
+ * Loads the module at path. When BEARWASM_CACHE_DIR is set the decoded
+ * module is cached there under the hash of the binary and the flags it
+ * was translated with, so later runs skip decoding.
+ */
+static bearwasm::Module *load_module(const char *path,
+		uint32_t translate_flags) {
+	MappedFile wasm;
+	if (!map_file(path, wasm)) {
+		std::cout << "Unable to open " << path << std::endl;
+		return nullptr;
 	}
+	auto hash = bearwasm::ModuleCache::hash(
+			reinterpret_cast<const char*>(&translate_flags),
+			sizeof(translate_flags));
+	hash = bearwasm::ModuleCache::hash(wasm.data, wasm.size, hash);
+
+	std::string cache_path;
+	if (auto dir = getenv("BEARWASM_CACHE_DIR")) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016" PRIx64 ".bwc", hash);
+		cache_path = std::string(dir) + name;
 
-	long tell() {
-		return stream.tellg();
+		MappedFile cache;
+		if (map_file(cache_path.c_str(), cache)) {
+			/* the module has its own copy of everything */
+			auto module = bearwasm::ModuleCache::load(cache.data,
+					cache.size, hash);
+			unmap_file(cache);
+			if (module) {
+				unmap_file(wasm);
+				return module;
+			}
+		}
 	}
-private:
-	std::ifstream stream;
-};
 
-static int print(bearwasm::InterpreterState *state) {
-	auto val = state->stack.top();
-	state->stack.pop();
-	int ptr = val.int32_val;
-	char *str = reinterpret_cast<char*>(
-			state->memory[0].data() + ptr);
-	return printf(str);
+	/* decode while the rest of the file is still being paged in */
+	bearwasm::StreamingDecoder decoder{translate_flags};
+	for (size_t offset = 0; offset < wasm.size; offset += CHUNK_SIZE)
+		decoder.feed(wasm.data + offset,
+				std::min(CHUNK_SIZE, wasm.size - offset));
+	unmap_file(wasm);
+	auto module = decoder.finish();
+
+	if (!cache_path.empty()) {
+		/* write under a temporary name so concurrently starting
+		 * processes never map a half written cache */
+		auto tmp_path = cache_path + "." + std::to_string(getpid());
+		if (FILE *file = fopen(tmp_path.c_str(), "wb")) {
+			FileSink sink{file};
+			bool written = bearwasm::ModuleCache::write(*module,
+					hash, &sink);
+			if (fclose(file) || !written
+					|| rename(tmp_path.c_str(),
+						cache_path.c_str()))
+				unlink(tmp_path.c_str());
+		}
+	}
+	return module;
 }
 
-void bearwasm_abort() {
-	exit(1);
+/*
+ * Places the file at path read only into the exported memory at
+ * address, for --map. The image stays until the process exits.
+ */
+static bool map_into_memory(bearwasm::VirtualMachine &vm,
+		uint32_t address, const char *path) {
+	auto memory = vm.get_memory("memory");
+	if (!memory)
+		return false;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *image = nullptr;
+	if (!fstat(fd, &st) && st.st_size)
+		image = bearwasm_open_image(fd);
+	close(fd);
+	if (!image)
+		return false;
+	if (!memory->map_range(address, st.st_size, image, 0, false)) {
+		bearwasm_destroy_image(image);
+		return false;
+	}
+	return true;
 }
 
-void bearwasm_log(int level, const char *str) {
-	(void)level;
-	printf("%s", str);
+static int32_t print(bearwasm::InterpreterState *state, uint32_t ptr) {
+	size_t length;
+	auto str = state->memory[0].string_view(ptr, length);
+	if (!str)
+		bearwasm::raise_trap(bearwasm::TRAP_OUT_OF_BOUNDS);
+	return fwrite(str, 1, length, stdout);
 }
 
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		std::cout << "Please provide the path to a wasm binary" << std::endl;
+	/* options come before the binary, everything after is the guest's */
+	uint32_t translate_flags = 0;
+	/* host directories the guest may open files below */
+	std::vector<const char*> dirs;
+	/* files placed into guest memory, by address */
+	std::vector<std::pair<uint32_t, const char*>> maps;
+	int first = 1;
+	for (; first < argc && !strncmp(argv[first], "--", 2); first++) {
+		if (!strcmp(argv[first], "--elide-bounds-checks")) {
+			translate_flags |= bearwasm::TRANSLATE_BOUNDS_CHECKS;
+		} else if (!strncmp(argv[first], "--dir=", 6)
+				&& argv[first][6]) {
+			dirs.push_back(argv[first] + 6);
+		} else if (!strncmp(argv[first], "--map=", 6)) {
+			char *path;
+			auto address = strtoul(argv[first] + 6, &path, 0);
+			if (*path != ':' || !path[1] || address > UINT32_MAX) {
+				std::cout << "Expected --map=ADDRESS:PATH"
+					<< std::endl;
+				return 1;
+			}
+			maps.push_back({address, path + 1});
+		} else {
+			std::cout << "Unknown option " << argv[first] << std::endl;
+			return 1;
+		}
+	}
+	if (first == argc) {
+		std::cout << "Usage: bearwasm [--elide-bounds-checks] "
+			"[--dir=PATH]... [--map=ADDRESS:PATH]... "
+			"binary.wasm [args...]" << std::endl;
 		return 0;
 	}
 
-	FileStream stream{std::string(argv[1])};
-	bearwasm::VirtualMachine vm{&stream};
-	vm.register_handler("print", &print);
-	vm.init();
+	bearwasm_install_fault_handlers();
+
+	auto module = load_module(argv[first], translate_flags);
+	if (!module)
+		return 1;
+
+	/* the guest sees the arguments after the binary and no files but
+	 * those below the directories given with --dir */
+	std::vector<std::string> args{argv + first, argv + argc};
+	std::vector<std::string> environment;
+	for (auto env = environ; *env; env++)
+		environment.push_back(*env);
+	bearwasm::WasiContext wasi{std::move(args), std::move(environment)};
+	for (auto dir : dirs) {
+		if (!wasi.preopen(dir, dir)) {
+			std::cout << "Unable to open directory " << dir
+				<< std::endl;
+			return 1;
+		}
+	}
+
+	bearwasm::VirtualMachine vm{module};
+	vm.register_function("print", &print);
+	wasi.attach(vm);
+	if (vm.init() != bearwasm::EXECUTION_FINISHED) {
+		wasi.flush();
+		if (vm.get_trap() == bearwasm::TRAP_EXIT) {
+			std::cout << "Program exit code: "
+				<< wasi.get_exit_code() << std::endl;
+			return wasi.get_exit_code();
+		}
+		std::cout << "Start function did not finish: "
+			<< bearwasm::trap_name(vm.get_trap()) << std::endl;
+		return 1;
+	}
+	for (const auto &map : maps) {
+		if (!map_into_memory(vm, map.first, map.second)) {
+			std::cout << "Unable to map " << map.second
+				<< " at " << map.first << std::endl;
+			return 1;
+		}
+	}
+
+	/* the epoch ticks every millisecond while a time limit is set */
+	bearwasm::EpochTimer *timer = nullptr;
+	if (auto timeout = getenv("BEARWASM_TIMEOUT_MS")) {
+		timer = new bearwasm::EpochTimer{1000};
+		vm.set_epoch_deadline(strtoull(timeout, nullptr, 10));
+	}
+
+	/* WASI commands export _start, everything else main */
 	std::cout << "Starting to execute program" << std::endl;
-	auto res = vm.execute(argc - 2, argv + 2);
-	std::cout << "Program exit code: " << res << std::endl;
-	return 0;
+	auto entry = vm.find_function("_start");
+	if (entry >= 0)
+		vm.start_function(entry);
+	else
+		vm.start(argc - first - 1, argv + first + 1);
+	auto status = vm.resume(bearwasm::BUDGET_UNLIMITED);
+	delete timer;
+	wasi.flush();
+	switch (status) {
+		case bearwasm::EXECUTION_FINISHED:
+			/* _start has no result, a non-zero code goes
+			 * through proc_exit */
+			if (entry >= 0) {
+				std::cout << "Program exit code: 0" << std::endl;
+				return 0;
+			}
+			std::cout << "Program exit code: " << vm.get_result()
+				<< std::endl;
+			return 0;
+		case bearwasm::EXECUTION_TRAPPED:
+			if (vm.get_trap() == bearwasm::TRAP_EXIT) {
+				std::cout << "Program exit code: "
+					<< wasi.get_exit_code() << std::endl;
+				return wasi.get_exit_code();
+			}
+			std::cout << "Program trapped: "
+				<< bearwasm::trap_name(vm.get_trap())
+				<< std::endl;
+			return 1;
+		case bearwasm::EXECUTION_INTERRUPTED:
+			std::cout << "Program exceeded its time limit"
+				<< std::endl;
+			return 1;
+		case bearwasm::EXECUTION_OUT_OF_FUEL:
+			std::cout << "Program ran out of fuel" << std::endl;
+			return 1;
+		case bearwasm::EXECUTION_BLOCKED:
+			std::cout << "Program blocked in a native call"
+				<< std::endl;
+			return 1;
+		case bearwasm::EXECUTION_SUSPENDED:
+			std::cout << "Program was suspended" << std::endl;
+			return 1;
+	}
+	return 1;
 }
@@ -0,0 +1,249 @@
+#ifndef BEARWASM_TEST_H
+#define BEARWASM_TEST_H
+
+/*
+ * Shared by the runtime tests: CHECK and a small assembler for the
+ * modules they run. A test is a program that exits with the number of
+ * failed checks.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <bearwasm/StreamingDecoder.h>
+#include <bearwasm/VirtualMachine.h>
+#include <bearwasm/LinuxHost.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", \
+				__FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+namespace wasm {
+
+using Bytes = std::string;
+
+static constexpr uint8_t I32 = 0x7F;
+static constexpr uint8_t I64 = 0x7E;
+static constexpr uint8_t VOID = 0x40;
+
+inline Bytes uleb(uint64_t value) {
+	Bytes out;
+	do {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		out += static_cast<char>(value ? byte | 0x80 : byte);
+	} while (value);
+	return out;
+}
+
+inline Bytes sleb(int64_t value) {
+	Bytes out;
+	while (true) {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		if ((!value && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+			out += static_cast<char>(byte);
+			return out;
+		}
+		out += static_cast<char>(byte | 0x80);
+	}
+}
+
+inline Bytes op(uint8_t opcode) {
+	return Bytes(1, static_cast<char>(opcode));
+}
+
+/* call, br, local.get and everything else with one index */
+inline Bytes op(uint8_t opcode, uint32_t index) {
+	return op(opcode) + uleb(index);
+}
+
+inline Bytes i32_const(int32_t value) {
+	return op(bearwasm::I_32_CONST) + sleb(value);
+}
+
+inline Bytes i64_const(int64_t value) {
+	return op(bearwasm::I_64_CONST) + sleb(value);
+}
+
+inline Bytes block(uint8_t opcode, uint8_t type = VOID) {
+	return op(opcode) + static_cast<char>(type);
+}
+
+/* loads and stores, alignment is not checked */
+inline Bytes memory(uint8_t opcode, uint32_t offset = 0) {
+	return op(opcode) + uleb(0) + uleb(offset);
+}
+
+inline Bytes call_indirect(uint32_t type) {
+	return op(bearwasm::INSTR_CALL_INDIRECT) + uleb(type) + uleb(0);
+}
+
+inline Bytes name(const Bytes &text) {
+	return uleb(text.size()) + text;
+}
+
+inline Bytes section(uint8_t id, uint32_t count, const Bytes &payload) {
+	auto body = uleb(count) + payload;
+	return static_cast<char>(id) + uleb(body.size()) + body;
+}
+
+struct Function {
+	uint32_t type;
+	/* every local on its own */
+	Bytes locals;
+	Bytes body;
+};
+
+struct ModuleBuilder {
+	/* params and results, one byte per value type */
+	std::vector<std::pair<Bytes, Bytes>> types;
+	/* module, name and the import description after the kind */
+	std::vector<std::pair<std::pair<Bytes, Bytes>, Bytes>> imports;
+	std::vector<Function> functions;
+	int memory = -1;
+	int table = -1;
+	int start = -1;
+	std::vector<std::pair<Bytes, uint32_t>> exports;
+	/* memory 0 is exported under this name if it is not empty */
+	Bytes memory_export;
+	std::vector<std::pair<uint32_t, std::vector<uint32_t>>> elements;
+	std::vector<std::pair<uint32_t, Bytes>> data;
+
+	uint32_t type(const Bytes &params, const Bytes &results) {
+		types.push_back({params, results});
+		return types.size() - 1;
+	}
+
+	/* exported under name if it has one */
+	uint32_t function(uint32_t type, const Bytes &locals,
+			const Bytes &body, const Bytes &export_name = "") {
+		uint32_t index = functions.size();
+		for (const auto &import : imports)
+			if (import.second[0] == 0)
+				index++;
+		functions.push_back({type, locals, body});
+		if (!export_name.empty())
+			exports.push_back({export_name, index});
+		return index;
+	}
+
+	Bytes build() const {
+		Bytes out("\0asm\1\0\0\0", 8);
+		Bytes payload;
+		for (const auto &type : types)
+			payload += "\x60" + name(type.first) + name(type.second);
+		out += section(1, types.size(), payload);
+
+		payload.clear();
+		for (const auto &import : imports)
+			payload += name(import.first.first)
+				+ name(import.first.second) + import.second;
+		if (!imports.empty())
+			out += section(2, imports.size(), payload);
+
+		payload.clear();
+		for (const auto &function : functions)
+			payload += uleb(function.type);
+		out += section(3, functions.size(), payload);
+
+		if (table >= 0)
+			out += section(4, 1, Bytes("\x70\0", 2) + uleb(table));
+		if (memory >= 0)
+			out += section(5, 1, Bytes(1, '\0') + uleb(memory));
+
+		payload.clear();
+		for (const auto &exported : exports)
+			payload += name(exported.first) + '\0'
+				+ uleb(exported.second);
+		if (!memory_export.empty())
+			payload += name(memory_export) + Bytes("\2\0", 2);
+		out += section(7, exports.size() + !memory_export.empty(),
+			payload);
+		/* holds only the index, where others have the count */
+		if (start >= 0)
+			out += section(8, start, "");
+
+		payload.clear();
+		for (const auto &element : elements) {
+			payload += Bytes(1, '\0') + i32_const(element.first)
+				+ op(bearwasm::INSTR_END)
+				+ uleb(element.second.size());
+			for (auto index : element.second)
+				payload += uleb(index);
+		}
+		if (!elements.empty())
+			out += section(9, elements.size(), payload);
+
+		payload.clear();
+		for (const auto &function : functions) {
+			auto code = uleb(function.locals.size());
+			for (auto local : function.locals)
+				code += uleb(1) + local;
+			code += function.body + op(bearwasm::INSTR_END);
+			payload += uleb(code.size()) + code;
+		}
+		out += section(10, functions.size(), payload);
+
+		payload.clear();
+		for (const auto &segment : data)
+			payload += Bytes(1, '\0') + i32_const(segment.first)
+				+ op(bearwasm::INSTR_END) + name(segment.second);
+		if (!data.empty())
+			out += section(11, data.size(), payload);
+		return out;
+	}
+};
+
+inline bearwasm::Module *decode(const Bytes &binary,
+		uint32_t translate_flags = 0) {
+	bearwasm::StreamingDecoder decoder{translate_flags};
+	decoder.feed(binary.data(), binary.size());
+	return decoder.finish();
+}
+
+/* runs export name of an initialized instance to its end */
+inline bearwasm::ExecutionStatus call(bearwasm::VirtualMachine &vm,
+		const char *name) {
+	auto index = vm.find_function(name);
+	if (index < 0)
+		return bearwasm::EXECUTION_TRAPPED;
+	vm.start_function(index);
+	return vm.resume(bearwasm::BUDGET_UNLIMITED);
+}
+
+/*
+ * Whether decoding and instantiating binary stops the process, the
+ * way the runtime refuses malformed modules. Runs in a child, setup
+ * may register imports before init().
+ */
+inline bool rejected(const Bytes &binary,
+		void (*setup)(bearwasm::VirtualMachine &vm) = nullptr) {
+	fflush(stdout);
+	fflush(stderr);
+	auto child = fork();
+	if (!child) {
+		bearwasm::VirtualMachine vm{decode(binary)};
+		if (setup)
+			setup(vm);
+		vm.init();
+		_exit(0);
+	}
+	int status;
+	if (waitpid(child, &status, 0) != child)
+		return false;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+} /* namespace wasm */
+
+#endif
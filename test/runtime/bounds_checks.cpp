@@ -0,0 +1,128 @@
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr int32_t FAR = 0x10000000;
+
+/* instructions of type in the translated code of function */
+static int count(Module *module, uint32_t function, uint32_t type) {
+	int n = 0;
+	for (const auto &inst : module->function_code[function].expression)
+		n += inst.type == type;
+	return n;
+}
+
+static bool traps(VirtualMachine &vm, const char *name) {
+	vm.reset();
+	return call(vm, name) == EXECUTION_TRAPPED
+		&& vm.get_trap() == TRAP_OUT_OF_BOUNDS;
+}
+
+/*
+ * Addresses that reach a load through the result of a block, either at
+ * its end or carried by a branch. Each function loads from FAR on the
+ * path it takes, so all of them have to keep their check.
+ */
+static void merges() {
+	ModuleBuilder m;
+	m.memory = 1;
+	auto get = m.type("", Bytes(1, I32));
+	/* always 0, but the analysis can not know */
+	auto zero = i32_const(0) + memory(I_32_LOAD);
+
+	m.function(get, Bytes(1, I32), zero + block(INSTR_IF, I32)
+		+ i32_const(0) + op(INSTR_ELSE) + i32_const(FAR)
+		+ op(INSTR_END) + memory(I_32_LOAD), "if_else");
+	m.function(get, Bytes(1, I32), block(INSTR_BLOCK, I32)
+		+ i32_const(FAR) + zero + op(I_32_EQZ) + op(BR_IF, 0)
+		+ op(INSTR_DROP) + i32_const(0) + op(INSTR_END)
+		+ memory(I_32_LOAD), "br_if");
+	m.function(get, "", block(INSTR_BLOCK, I32) + block(INSTR_BLOCK)
+		+ i32_const(FAR) + op(BR, 1) + op(INSTR_END)
+		+ i32_const(0) + op(INSTR_END) + memory(I_32_LOAD), "br");
+	/* the else arm of an if without result, below the stack top */
+	m.function(get, Bytes(1, I32), i32_const(0) + zero
+		+ block(INSTR_IF) + op(INSTR_DROP) + i32_const(0)
+		+ op(INSTR_ELSE) + op(INSTR_DROP) + i32_const(FAR)
+		+ op(INSTR_END) + memory(I_32_LOAD), "if_below");
+	/* a value under a loop that the loop changes through a local */
+	m.function(get, Bytes(2, I32), op(LOCAL_GET, 1)
+		+ block(INSTR_LOOP) + i32_const(FAR) + op(LOCAL_SET, 1)
+		+ zero + op(BR_IF, 0) + op(INSTR_END)
+		+ op(LOCAL_GET, 1) + op(I_32_ADD) + memory(I_32_LOAD), "loop");
+
+	auto module = decode(m.build(), TRANSLATE_BOUNDS_CHECKS);
+	module->retain();
+	VirtualMachine vm{module};
+	vm.init();
+	for (auto name : {"if_else", "br_if", "br", "if_below", "loop"})
+		CHECK(traps(vm, name));
+	for (uint32_t i = 0; i < 5; i++)
+		CHECK(count(module, i, I_32_LOAD) == 1);
+	module->release();
+}
+
+/*
+ * Loads at constant addresses lose their check. Those relative to a
+ * local the loop does not write run unchecked in a copy of the loop
+ * once a test before it passes, and checked otherwise.
+ */
+static void elided() {
+	ModuleBuilder m;
+	m.memory = 1;
+	auto none = m.type("", "");
+	auto get = m.type("", Bytes(1, I32));
+	auto sum = [] (const Bytes &address) {
+		return block(INSTR_LOOP) + op(LOCAL_GET, 1) + address
+			+ memory(I_32_LOAD, 64) + op(I_32_ADD)
+			+ op(LOCAL_SET, 1)
+			+ op(LOCAL_GET, 0) + i32_const(1) + op(I_32_ADD)
+			+ op(LOCAL_TEE, 0) + i32_const(16) + op(I_32_LT_U)
+			+ op(BR_IF, 0) + op(INSTR_END) + op(LOCAL_GET, 1);
+	};
+	auto index = op(LOCAL_GET, 0) + i32_const(4) + op(I_32_MUL);
+	auto statics = m.function(get, Bytes(2, I32), sum(index), "static");
+	/* the base comes from memory, nothing is known about it */
+	auto hoisted = m.function(get, Bytes(3, I32), i32_const(0)
+		+ memory(I_32_LOAD) + op(LOCAL_SET, 2)
+		+ sum(op(LOCAL_GET, 2) + index + op(I_32_ADD)), "hoisted");
+	m.function(none, "", i32_const(0) + i32_const(0)
+		+ memory(I_32_STORE), "start");
+	m.function(none, "", i32_const(0) + i32_const(0x10000 - 32 - 64)
+		+ memory(I_32_STORE), "end");
+	Bytes values;
+	for (int i = 1; i <= 16; i++)
+		values += Bytes(1, static_cast<char>(i)) + Bytes(3, '\0');
+	m.data.push_back({64, values});
+
+	auto module = decode(m.build(), TRANSLATE_BOUNDS_CHECKS);
+	module->retain();
+	VirtualMachine vm{module};
+	vm.init();
+	CHECK(count(module, statics, I_32_LOAD) == 0);
+	CHECK(count(module, statics, I_32_LOAD_UNCHECKED) == 1);
+	CHECK(count(module, hoisted, INSTR_MEMORY_FITS) == 1);
+	/* the copy that keeps its checks, the base is read from 0 */
+	CHECK(count(module, hoisted, I_32_LOAD) == 1);
+	CHECK(count(module, hoisted, I_32_LOAD_UNCHECKED) == 2);
+
+	/* the words at 64 and on hold 1 to 16 */
+	CHECK(call(vm, "static") == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == 136);
+	CHECK(call(vm, "start") == EXECUTION_FINISHED);
+	CHECK(call(vm, "hoisted") == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == 136);
+	/* the guard fails, the checked copy traps halfway */
+	CHECK(call(vm, "end") == EXECUTION_FINISHED);
+	CHECK(call(vm, "hoisted") == EXECUTION_TRAPPED);
+	CHECK(vm.get_trap() == TRAP_OUT_OF_BOUNDS);
+	module->release();
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	merges();
+	elided();
+	return failures;
+}
@@ -0,0 +1,194 @@
+#include <bearwasm/Checkpoint.h>
+#include <bearwasm/Util.h>
+#include <stddef.h>
+#include <string.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr uint64_t HASH = 0x1234;
+static constexpr int RESULT = 499500;
+
+class StringSink : public DataSink {
+public:
+	bool write(const char *buf, size_t size) override {
+		data.append(buf, size);
+		return true;
+	}
+
+	std::string data;
+};
+
+/* stores 0 to 999 one after another, then adds them up from memory */
+static Bytes sum_module() {
+	ModuleBuilder m;
+	m.memory = 1;
+	auto count_up = [] (const Bytes &body) {
+		return block(INSTR_LOOP) + body
+			+ op(LOCAL_GET, 0) + i32_const(1) + op(I_32_ADD)
+			+ op(LOCAL_TEE, 0) + i32_const(1000) + op(I_32_LT_S)
+			+ op(BR_IF, 0) + op(INSTR_END);
+	};
+	auto address = op(LOCAL_GET, 0) + i32_const(4) + op(I_32_MUL);
+	m.function(m.type("", Bytes(1, I32)), Bytes(2, I32),
+		count_up(address + op(LOCAL_GET, 0) + memory(I_32_STORE))
+		+ i32_const(0) + op(LOCAL_SET, 0)
+		+ count_up(op(LOCAL_GET, 1) + address + memory(I_32_LOAD)
+			+ op(I_32_ADD) + op(LOCAL_SET, 1))
+		+ op(LOCAL_GET, 1), "sum");
+	m.function(m.type("", Bytes(1, I32)), "", op(INSTR_CALL, 0)
+		+ i32_const(1) + op(I_32_ADD), "nested");
+	return m.build();
+}
+
+static bool save(VirtualMachine &vm, std::string &out) {
+	StringSink sink;
+	if (!Checkpoint::save(vm, HASH, &sink))
+		return false;
+	out = sink.data;
+	return true;
+}
+
+static bool restore(VirtualMachine &vm, const std::string &data,
+		uint64_t hash = HASH) {
+	MemoryStream stream{data.data(), data.size()};
+	return Checkpoint::restore(vm, hash, &stream);
+}
+
+/* every slice continues in a fresh instance restored from the last one */
+static void round_trip(Module *module) {
+	std::string data;
+	{
+		module->retain();
+		VirtualMachine vm{module};
+		vm.init();
+		vm.start_function(vm.find_function("sum"));
+		CHECK(vm.resume(1000) == EXECUTION_SUSPENDED);
+		CHECK(save(vm, data));
+	}
+
+	int slices = 1;
+	while (true) {
+		module->retain();
+		VirtualMachine vm{module};
+		vm.init();
+		if (!restore(vm, data)) {
+			CHECK(!"restore failed");
+			return;
+		}
+		auto status = vm.resume(1000);
+		if (status == EXECUTION_FINISHED) {
+			CHECK(vm.get_result() == RESULT);
+			break;
+		}
+		CHECK(status == EXECUTION_SUSPENDED);
+		CHECK(save(vm, data));
+		if (++slices > 1000) {
+			CHECK(!"never finished");
+			return;
+		}
+	}
+	/* both loops were cut at least once */
+	CHECK(slices > 20);
+}
+
+static void malformed(Module *module) {
+	std::string data;
+	module->retain();
+	VirtualMachine vm{module};
+	vm.init();
+	vm.start_function(vm.find_function("sum"));
+	CHECK(vm.resume(10000) == EXECUTION_SUSPENDED);
+	CHECK(save(vm, data));
+
+	module->retain();
+	VirtualMachine other{module};
+	other.init();
+	CHECK(!restore(other, data, HASH + 1));
+	CHECK(!restore(other, data.substr(0, data.size() - 1)));
+	CHECK(!restore(other, data.substr(0, sizeof(CheckpointHeader))));
+
+	auto header = data;
+	header[0] = 'X';
+	CHECK(!restore(other, header));
+
+	/* a failed restore leaves the instance as after reset() */
+	CHECK(call(other, "sum") == EXECUTION_FINISHED);
+	CHECK(other.get_result() == RESULT);
+
+	CHECK(restore(other, data));
+	CHECK(other.resume(BUDGET_UNLIMITED) == EXECUTION_FINISHED);
+	CHECK(other.get_result() == RESULT);
+}
+
+/* sizes of the entries after the header, as Checkpoint.cpp writes them */
+static constexpr size_t FRAME_SIZE = 16;
+static constexpr size_t LABEL_SIZE = 8;
+
+template<typename T>
+static std::string patch(std::string data, size_t offset, T value) {
+	memcpy(&data[offset], &value, sizeof(T));
+	return data;
+}
+
+/* pcs, labels and memory sizes that do not fit the module are refused */
+static void corrupted(Module *module) {
+	std::string data;
+	module->retain();
+	VirtualMachine vm{module};
+	vm.init();
+	vm.start_function(vm.find_function("nested"));
+	CHECK(vm.resume(10000) == EXECUTION_SUSPENDED);
+	CHECK(save(vm, data));
+
+	CheckpointHeader header;
+	memcpy(&header, data.data(), sizeof(header));
+	CHECK(header.callstack_size == 2);
+	CHECK(header.labelstack_size >= 1);
+	auto frames = sizeof(header) + 8 * (header.num_globals
+			+ header.stack_size);
+	auto labels = frames + FRAME_SIZE * header.callstack_size;
+	auto memories = labels + LABEL_SIZE * header.labelstack_size;
+
+	module->retain();
+	VirtualMachine other{module};
+	other.init();
+	CHECK(!restore(other, patch(data, offsetof(CheckpointHeader, pc),
+					1 << 20)));
+	CHECK(!restore(other, patch(data, offsetof(CheckpointHeader, pc),
+					-2)));
+	CHECK(!restore(other, patch(data, offsetof(CheckpointHeader,
+						callstack_size), 0)));
+	/* the frame of the call to sum: pc, then labelstack_size */
+	CHECK(!restore(other, patch(data, frames + FRAME_SIZE, 1 << 20)));
+	CHECK(!restore(other, patch(data, frames + FRAME_SIZE + 4,
+					header.labelstack_size + 1)));
+	CHECK(!restore(other, patch(data, frames + FRAME_SIZE + 4, -1)));
+	/* where a branch to the loop sum is in continues */
+	CHECK(!restore(other, patch(data, labels, 1 << 20)));
+	CHECK(!restore(other, patch(data, labels, -5)));
+	CHECK(!restore(other, patch(data, memories, 0x10001)));
+
+	CHECK(restore(other, data));
+	CHECK(other.resume(BUDGET_UNLIMITED) == EXECUTION_FINISHED);
+	CHECK(other.get_result() == RESULT + 1);
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	auto module = decode(sum_module());
+
+	module->retain();
+	{
+		VirtualMachine vm{module};
+		vm.init();
+		CHECK(call(vm, "sum") == EXECUTION_FINISHED);
+		CHECK(vm.get_result() == RESULT);
+	}
+	round_trip(module);
+	malformed(module);
+	corrupted(module);
+	module->release();
+	return failures;
+}
@@ -0,0 +1,127 @@
+#include <bearwasm/Executor.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+/* main with body and locals, returning an i32 */
+static Module *main_module(const Bytes &body, const Bytes &locals = "") {
+	ModuleBuilder m;
+	/* start() copies argv into it */
+	m.memory = 1;
+	m.function(m.type("", Bytes(1, I32)), locals, body, "main");
+	return decode(m.build());
+}
+
+static constexpr int NUM_WORKERS = 4;
+static constexpr int NUM_SHORT = 64;
+static constexpr int ROUNDS = 16;
+static Invocation short_invocations[NUM_SHORT];
+static uint32_t done_count[NUM_SHORT];
+
+static void count_done(Invocation *invocation) {
+	__atomic_fetch_add(&done_count[invocation - short_invocations], 1,
+			__ATOMIC_RELAXED);
+}
+
+/* counts a local down from iterations before returning */
+static Module *slow_module(int32_t iterations) {
+	return main_module(i32_const(iterations) + op(LOCAL_SET, 0)
+			+ block(INSTR_LOOP) + op(LOCAL_GET, 0) + i32_const(1)
+			+ op(I_32_SUB) + op(LOCAL_TEE, 0) + op(BR_IF, 0)
+			+ op(INSTR_END) + i32_const(-1), Bytes(1, I32));
+}
+
+/*
+ * Every worker is first held up by a slow invocation of its own, of
+ * different lengths, while the short ones pile up in the shared queue.
+ * Whoever is done first takes a batch of them into its deque, the
+ * others grab theirs and have to steal once the queue is empty. Every
+ * short invocation has to finish exactly once with its own result.
+ */
+static void many_short(char **argv) {
+	VirtualMachine *slow[NUM_WORKERS];
+	Invocation slow_invocations[NUM_WORKERS];
+	for (int i = 0; i < NUM_WORKERS; i++) {
+		slow[i] = new VirtualMachine{slow_module(20000 * (i + 1))};
+		slow[i]->init();
+		slow_invocations[i].vm = slow[i];
+		slow_invocations[i].argc = 1;
+		slow_invocations[i].argv = argv;
+		slow_invocations[i].done = nullptr;
+	}
+	VirtualMachine *vms[NUM_SHORT];
+	for (int i = 0; i < NUM_SHORT; i++) {
+		vms[i] = new VirtualMachine{main_module(i32_const(i))};
+		vms[i]->init();
+		short_invocations[i].vm = vms[i];
+		short_invocations[i].argc = 1;
+		short_invocations[i].argv = argv;
+		short_invocations[i].done = count_done;
+	}
+
+	{
+		Executor executor{NUM_WORKERS};
+		for (int round = 0; round < ROUNDS; round++) {
+			for (auto &invocation : slow_invocations)
+				executor.submit(&invocation);
+			for (int i = 0; i < NUM_SHORT; i++) {
+				short_invocations[i].status = EXECUTION_TRAPPED;
+				executor.submit(&short_invocations[i]);
+			}
+			executor.wait_idle();
+			for (const auto &invocation : slow_invocations)
+				CHECK(invocation.result == -1);
+			for (int i = 0; i < NUM_SHORT; i++) {
+				CHECK(short_invocations[i].status
+						== EXECUTION_FINISHED);
+				CHECK(short_invocations[i].result == i);
+				CHECK(__atomic_load_n(&done_count[i],
+						__ATOMIC_RELAXED)
+						== static_cast<uint32_t>(round + 1));
+			}
+		}
+	}
+
+	for (auto vm : slow)
+		delete vm;
+	for (auto vm : vms)
+		delete vm;
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+
+	static char name[] = "test";
+	static char *argv[] = {name};
+	VirtualMachine finishes{main_module(i32_const(42))};
+	VirtualMachine traps{main_module(op(INSTR_UNREACHABLE))};
+	VirtualMachine spins{main_module(block(INSTR_LOOP)
+			+ op(BR, 0) + op(INSTR_END) + i32_const(0))};
+	VirtualMachine *vms[] = {&finishes, &traps, &spins};
+	for (auto vm : vms)
+		vm->init();
+	spins.set_fuel(1000);
+
+	/* none of them takes the process down with it */
+	Invocation invocations[3];
+	{
+		Executor executor{2};
+		for (int i = 0; i < 3; i++) {
+			invocations[i].vm = vms[i];
+			invocations[i].argc = 1;
+			invocations[i].argv = argv;
+			invocations[i].done = nullptr;
+			executor.submit(&invocations[i]);
+		}
+		executor.wait_idle();
+	}
+	CHECK(invocations[0].status == EXECUTION_FINISHED);
+	CHECK(invocations[0].result == 42);
+	CHECK(invocations[1].status == EXECUTION_TRAPPED);
+	CHECK(traps.get_trap() == TRAP_UNREACHABLE);
+	CHECK(invocations[2].status == EXECUTION_OUT_OF_FUEL);
+
+	many_short(argv);
+	return failures;
+}
@@ -0,0 +1,119 @@
+#include <bearwasm/Inliner.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+/* indices of the functions calls() and the checks look at */
+struct Indices {
+	uint32_t twice, nested, recursive, early, outer_branch, large;
+	uint32_t inner_branch, fact, extra;
+};
+
+static Bytes calls_module(Indices &f) {
+	ModuleBuilder m;
+	auto get = m.type("", Bytes(1, I32));
+	auto unary = m.type(Bytes(1, I32), Bytes(1, I32));
+	auto binary = m.type(Bytes(2, I32), Bytes(1, I32));
+	auto arg = [] (uint32_t index) {
+		return op(LOCAL_GET, index);
+	};
+
+	/* its local starts out as 0 on every call, inlined or not */
+	auto accumulate = m.function(unary, Bytes(1, I32), arg(1) + arg(0)
+		+ op(I_32_ADD) + op(LOCAL_TEE, 1) + arg(1) + op(I_32_ADD));
+	auto square = m.function(unary, "", arg(0) + arg(0) + op(I_32_MUL));
+	auto sub = m.function(binary, "", arg(0) + arg(1) + op(I_32_SUB));
+	/* calls of its own, inlined one level further down */
+	auto mix = m.function(binary, "", arg(0) + op(INSTR_CALL, square)
+		+ arg(1) + op(INSTR_CALL, sub));
+	/* returns before its end */
+	auto early_return = m.function(unary, "", arg(0)
+		+ block(INSTR_IF) + i32_const(1) + op(INSTR_RETURN)
+		+ op(INSTR_END) + i32_const(2));
+	/* branches to its outermost label */
+	auto outer = m.function(unary, "", i32_const(3) + arg(0)
+		+ op(BR_IF, 0) + op(INSTR_DROP) + i32_const(4));
+	Bytes body = arg(0);
+	for (int i = 0; i < 10; i++)
+		body += i32_const(1) + op(I_32_ADD);
+	auto too_large = m.function(unary, "", body);
+	/* a block of its own that it branches out of */
+	auto inner = m.function(unary, "", block(INSTR_BLOCK, I32)
+		+ i32_const(5) + arg(0) + op(BR_IF, 0) + op(INSTR_DROP)
+		+ i32_const(6) + op(INSTR_END));
+	/* returns with one more value on the stack than its result */
+	auto extra_value = m.function(get, "", i32_const(1) + i32_const(2)
+		+ op(INSTR_RETURN));
+	f.fact = m.function(unary, "", arg(0) + i32_const(1) + op(I_32_GT_S)
+		+ block(INSTR_IF, I32) + arg(0) + arg(0) + i32_const(1)
+		+ op(I_32_SUB) + op(INSTR_CALL, m.functions.size())
+		+ op(I_32_MUL) + op(INSTR_ELSE) + i32_const(1)
+		+ op(INSTR_END));
+
+	f.twice = m.function(get, "", i32_const(1)
+		+ op(INSTR_CALL, accumulate) + i32_const(10)
+		+ op(INSTR_CALL, accumulate) + op(I_32_ADD), "twice");
+	f.nested = m.function(get, "", i32_const(7) + i32_const(9)
+		+ op(INSTR_CALL, mix), "nested");
+	f.recursive = m.function(get, "", i32_const(6)
+		+ op(INSTR_CALL, f.fact), "recursive");
+	f.early = m.function(get, "", i32_const(1)
+		+ op(INSTR_CALL, early_return) + i32_const(0)
+		+ op(INSTR_CALL, early_return) + op(I_32_ADD), "early");
+	f.outer_branch = m.function(get, "", i32_const(1)
+		+ op(INSTR_CALL, outer) + i32_const(0)
+		+ op(INSTR_CALL, outer) + op(I_32_ADD), "outer_branch");
+	f.large = m.function(get, "", i32_const(1)
+		+ op(INSTR_CALL, too_large), "large");
+	f.inner_branch = m.function(get, "", i32_const(1)
+		+ op(INSTR_CALL, inner) + i32_const(0)
+		+ op(INSTR_CALL, inner) + op(I_32_ADD), "inner_branch");
+	f.extra = m.function(get, "", i32_const(5)
+		+ op(INSTR_CALL, extra_value) + op(I_32_SUB), "extra");
+	return m.build();
+}
+
+static int calls(Module *module, uint32_t function) {
+	int count = 0;
+	for (const auto &inst : module->function_code[function].expression)
+		if (inst.type == INSTR_CALL)
+			count++;
+	return count;
+}
+
+static int32_t run(VirtualMachine &vm, const char *name) {
+	CHECK(call(vm, name) == EXECUTION_FINISHED);
+	return vm.get_result();
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	Indices f;
+	auto module = decode(calls_module(f));
+
+	/* what can be inlined was, the rest still is a call */
+	CHECK(!calls(module, f.twice));
+	CHECK(!calls(module, f.nested));
+	CHECK(!calls(module, f.inner_branch));
+	CHECK(calls(module, f.recursive) == 1);
+	CHECK(calls(module, f.fact) == 1);
+	CHECK(calls(module, f.early) == 2);
+	CHECK(calls(module, f.outer_branch) == 2);
+	CHECK(calls(module, f.large) == 1);
+	CHECK(calls(module, f.extra) == 1);
+
+	module->retain();
+	VirtualMachine vm{module};
+	vm.init();
+	CHECK(run(vm, "twice") == 2 + 20);
+	CHECK(run(vm, "nested") == 7 * 7 - 9);
+	CHECK(run(vm, "recursive") == 720);
+	CHECK(run(vm, "early") == 1 + 2);
+	CHECK(run(vm, "outer_branch") == 3 + 4);
+	CHECK(run(vm, "large") == 11);
+	CHECK(run(vm, "inner_branch") == 5 + 6);
+	CHECK(run(vm, "extra") == 5 - 2);
+	module->release();
+	return failures;
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr uint32_t CONTENTS = 0x01020304;
+
+/* a file of one page that starts with CONTENTS, or -1 */
+static int make_file() {
+	char path[] = "/tmp/bearwasm-mapped-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	char page[DIRTY_PAGE_SIZE] = {};
+	memcpy(page, &CONTENTS, sizeof(CONTENTS));
+	if (write(fd, page, sizeof(page)) != sizeof(page)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static uint32_t file_contents(int fd) {
+	uint32_t value = 0;
+	if (pread(fd, &value, sizeof(value), 0) != sizeof(value))
+		return 0;
+	return value;
+}
+
+/* the file goes read only at 0, writable at 0x2000 and read only
+ * with a second page past its end at 0x10000 */
+static Bytes mapping_module() {
+	ModuleBuilder m;
+	m.memory = 3;
+	m.memory_export = "memory";
+	auto none = m.type("", "");
+	auto get = m.type("", Bytes(1, I32));
+	m.function(get, "", i32_const(0) + memory(I_32_LOAD), "ro_load");
+	m.function(none, "", i32_const(0) + i32_const(1)
+		+ memory(I_32_STORE), "ro_store");
+	m.function(get, "", i32_const(0x2000) + memory(I_32_LOAD),
+		"rw_load");
+	m.function(none, "", i32_const(0x2000) + i32_const(99)
+		+ memory(I_32_STORE), "rw_store");
+	m.function(get, "", i32_const(0x10000) + memory(I_32_LOAD),
+		"head_load");
+	m.function(get, "", i32_const(0x11000) + memory(I_32_LOAD),
+		"tail_load");
+	return m.build();
+}
+
+/* loads from address 0 of the memory it imports as env.memory */
+static Bytes importing_module() {
+	ModuleBuilder m;
+	m.imports.push_back({{"env", "memory"}, Bytes("\2\0", 2) + uleb(1)});
+	m.memory_export = "memory";
+	auto get = m.type("", Bytes(1, I32));
+	m.function(get, "", i32_const(0) + memory(I_32_LOAD), "load");
+	return m.build();
+}
+
+static uint32_t load(VirtualMachine &vm, const char *name) {
+	CHECK(call(vm, name) == EXECUTION_FINISHED);
+	return vm.get_result();
+}
+
+static bool traps(VirtualMachine &vm, const char *name) {
+	return call(vm, name) == EXECUTION_TRAPPED
+		&& vm.get_trap() == TRAP_OUT_OF_BOUNDS;
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	int fd = make_file();
+	CHECK(fd >= 0);
+	auto image = bearwasm_open_image(fd);
+	CHECK(image);
+
+	VirtualMachine vm{decode(mapping_module())};
+	CHECK(vm.init() == EXECUTION_FINISHED);
+	CHECK(!vm.get_memory("missing"));
+	auto mem = vm.get_memory("memory");
+	CHECK(mem);
+	CHECK(mem->map_range(0, DIRTY_PAGE_SIZE, image, 0, false));
+	CHECK(mem->map_range(0x2000, DIRTY_PAGE_SIZE, image, 0, true));
+	CHECK(mem->map_range(0x10000, 2 * DIRTY_PAGE_SIZE, image, 0, false));
+	/* neither unaligned nor outside of memory */
+	CHECK(!mem->map_range(0x100, DIRTY_PAGE_SIZE, image, 0, false));
+	CHECK(!mem->map_range(0x30000, DIRTY_PAGE_SIZE, image, 0, false));
+
+	/* writes to a read only mapping trap, host functions can not
+	 * get around it either */
+	CHECK(load(vm, "ro_load") == CONTENTS);
+	CHECK(traps(vm, "ro_store"));
+	CHECK(!mem->writable_view(0, 4));
+	vm.reset();
+	CHECK(load(vm, "ro_load") == CONTENTS);
+
+	/* the page past the end of the file raises SIGBUS */
+	CHECK(load(vm, "head_load") == CONTENTS);
+	CHECK(traps(vm, "tail_load"));
+	vm.reset();
+
+	/* writable mappings are private, reset() brings the file back */
+	CHECK(call(vm, "rw_store") == EXECUTION_FINISHED);
+	CHECK(load(vm, "rw_load") == 99);
+	CHECK(file_contents(fd) == CONTENTS);
+	CHECK(vm.reset() == EXECUTION_FINISHED);
+	CHECK(load(vm, "rw_load") == CONTENTS);
+	CHECK(load(vm, "ro_load") == CONTENTS);
+
+	/* another instance sees the mapped file through the import */
+	VirtualMachine shared{decode(importing_module())};
+	shared.register_memory("env", "memory", *mem);
+	CHECK(shared.init() == EXECUTION_FINISHED);
+	CHECK(load(shared, "load") == CONTENTS);
+	/* borrowed memory is not the importer's to map into */
+	auto imported = shared.get_memory("memory");
+	CHECK(imported && imported->data() == mem->data());
+	CHECK(imported && !imported->map_range(0x1000, DIRTY_PAGE_SIZE,
+				image, 0, false));
+
+	/* memory that belongs to the embedder */
+	auto base = static_cast<char*>(aligned_alloc(PAGE_SIZE, PAGE_SIZE));
+	memset(base, 0, PAGE_SIZE);
+	uint32_t value = 42;
+	memcpy(base, &value, sizeof(value));
+	VirtualMachine borrowed{decode(importing_module())};
+	borrowed.register_memory("env", "memory", base, 1);
+	CHECK(borrowed.init() == EXECUTION_FINISHED);
+	CHECK(load(borrowed, "load") == 42);
+	CHECK(borrowed.get_memory("memory")->data() == base);
+	value = 43;
+	memcpy(base, &value, sizeof(value));
+	CHECK(borrowed.reset() == EXECUTION_FINISHED);
+	CHECK(load(borrowed, "load") == 43);
+
+	close(fd);
+	return failures;
+}
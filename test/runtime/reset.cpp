@@ -0,0 +1,73 @@
+#include "Test.h"
+#include <bearwasm/InstancePool.h>
+
+using namespace bearwasm;
+using namespace wasm;
+
+/* the start function counts how often it ran on the same memory */
+static Bytes counter_module() {
+	ModuleBuilder m;
+	m.memory = 2;
+	auto none = m.type("", "");
+	auto get = m.type("", Bytes(1, I32));
+	auto add = [] (int32_t value) {
+		return i32_const(0) + i32_const(0) + memory(I_32_LOAD)
+			+ i32_const(value) + op(I_32_ADD) + memory(I_32_STORE);
+	};
+	m.start = m.function(none, "", add(1));
+	m.function(none, "", add(10) + i32_const(70000) + i32_const(1)
+		+ memory(I_32_STORE), "bump");
+	m.function(get, "", i32_const(0) + memory(I_32_LOAD), "count");
+	m.function(get, "", i32_const(70000) + memory(I_32_LOAD), "far");
+	m.data.push_back({70000, Bytes("\7\0\0\0", 4)});
+	return m.build();
+}
+
+/* start writes to memory, then traps */
+static Bytes trapping_start_module() {
+	ModuleBuilder m;
+	m.memory = 1;
+	auto none = m.type("", "");
+	m.start = m.function(none, "", i32_const(0) + i32_const(7)
+		+ memory(I_32_STORE) + op(INSTR_UNREACHABLE));
+	return m.build();
+}
+
+static int32_t run(VirtualMachine &vm, const char *name) {
+	CHECK(call(vm, name) == EXECUTION_FINISHED);
+	return vm.get_result();
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	VirtualMachine vm{decode(counter_module())};
+	CHECK(vm.init() == EXECUTION_FINISHED);
+	CHECK(run(vm, "count") == 1);
+	CHECK(run(vm, "far") == 7);
+
+	/* reset() must undo what start wrote before running it again */
+	vm.reset();
+	CHECK(run(vm, "count") == 1);
+	vm.reset();
+	vm.reset();
+	CHECK(run(vm, "count") == 1);
+
+	CHECK(call(vm, "bump") == EXECUTION_FINISHED);
+	CHECK(run(vm, "count") == 11);
+	CHECK(run(vm, "far") == 1);
+	vm.reset();
+	CHECK(run(vm, "count") == 1);
+	CHECK(run(vm, "far") == 7);
+
+	/* a start that traps leaves an instance nobody may use */
+	VirtualMachine broken{decode(trapping_start_module())};
+	CHECK(broken.init() == EXECUTION_TRAPPED);
+	CHECK(broken.get_trap() == TRAP_UNREACHABLE);
+	CHECK(broken.reset() == EXECUTION_TRAPPED);
+	CHECK(broken.get_trap() == TRAP_UNREACHABLE);
+
+	InstancePool pool{decode(trapping_start_module()), nullptr, 4};
+	pool.prefill(4);
+	CHECK(pool.acquire() == nullptr);
+	return failures;
+}
@@ -0,0 +1,209 @@
+#include <bearwasm/IoRing.h>
+#include <bearwasm/Scheduler.h>
+#include <bearwasm/Wasi.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr int THREADS = 16;
+static constexpr int WAITS = 10;
+
+static Module *main_module(ModuleBuilder &m, const Bytes &locals,
+		const Bytes &body) {
+	/* start() copies argv into it */
+	m.memory = 1;
+	m.function(m.type("", Bytes(1, I32)), locals, body, "main");
+	return decode(m.build());
+}
+
+/* adds up what wait returns, WAITS times */
+static Module *waiting_module() {
+	ModuleBuilder m;
+	m.imports.push_back({{"env", "wait"},
+			Bytes(1, '\0') + uleb(m.type("", Bytes(1, I32)))});
+	return main_module(m, Bytes(2, I32), block(INSTR_LOOP)
+		+ op(LOCAL_GET, 1) + op(INSTR_CALL, 0) + op(I_32_ADD)
+		+ op(LOCAL_SET, 1)
+		+ op(LOCAL_GET, 0) + i32_const(1) + op(I_32_ADD)
+		+ op(LOCAL_TEE, 0) + i32_const(WAITS) + op(I_32_LT_S)
+		+ op(BR_IF, 0) + op(INSTR_END) + op(LOCAL_GET, 1));
+}
+
+/* calls that wait was blocked in, finished by another thread */
+static InterpreterState *blocked_calls[THREADS];
+static int num_blocked;
+static bool calls_locked;
+
+static void lock_calls() {
+	while (__atomic_test_and_set(&calls_locked, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void unlock_calls() {
+	__atomic_clear(&calls_locked, __ATOMIC_RELEASE);
+}
+
+static int32_t wait_native(InterpreterState *state) {
+	block_call(state);
+	lock_calls();
+	blocked_calls[num_blocked++] = state;
+	unlock_calls();
+	return -1;
+}
+
+static bool finishing;
+
+static void *finisher(void *) {
+	while (__atomic_load_n(&finishing, __ATOMIC_ACQUIRE)) {
+		InterpreterState *calls[THREADS];
+		lock_calls();
+		int count = num_blocked;
+		for (int i = 0; i < count; i++)
+			calls[i] = blocked_calls[i];
+		num_blocked = 0;
+		unlock_calls();
+		for (int i = 0; i < count; i++)
+			finish_call(calls[i], static_cast<int32_t>(3));
+		usleep(100);
+	}
+	return nullptr;
+}
+
+static int finished;
+
+static void count_done(GreenThread *thread) {
+	if (thread->status == EXECUTION_FINISHED)
+		__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+}
+
+/* blocked threads are parked, not done, and run on once finished */
+static void blocking() {
+	Module *module = waiting_module();
+	VirtualMachine *vms[THREADS];
+	GreenThread threads[THREADS];
+	for (int i = 0; i < THREADS; i++) {
+		module->retain();
+		vms[i] = new VirtualMachine{module};
+		vms[i]->register_function("wait", wait_native);
+		vms[i]->init();
+		threads[i].vm = vms[i];
+		threads[i].argc = 0;
+		threads[i].argv = nullptr;
+		threads[i].done = count_done;
+	}
+	module->release();
+
+	finishing = true;
+	pthread_t thread;
+	pthread_create(&thread, nullptr, finisher, nullptr);
+	{
+		Executor executor{4};
+		Scheduler scheduler{&executor};
+		for (auto &green : threads)
+			scheduler.spawn(&green);
+		scheduler.wait_idle();
+	}
+	__atomic_store_n(&finishing, false, __ATOMIC_RELEASE);
+	pthread_join(thread, nullptr);
+
+	CHECK(finished == THREADS);
+	for (auto &green : threads) {
+		CHECK(green.status == EXECUTION_FINISHED);
+		CHECK(green.result == 3 * WAITS);
+		CHECK(green.slices > WAITS);
+	}
+	for (auto vm : vms)
+		delete vm;
+}
+
+/* reads one byte from stdin and returns it */
+static Module *reading_module() {
+	ModuleBuilder m;
+	m.imports.push_back({{"wasi_snapshot_preview1", "fd_read"},
+			Bytes(1, '\0') + uleb(m.type(Bytes(4, I32),
+						Bytes(1, I32)))});
+	/* the iovec at 16 points at 64, the count goes to 32 */
+	return main_module(m, "", i32_const(16) + i32_const(64)
+		+ memory(I_32_STORE)
+		+ i32_const(20) + i32_const(1) + memory(I_32_STORE)
+		+ i32_const(0) + i32_const(16) + i32_const(1) + i32_const(32)
+		+ op(INSTR_CALL, 0) + op(INSTR_DROP)
+		+ i32_const(64) + memory(I_32_LOAD_8_U));
+}
+
+static int pipe_in;
+
+static void *writer(void *) {
+	for (int i = 1; i <= THREADS; i++) {
+		usleep(1000);
+		char byte = i;
+		CHECK(write(pipe_in, &byte, 1) == 1);
+	}
+	return nullptr;
+}
+
+/* WASI reads through the ring wait for a writer that comes later */
+static void ring_io() {
+	IoRing ring;
+	if (!ring.valid()) {
+		fprintf(stderr, "no io_uring, skipping ring_io\n");
+		return;
+	}
+	int fds[2];
+	CHECK(!pipe(fds));
+	CHECK(dup2(fds[0], 0) == 0);
+	pipe_in = fds[1];
+
+	Module *module = reading_module();
+	VirtualMachine *vms[THREADS];
+	WasiContext *contexts[THREADS];
+	GreenThread threads[THREADS];
+	for (int i = 0; i < THREADS; i++) {
+		module->retain();
+		vms[i] = new VirtualMachine{module};
+		contexts[i] = new WasiContext{{}, {}};
+		contexts[i]->set_ring(&ring);
+		contexts[i]->attach(*vms[i]);
+		vms[i]->init();
+		threads[i].vm = vms[i];
+		threads[i].argc = 0;
+		threads[i].argv = nullptr;
+		threads[i].done = nullptr;
+	}
+	module->release();
+
+	pthread_t thread;
+	pthread_create(&thread, nullptr, writer, nullptr);
+	{
+		Executor executor{4};
+		IoWorker worker{&ring};
+		Scheduler scheduler{&executor};
+		for (auto &green : threads)
+			scheduler.spawn(&green);
+		scheduler.wait_idle();
+	}
+	pthread_join(thread, nullptr);
+
+	int sum = 0;
+	for (auto &green : threads) {
+		CHECK(green.status == EXECUTION_FINISHED);
+		sum += green.result;
+	}
+	CHECK(sum == THREADS * (THREADS + 1) / 2);
+	CHECK(!ring.in_flight());
+	for (int i = 0; i < THREADS; i++) {
+		delete vms[i];
+		delete contexts[i];
+	}
+	close(fds[1]);
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	blocking();
+	ring_io();
+	return failures;
+}
@@ -0,0 +1,98 @@
+#include <string>
+#include <bearwasm/ModuleCache.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr int NUM_FUNCTIONS = 150;
+
+class StringSink : public DataSink {
+public:
+	bool write(const char *buf, size_t size) override {
+		data.append(buf, size);
+		return true;
+	}
+
+	std::string data;
+};
+
+static int32_t add(int32_t a, int32_t b) {
+	return a + b;
+}
+
+/*
+ * Every kind of section, with sections, bodies, constants and segments
+ * long enough that their lengths take more than one byte.
+ */
+static Bytes large_module() {
+	ModuleBuilder m;
+	m.memory = 1;
+	m.table = 4;
+	auto none = m.type("", "");
+	auto get = m.type("", Bytes(1, I32));
+	auto take = m.type(Bytes(2, I32), Bytes(1, I32));
+	m.imports.push_back({{"env", "add"}, Bytes(1, '\0') + uleb(take)});
+	for (int i = 0; i < NUM_FUNCTIONS; i++)
+		m.function(get, "", i32_const(i * 1000),
+			"f" + std::to_string(i));
+	m.function(get, "", i32_const(0x100 + 200) + memory(I_32_LOAD_8_U),
+		"data");
+	m.function(get, "", i32_const(0x10) + memory(I_32_LOAD), "started");
+	m.function(get, "", i32_const(3) + i32_const(4)
+		+ op(INSTR_CALL, 0), "add");
+	m.function(get, "", i32_const(2) + call_indirect(get), "indirect");
+	m.start = m.function(none, Bytes(1, I32), i32_const(0x10)
+		+ i32_const(77) + memory(I_32_STORE));
+	m.elements.push_back({0, {1, 2, 3}});
+	Bytes segment;
+	for (int i = 0; i < 300; i++)
+		segment += static_cast<char>(i);
+	m.data.push_back({0x100, segment});
+	return m.build();
+}
+
+static Module *decode_in_chunks(const Bytes &binary, size_t chunk) {
+	StreamingDecoder decoder;
+	for (size_t offset = 0; offset < binary.size(); offset += chunk)
+		decoder.feed(binary.data() + offset,
+				std::min(chunk, binary.size() - offset));
+	return decoder.finish();
+}
+
+/* everything the decoder produced, in the form the cache stores it */
+static std::string serialize(Module *module) {
+	StringSink sink;
+	CHECK(ModuleCache::write(*module, 0, &sink));
+	return sink.data;
+}
+
+static int32_t run(VirtualMachine &vm, const char *name) {
+	CHECK(call(vm, name) == EXECUTION_FINISHED);
+	return vm.get_result();
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	auto binary = large_module();
+	auto whole = decode(binary);
+	auto expected = serialize(whole);
+	whole->release();
+
+	/* chunk boundaries fall inside headers, varuints and bodies */
+	for (size_t chunk : {1, 3, 7}) {
+		auto module = decode_in_chunks(binary, chunk);
+		CHECK(serialize(module) == expected);
+
+		VirtualMachine vm{module};
+		vm.register_function("add", add);
+		CHECK(vm.init() == EXECUTION_FINISHED);
+		CHECK(run(vm, "f0") == 0);
+		CHECK(run(vm, "f149") == 149000);
+		CHECK(run(vm, "data") == 200);
+		CHECK(run(vm, "started") == 77);
+		CHECK(run(vm, "add") == 7);
+		CHECK(run(vm, "indirect") == 2000);
+	}
+	return failures;
+}
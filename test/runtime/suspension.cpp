@@ -0,0 +1,108 @@
+#include <bearwasm/Epoch.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr int COUNT = 10000;
+
+/* count adds up 0 to COUNT - 1, spin never ends */
+static Bytes loops_module() {
+	ModuleBuilder m;
+	auto get = m.type("", Bytes(1, I32));
+	m.function(get, Bytes(2, I32), block(INSTR_LOOP)
+		+ op(LOCAL_GET, 1) + op(LOCAL_GET, 0) + op(I_32_ADD)
+		+ op(LOCAL_SET, 1)
+		+ op(LOCAL_GET, 0) + i32_const(1) + op(I_32_ADD)
+		+ op(LOCAL_TEE, 0) + i32_const(COUNT) + op(I_32_LT_S)
+		+ op(BR_IF, 0) + op(INSTR_END) + op(LOCAL_GET, 1), "count");
+	m.function(get, "", block(INSTR_LOOP) + op(BR, 0) + op(INSTR_END)
+		+ i32_const(0), "spin");
+	/* no loop and no call, so no deadline is looked at */
+	Bytes body = i32_const(0);
+	for (int i = 0; i < 100; i++)
+		body += i32_const(1) + op(I_32_ADD);
+	m.function(get, "", body, "straight");
+	return m.build();
+}
+
+static constexpr int32_t SUM = COUNT * (COUNT - 1) / 2;
+
+/* a budget only ends the slice, the next resume() goes on from there */
+static void budget(VirtualMachine &vm) {
+	vm.reset();
+	vm.start_function(vm.find_function("count"));
+	int slices = 1;
+	ExecutionStatus status;
+	while ((status = vm.resume(1000)) == EXECUTION_SUSPENDED)
+		slices++;
+	CHECK(status == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == SUM);
+	CHECK(slices > 10);
+}
+
+/* fuel lasts across resumes, the instance goes on once there is more */
+static void fuel(VirtualMachine &vm) {
+	vm.reset();
+	vm.set_fuel(1000);
+	vm.start_function(vm.find_function("count"));
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_OUT_OF_FUEL);
+	CHECK(vm.get_fuel() == 0);
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_OUT_OF_FUEL);
+	vm.set_fuel(1000000);
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == SUM);
+	auto left = vm.get_fuel();
+	CHECK(left > 0 && left < 1000000);
+
+	/* a budget smaller than the fuel left suspends instead */
+	vm.reset();
+	vm.set_fuel(5000);
+	vm.start_function(vm.find_function("count"));
+	CHECK(vm.resume(1000) == EXECUTION_SUSPENDED);
+	CHECK(vm.get_fuel() <= 4000);
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_OUT_OF_FUEL);
+
+	/* reset() takes the limit away */
+	vm.reset();
+	CHECK(call(vm, "count") == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == SUM);
+}
+
+/* a passed deadline interrupts at the next loop, a new one resumes */
+static void epoch(VirtualMachine &vm) {
+	vm.reset();
+	vm.set_epoch_deadline(1);
+	vm.start_function(vm.find_function("count"));
+	increment_epoch();
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_INTERRUPTED);
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_INTERRUPTED);
+	vm.set_epoch_deadline(EPOCH_NEVER);
+	CHECK(vm.resume(BUDGET_UNLIMITED) == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == SUM);
+
+	vm.reset();
+	vm.set_epoch_deadline(0);
+	CHECK(call(vm, "straight") == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == 100);
+
+	/* the timer ends what would run forever */
+	vm.reset();
+	{
+		EpochTimer timer{1000};
+		vm.set_epoch_deadline(10);
+		CHECK(call(vm, "spin") == EXECUTION_INTERRUPTED);
+	}
+	vm.reset();
+	CHECK(call(vm, "count") == EXECUTION_FINISHED);
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	VirtualMachine vm{decode(loops_module())};
+	vm.init();
+	budget(vm);
+	fuel(vm);
+	epoch(vm);
+	return failures;
+}
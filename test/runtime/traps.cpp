@@ -0,0 +1,136 @@
+#include <signal.h>
+#include <stdint.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static Bytes arithmetic_module() {
+	ModuleBuilder m;
+	auto get = m.type("", Bytes(1, I32));
+	auto binary = [&] (const Bytes &a, const Bytes &b, uint8_t opcode,
+			const char *name) {
+		m.function(get, "", a + b + op(opcode), name);
+	};
+	binary(i32_const(7), i32_const(0), I_32_DIV_S, "div_zero");
+	binary(i32_const(INT32_MIN), i32_const(-1), I_32_DIV_S, "div_overflow");
+	binary(i32_const(-7), i32_const(2), I_32_DIV_S, "div");
+	binary(i32_const(7), i32_const(0), I_32_REM_S, "rem_zero");
+	binary(i32_const(INT32_MIN), i32_const(-1), I_32_REM_S, "rem_min");
+	binary(i32_const(-7), i32_const(2), I_32_REM_S, "rem");
+	/* the low half is what get_result() sees */
+	m.function(get, "", i64_const(7) + i64_const(0) + op(I_64_DIV_U)
+		+ op(INSTR_DROP) + i32_const(0), "div_u64_zero");
+	return m.build();
+}
+
+static Bytes fault_module() {
+	ModuleBuilder m;
+	m.memory = 1;
+	auto get = m.type("", Bytes(1, I32));
+	m.function(get, "", op(INSTR_UNREACHABLE), "unreachable");
+	m.function(get, "", i32_const(0x10000 - 2) + memory(I_32_LOAD),
+		"load");
+	m.function(get, "", i32_const(-1) + memory(I_32_LOAD, 8), "wrap");
+	m.function(get, "", op(INSTR_CALL, 3), "recurse");
+	m.function(get, "", i32_const(5), "fine");
+	return m.build();
+}
+
+static int32_t crash() {
+	return *static_cast<volatile int32_t*>(nullptr);
+}
+
+/* a host function that crashes after the instance trapped before */
+static bool crash_is_trapped() {
+	ModuleBuilder m;
+	auto get = m.type("", Bytes(1, I32));
+	m.imports.push_back({{"env", "crash"}, Bytes(1, '\0') + uleb(get)});
+	m.function(get, "", op(INSTR_UNREACHABLE), "unreachable");
+	m.function(get, "", op(INSTR_CALL, 0), "crash");
+	auto binary = m.build();
+
+	fflush(stdout);
+	fflush(stderr);
+	auto child = fork();
+	if (!child) {
+		VirtualMachine vm{decode(binary)};
+		vm.register_function("crash", crash);
+		vm.init();
+		call(vm, "unreachable");
+		_exit(call(vm, "crash") == EXECUTION_TRAPPED ? 0 : 1);
+	}
+	int status;
+	if (waitpid(child, &status, 0) != child)
+		return true;
+	return !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV;
+}
+
+/* calls through slot 0 to 3 of a table with 2 slots, 1 is empty */
+static Bytes indirect_module() {
+	ModuleBuilder m;
+	m.table = 2;
+	auto get = m.type("", Bytes(1, I32));
+	/* the same as get, declared again */
+	auto same = m.type("", Bytes(1, I32));
+	auto take = m.type(Bytes(1, I32), Bytes(1, I32));
+	auto target = m.function(get, "", i32_const(9));
+	m.elements.push_back({0, {target}});
+	m.function(get, "", i32_const(0) + call_indirect(get), "indirect");
+	m.function(get, "", i32_const(0) + call_indirect(same),
+		"indirect_same");
+	m.function(get, "", i32_const(1) + i32_const(0) + call_indirect(take),
+		"indirect_mismatch");
+	m.function(get, "", i32_const(1) + call_indirect(get),
+		"indirect_empty");
+	m.function(get, "", i32_const(3) + call_indirect(get),
+		"indirect_outside");
+	return m.build();
+}
+
+static void expect(VirtualMachine &vm, const char *name, TrapKind trap) {
+	vm.reset();
+	CHECK(call(vm, name) == EXECUTION_TRAPPED);
+	CHECK(vm.get_trap() == trap);
+}
+
+static void expect(VirtualMachine &vm, const char *name, int32_t result) {
+	vm.reset();
+	CHECK(call(vm, name) == EXECUTION_FINISHED);
+	CHECK(vm.get_result() == result);
+}
+
+int main() {
+	/* checked by the interpreter, no SIGFPE is involved */
+	VirtualMachine arithmetic{decode(arithmetic_module())};
+	arithmetic.init();
+	expect(arithmetic, "div_zero", TRAP_DIVIDE_BY_ZERO);
+	expect(arithmetic, "div_overflow", TRAP_INTEGER_OVERFLOW);
+	expect(arithmetic, "div", -3);
+	expect(arithmetic, "rem_zero", TRAP_DIVIDE_BY_ZERO);
+	expect(arithmetic, "rem_min", 0);
+	expect(arithmetic, "rem", -1);
+	expect(arithmetic, "div_u64_zero", TRAP_DIVIDE_BY_ZERO);
+
+	VirtualMachine indirect{decode(indirect_module())};
+	indirect.init();
+	expect(indirect, "indirect", 9);
+	expect(indirect, "indirect_same", 9);
+	expect(indirect, "indirect_mismatch", TRAP_INDIRECT_CALL_MISMATCH);
+	expect(indirect, "indirect_empty", TRAP_UNINITIALIZED_ELEMENT);
+	expect(indirect, "indirect_outside", TRAP_UNDEFINED_ELEMENT);
+
+	bearwasm_install_fault_handlers();
+	VirtualMachine faults{decode(fault_module())};
+	faults.init();
+	expect(faults, "unreachable", TRAP_UNREACHABLE);
+	expect(faults, "load", TRAP_OUT_OF_BOUNDS);
+	expect(faults, "wrap", TRAP_OUT_OF_BOUNDS);
+	expect(faults, "recurse", TRAP_STACK_OVERFLOW);
+	/* an instance that trapped is usable again after reset() */
+	expect(faults, "fine", 5);
+
+	/* faults outside of the instance are crashes, not traps */
+	CHECK(!crash_is_trapped());
+	return failures;
+}
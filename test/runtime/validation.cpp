@@ -0,0 +1,104 @@
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+/* a module with one function taking an i32, with body and one local */
+static Bytes with_body(const Bytes &body, int start = -1) {
+	ModuleBuilder m;
+	m.function(m.type(Bytes(1, I32), ""), Bytes(1, I32), body, "f");
+	m.start = start;
+	return m.build();
+}
+
+/* one function without parameters whose locals come in runs of counts */
+static Bytes with_locals(const std::vector<uint32_t> &counts) {
+	Bytes body = uleb(counts.size());
+	for (auto count : counts)
+		body += uleb(count) + Bytes(1, I32);
+	body += op(INSTR_END);
+	return Bytes("\0asm\1\0\0\0", 8)
+		+ section(1, 1, "\x60" + name("") + name(""))
+		+ section(3, 1, uleb(0)) + section(10, 1, name(body));
+}
+
+/* imports env.add as (i32, i32) -> i32 and calls it */
+static Bytes with_import() {
+	ModuleBuilder m;
+	auto add = m.type(Bytes(2, I32), Bytes(1, I32));
+	m.imports.push_back({{"env", "add"}, Bytes(1, '\0') + uleb(add)});
+	m.function(add, "", op(LOCAL_GET, 0) + op(LOCAL_GET, 1)
+		+ op(INSTR_CALL, 0), "f");
+	return m.build();
+}
+
+static int32_t add(int32_t a, int32_t b) {
+	return a + b;
+}
+
+static int32_t add_with_state(InterpreterState *, int32_t a, int32_t b) {
+	return a + b;
+}
+
+static int64_t add_wide(int32_t a, int32_t b) {
+	return a + b;
+}
+
+static int32_t add_one(int32_t a) {
+	return a + 1;
+}
+
+static void add_nothing(int32_t, int32_t) {
+}
+
+static int32_t add_64(int64_t a, int32_t b) {
+	return a + b;
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+
+	/* the parameter and the local */
+	CHECK(!rejected(with_body(op(LOCAL_GET, 0) + op(LOCAL_SET, 1))));
+	CHECK(rejected(with_body(op(LOCAL_GET, 2) + op(INSTR_DROP))));
+	CHECK(rejected(with_body(i32_const(1) + op(LOCAL_SET, 2))));
+	CHECK(rejected(with_body(i32_const(1) + op(LOCAL_TEE, 1000)
+				+ op(INSTR_DROP))));
+
+	CHECK(rejected(with_body(op(GLOBAL_GET, 0) + op(INSTR_DROP))));
+	CHECK(rejected(with_body(i32_const(1) + op(GLOBAL_SET, 0))));
+
+	CHECK(!rejected(with_body(i32_const(1) + op(INSTR_CALL, 0))));
+	CHECK(rejected(with_body(i32_const(1) + op(INSTR_CALL, 1))));
+	CHECK(rejected(with_body(i32_const(1) + call_indirect(1))));
+
+	CHECK(rejected(with_body("", 1)));
+
+	/* the total is capped, a sum that wraps does not get around it */
+	CHECK(!rejected(with_locals({MAX_LOCALS - 1, 1})));
+	CHECK(rejected(with_locals({MAX_LOCALS, 1})));
+	CHECK(rejected(with_locals({0xffffffff})));
+	CHECK(rejected(with_locals({1, 0xffffffff})));
+
+	/* host functions have to match the type of their import */
+	CHECK(!rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add);
+	}));
+	CHECK(!rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add_with_state);
+	}));
+	CHECK(rejected(with_import()));
+	CHECK(rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add_wide);
+	}));
+	CHECK(rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add_one);
+	}));
+	CHECK(rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add_nothing);
+	}));
+	CHECK(rejected(with_import(), [] (VirtualMachine &vm) {
+		vm.register_function("add", add_64);
+	}));
+	return failures;
+}
@@ -0,0 +1,177 @@
+#include <bearwasm/Wasi.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "Test.h"
+
+using namespace bearwasm;
+using namespace wasm;
+
+static constexpr int32_t WASI_ESUCCESS = 0;
+static constexpr int32_t WASI_ELOOP = 32;
+static constexpr int32_t WASI_ENOTDIR = 54;
+static constexpr int32_t WASI_ENOTCAPABLE = 76;
+static constexpr int64_t RIGHT_FD_READ = 1 << 1;
+/* the first preopened directory */
+static constexpr int32_t DIR_FD = 3;
+/* where the paths of open_paths() go */
+static constexpr uint32_t PATHS = 1024;
+/* the iovecs of write_N, one byte at N */
+static constexpr uint32_t IOVS = 256;
+
+static const char *paths[] = {
+	"inside",
+	"sub/file",
+	/* a symlink to the directory above */
+	"up/outside",
+	/* a symlink to a file outside */
+	"escape",
+	/* a symlink to sub, which stays inside */
+	"down/file",
+	"../outside",
+	"/etc/passwd",
+};
+static constexpr int NUM_PATHS = sizeof(paths) / sizeof(paths[0]);
+
+/* open_N opens paths[N] below DIR_FD and returns the errno */
+static Bytes open_paths() {
+	ModuleBuilder m;
+	auto i64 = Bytes(1, I64);
+	m.imports.push_back({{"wasi_snapshot_preview1", "path_open"},
+			Bytes(1, '\0') + uleb(m.type(Bytes(5, I32) + i64 + i64
+						+ Bytes(2, I32),
+						Bytes(1, I32)))});
+	m.memory = 1;
+	auto type = m.type("", Bytes(1, I32));
+	uint32_t address = PATHS;
+	for (int i = 0; i < NUM_PATHS; i++) {
+		Bytes path = paths[i];
+		m.data.push_back({address, path});
+		m.function(type, "", i32_const(DIR_FD) + i32_const(0)
+			+ i32_const(address) + i32_const(path.size())
+			+ i32_const(0) + i64_const(RIGHT_FD_READ)
+			+ i64_const(0) + i32_const(0) + i32_const(8)
+			+ op(INSTR_CALL, 0), "open_" + std::to_string(i));
+		address += path.size();
+	}
+	return m.build();
+}
+
+static void write_file(const std::string &path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	close(fd);
+}
+
+/* nothing outside the preopened directory, however the path gets there */
+static void containment() {
+	char base[] = "/tmp/bearwasm-wasi-XXXXXX";
+	CHECK(mkdtemp(base));
+	std::string root = std::string(base) + "/root";
+	CHECK(!mkdir(root.c_str(), 0755));
+	CHECK(!mkdir((root + "/sub").c_str(), 0755));
+	write_file(root + "/inside");
+	write_file(root + "/sub/file");
+	write_file(std::string(base) + "/outside");
+	CHECK(!symlink("..", (root + "/up").c_str()));
+	CHECK(!symlink("../outside", (root + "/escape").c_str()));
+	CHECK(!symlink("sub", (root + "/down").c_str()));
+
+	int32_t expected[NUM_PATHS] = {
+		WASI_ESUCCESS,
+		WASI_ESUCCESS,
+		WASI_ENOTCAPABLE,
+		WASI_ELOOP,
+		WASI_ESUCCESS,
+		WASI_ENOTCAPABLE,
+		WASI_ENOTCAPABLE,
+	};
+	{
+		WasiContext wasi{{}, {}};
+		CHECK(wasi.preopen(root.c_str(), "/sandbox"));
+		VirtualMachine vm{decode(open_paths())};
+		wasi.attach(vm);
+		vm.init();
+		for (int i = 0; i < NUM_PATHS; i++) {
+			auto name = "open_" + std::to_string(i);
+			CHECK(call(vm, name.c_str()) == EXECUTION_FINISHED);
+			auto result = vm.get_result();
+			/* kernels without openat2() follow no symlink */
+			if (result == WASI_ENOTDIR
+					&& (!strcmp(paths[i], "up/outside")
+					|| !strcmp(paths[i], "down/file")))
+				result = expected[i];
+			if (result != expected[i])
+				fprintf(stderr, "%s: %d, not %d\n", paths[i],
+						result, expected[i]);
+			CHECK(result == expected[i]);
+		}
+	}
+
+	for (auto name : {"/up", "/escape", "/down", "/sub/file", "/inside"})
+		unlink((root + name).c_str());
+	rmdir((root + "/sub").c_str());
+	rmdir(root.c_str());
+	unlink((std::string(base) + "/outside").c_str());
+	rmdir(base);
+}
+
+/* write_N writes the byte at N to fd N, "1" to stdout and "2" to stderr */
+static Bytes write_fds() {
+	ModuleBuilder m;
+	m.imports.push_back({{"wasi_snapshot_preview1", "fd_write"},
+			Bytes(1, '\0') + uleb(m.type(Bytes(4, I32),
+						Bytes(1, I32)))});
+	m.memory = 1;
+	m.data.push_back({1, "12"});
+	auto type = m.type("", Bytes(1, I32));
+	for (uint32_t fd = 1; fd <= 2; fd++) {
+		auto iov = IOVS + 8 * fd;
+		m.data.push_back({iov, Bytes(1, fd) + Bytes(3, '\0')
+				+ Bytes(1, 1) + Bytes(3, '\0')});
+		m.function(type, "", i32_const(fd) + i32_const(iov)
+			+ i32_const(1) + i32_const(16) + op(INSTR_CALL, 0),
+			"write_" + std::to_string(fd));
+	}
+	return m.build();
+}
+
+/* what the guest buffered for stdout goes out before it writes stderr */
+static void ordering() {
+	auto module = decode(write_fds());
+	char path[] = "/tmp/bearwasm-wasi-XXXXXX";
+	int out = mkstemp(path);
+	CHECK(out >= 0);
+	unlink(path);
+	fflush(stdout);
+	fflush(stderr);
+	int saved_stdout = dup(1);
+	int saved_stderr = dup(2);
+	dup2(out, 1);
+	dup2(out, 2);
+	{
+		WasiContext wasi{{}, {}};
+		VirtualMachine vm{module};
+		wasi.attach(vm);
+		vm.init();
+		for (auto name : {"write_1", "write_2", "write_1", "write_2"})
+			call(vm, name);
+	}
+	dup2(saved_stdout, 1);
+	dup2(saved_stderr, 2);
+	close(saved_stdout);
+	close(saved_stderr);
+
+	char written[8] = {};
+	CHECK(pread(out, written, sizeof(written) - 1, 0) == 4);
+	CHECK(!strcmp(written, "1212"));
+	close(out);
+}
+
+int main() {
+	bearwasm_install_fault_handlers();
+	containment();
+	ordering();
+	return failures;
+}